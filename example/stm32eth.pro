@@ -152,6 +152,7 @@ HEADERS += ../../rexos/userspace/core/stm32.h \
     ../../rexos/userspace/udp.h \
     ../../rexos/userspace/so.h \
     ../../rexos/midware/tcpips/tcps.h \
+    ../../rexos/midware/tcpips/tcpcc.h \
     ../../rexos/userspace/tcp.h
 SOURCES += \
 	 ../../rexos/kernel/core/kcortexm.c \
@@ -264,6 +265,7 @@ SOURCES += \
     ../../rexos/userspace/udp.c \
     ../../rexos/userspace/so.c \
     ../../rexos/midware/tcpips/tcps.c \
+    ../../rexos/midware/tcpips/tcpcc.c \
     ../../rexos/userspace/tcp.c
 OTHER_FILES += Makefile \
 	 ../../rexos/kernel/core/startup_cortexm.S \
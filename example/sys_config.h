@@ -124,6 +124,9 @@
 #define WAVEGEN_SQUARE                                      1
 #define WAVEGEN_TRIANGLE                                    0
 #define WAVEGEN_SINE                                        0
+//--------------------------------- GUI ----------------------------------------------
+//dirty regions tracked per canvas. On overflow nearest regions are merged
+#define CANVAS_DIRTY_RECTS_MAX                              4
 //--------------------------------- ETH ----------------------------------------------
 #define ETH_AUTO_NEGOTIATION_TIME                           5000
 
@@ -146,9 +149,17 @@
 #define ARP_DEBUG_FLOW                                      1
 
 #define ARP_CACHE_SIZE_MAX                                  10
+//hash table slots. Power of 2, greater than ARP_CACHE_SIZE_MAX
+#define ARP_HASH_SIZE                                       16
+//frames queued per unresolved address
+#define ARP_PENDING_MAX                                     3
 //in seconds
 #define ARP_CACHE_INCOMPLETE_TIMEOUT                        5
 #define ARP_CACHE_TIMEOUT                                   600
+//request retry interval for unresolved address
+#define ARP_RETRY_INTERVAL                                  1
+//refresh entry in use this time before expiry
+#define ARP_CACHE_REFRESH                                   5
 
 //----------------------------- TCP/IP IP ---------------------------------------------
 #define IP_DEBUG                                            1
@@ -162,9 +173,24 @@
 //must be less TCPIP_MTU * TCPIP_MAX_FRAMES_COUNT
 #define IP_MAX_LONG_SIZE                                    5000
 #define IP_MAX_LONG_PACKETS                                 2
+//RFC 815 reassembly, lookup by (src, dst, id, proto). Power of 2
+#define IP_FRAGMENTATION_HASH_SIZE                          4
+//total size of datagrams in reassembly, oldest is evicted above
+#define IP_FRAGMENTATION_MEM_MAX                            8000
 
 #define IP_FIREWALL                                         1
 
+#define IP_ROUTES_MAX                                       8
+//per-destination next hop cache. Power of 2
+#define IP_ROUTE_CACHE_SIZE                                 4
+
+//RFC 1191 path MTU discovery. Destinations with reduced MTU
+#define IP_PMTU_CACHE_SIZE                                  4
+//try larger MTU after, s
+#define IP_PMTU_TIMEOUT                                     600
+//lowest accepted path MTU, down to 68. At minimum TCP is sent without DF
+#define IP_PMTU_MIN                                         576
+
 //---------------------------- TCP/IP ICMP --------------------------------------------
 #define ICMP                                                1
 #define ICMP_DEBUG                                          1
@@ -183,14 +209,54 @@
 
 #define UDP_DEBUG                                           0
 #define UDP_DEBUG_FLOW                                      0
+//port lookup table size, power of 2
+#define UDP_HASH_SIZE                                       4
+//datagrams, held per socket while no read is queued. Taken from TCPIP_MAX_FRAMES_COUNT, not less than 1
+#define UDP_RX_QUEUE_MAX                                    2
 #define DNSS_DEBUG                                          1
 #define DHCPS_DEBUG                                         1
 
 //----------------------------- TCP/IP TCP --------------------------------------------
 #define TCP_DEBUG                                           1
-#define TCP_RETRY_COUNT                                     3
+//retransmission timeout doubles on every retry
+#define TCP_RETRY_COUNT                                     6
+//keep-alive enabled by default for new connections. Idle and interval in s
 #define TCP_KEEP_ALIVE                                      0
+#define TCP_KEEP_ALIVE_IDLE                                 60
+#define TCP_KEEP_ALIVE_INTERVAL                             10
+#define TCP_KEEP_ALIVE_COUNT                                5
+//RFC 5482 default user timeout, ms. 0 - close after TCP_RETRY_COUNT retries
+#define TCP_USER_TIMEOUT                                    0
 #define TCP_TIMEOUT                                         30000
+//adaptive retransmission timeout bounds, ms (RFC 6298)
+#define TCP_RTO_INITIAL                                     1000
+#define TCP_RTO_MIN                                         200
+#define TCP_RTO_MAX                                         60000
+//segments in flight per connection. Each one holds a frame while queued for tx, so keep less than TCPIP_MAX_FRAMES_COUNT
+#define TCP_TX_SEGMENTS_MAX                                 4
+//future segments, held per connection until hole is filled. Each one holds a frame, total is limited by TCPIP_MAX_FRAMES_COUNT / 2
+#define TCP_OOO_SEGMENTS_MAX                                3
+//receive window scale shift (RFC 7323). Option is always offered, so 0 still allows scaled peer window
+#define TCP_WINDOW_SCALE                                    0
+//selective acknowledgement (RFC 2018)
+#define TCP_SACK                                            1
+//ack delay, ms. Every second segment is acked at once. 0 - don't delay
+#define TCP_DELAYED_ACK_MS                                  100
+//frames, held per connection in zero-copy receive mode. Taken from TCPIP_MAX_FRAMES_COUNT, not less than 1
+#define TCP_ZC_FRAMES_MAX                                   2
+//per connection send buffer, allocated on first write. Keep at least TCP_TX_SEGMENTS_MAX * MSS for full window
+#define TCP_SND_BUF_SIZE                                    6144
+//lookup tables size, power of 2
+#define TCP_HASH_SIZE                                       16
+#define TCP_LISTEN_HASH_SIZE                                4
+//half-open connections per listener, before full TCB is allocated. SYN cookies are used when full
+#define TCP_SYN_BACKLOG                                     4
+#define TCP_SYN_COOKIES                                     1
+#define TCP_SYN_TIMEOUT                                     10000
+//TIME WAIT (2MSL), ms. 0 - don't keep
+#define TCP_TIME_WAIT                                       60000
+//connections in TIME WAIT. Oldest is dropped when full
+#define TCP_TW_MAX                                          8
 //0 - don't limit
 #define TCP_HANDLES_LIMIT                                   10
 //Low-level debug. only for development
@@ -22,6 +22,12 @@
 #define ESP_TO_SEND_DATA        6000
 #define ESP_TO_CONNECT          6000
 #define ESP_TO_LIST             5000
+//parser states. Stalled partial line is dropped, stalled +IPD payload is delivered as is
+#define ESP_TO_RX_LINE          2000
+#define ESP_TO_RX_DATA          500
+
+#define ESP_TIMER_CMD           0
+#define ESP_TIMER_RX            1
 
 #define ESP_FLAGS_Pos           24
 #define ESP_FLAGS_Pos           24
@@ -114,11 +120,13 @@ static inline void esp_set_result(ESP8266* esp, ESP_JOIN_STATE res)
     esp->join_state = res;
 }
 
+static const unsigned int esp_rx_timeouts[ESP_RX_STATE_MAX] = {ESP_TO_RX_LINE, ESP_TO_RX_DATA};
+
 static inline void esp_join(ESP8266* esp);
 static void esp_tcp_close(ESP8266* esp, int num);
 
 
-static inline void esp_rx_io_complete(ESP8266* esp, uint32_t conn)
+static void esp_rx_io_done(ESP8266* esp, uint32_t conn)
 {
     TCP_STACK* tcp_stack;
     ESP_SESSION* session = &esp->sessions[conn];
@@ -139,6 +147,12 @@ static inline void esp_rx_io_complete(ESP8266* esp, uint32_t conn)
         }
         session->rx = NULL;
     }
+}
+
+static inline void esp_rx_io_complete(ESP8266* esp, uint32_t conn)
+{
+    ESP_SESSION* session = &esp->sessions[conn];
+    esp_rx_io_done(esp, conn);
     if(session->rx_buffer != NULL)
     {
         session->rx_buffer_len = 0;
@@ -161,9 +175,10 @@ static void esp_pkt_flush_internal(ESP8266* esp)
 {
     int i;
     esp->req_head = esp->req_tail = 0;
-    if(esp->is_receive)
+    if(esp->rx_state == ESP_RX_DATA)
         esp_rx_io_complete(esp, esp->rx_conn);
-    esp->is_receive = false;
+    esp->rx_state = ESP_RX_LINE;
+    esp->strlen = 0;
     for(i = 0; i < ESP_CONNECT_COUNT; i++)
     {
         esp_tcp_close(esp, i);
@@ -318,12 +333,13 @@ static inline  void esp_chip_open(ESP8266* esp)
 static void init(ESP8266* esp)
 {
     memset(esp, 0, sizeof(ESP8266));
-    esp->timer = timer_create(0, HAL_WIFI);
+    esp->timer = timer_create(ESP_TIMER_CMD, HAL_WIFI);
+    esp->rx_timer = timer_create(ESP_TIMER_RX, HAL_WIFI);
     esp->uart.rx_io1 = io_create(ESP_IO_READ_SIZE);
     esp->uart.rx_io2 = io_create(ESP_IO_READ_SIZE);
     esp->uart.tx_io = io_create(ESP_IO_WRITE_SIZE);
     esp->state = ESP_CLOSE;
-    esp->is_receive = false;
+    esp->rx_state = ESP_RX_LINE;
     esp->join_state = ESP_JOIN_DISCONNECT;
 }
 
@@ -386,7 +402,7 @@ static inline ESP_REPLAY_NUM esp_parse_replay(char* str)
 static inline void esp_tcp_connect(ESP8266* esp, int num) // received num,CONNECT from ESP
 {
     ESP_SESSION* session = &esp->sessions[num];
-    if((num < 0) || (num > ESP_CONNECT_COUNT) )
+    if((num < 0) || (num >= ESP_CONNECT_COUNT) )
             return;
     switch(session->state)
     {
@@ -409,7 +425,7 @@ static void esp_tcp_close(ESP8266* esp, int num)
 #if(ESP_DEBUG_FLOW)
     printf("ESP:close session %u process %x state:%u\n", num, session->process, esp->state);
 #endif //ESP_DEBUG_FLOW
-    if((num < 0) || (num > ESP_CONNECT_COUNT) )
+    if((num < 0) || (num >= ESP_CONNECT_COUNT) )
             return;
 
     esp_rx_io_complete(esp, num);
@@ -546,130 +562,210 @@ static inline void esp_parse_string(ESP8266* esp)
     esp_pkt_send_next(esp);
 }
 
-static inline void esp_received(ESP8266* esp, char c)
+static inline void esp_line_append(ESP8266* esp, const char* data, unsigned int len)
+{
+    unsigned int shift;
+    //line is too long, only tail is valuable
+    if(len > ESP_MAX_STRING - 1)
+    {
+        data += len - (ESP_MAX_STRING - 1);
+        len = ESP_MAX_STRING - 1;
+        esp->strlen = 0;
+    }
+    if(esp->strlen + len > ESP_MAX_STRING - 1)
+    {
+        shift = esp->strlen + len - (ESP_MAX_STRING - 1);
+        memmove(esp->str, esp->str + shift, esp->strlen - shift);
+        esp->strlen -= shift;
+    }
+    memcpy(esp->str + esp->strlen, data, len);
+    esp->strlen += len;
+}
+
+static inline void esp_line_complete(ESP8266* esp)
 {
-    if( (c < ' ') && (c != '\n') && (c != '\r'))
+    if( (esp->strlen <=2) || (esp->str[esp->strlen-1] != '\r') )
     {
         esp->strlen = 0;
         return;
     }
+// received valid string
+    esp->str[esp->strlen-1] = 0;
+    esp_parse_string(esp);
+    esp->strlen = 0;
+}
 
-    if(esp->strlen >= ESP_MAX_STRING-1)
+// line, collected so far with new data, starts with +IPD,
+static inline bool esp_line_is_ipd(ESP8266* esp, const char* data, unsigned int len)
+{
+    unsigned int i;
+    char c;
+    for(i = 0; i < (sizeof(str_DATA)-1); i++)
     {
-        for(int i = 0; i < (ESP_MAX_STRING-10); i++)
-            esp->str[i] = esp->str[i+10];
-        esp->strlen-=10;
+        if(i < esp->strlen)
+            c = esp->str[i];
+        else if(i - esp->strlen < len)
+            c = data[i - esp->strlen];
+        else
+            return false;
+        if(c != str_DATA[i])
+            return false;
     }
+    return true;
+}
 
-    if(c == '\n')
+static void esp_rx_arm(ESP8266* esp)
+{
+    if(esp->rx_timer_active || ((esp->rx_state == ESP_RX_LINE) && (esp->strlen == 0)))
+        return;
+    esp->rx_bytes_armed = esp->rx_bytes;
+    esp->rx_timer_active = true;
+    timer_start_ms(esp->rx_timer, esp_rx_timeouts[esp->rx_state]);
+}
+
+static inline void esp_rx_timeout(ESP8266* esp)
+{
+    esp->rx_timer_active = false;
+    // stream is still moving, check later
+    if(esp->rx_bytes != esp->rx_bytes_armed)
     {
-        if( (esp->strlen <=2) || (esp->str[esp->strlen-1] != '\r') )
-        {
-            esp->strlen = 0;
-            return;
-        }
-// received valid string
-        esp->str[esp->strlen-1] = 0;
-        esp_parse_string(esp);
-        esp->strlen = 0;
-    }else
-        esp->str[esp->strlen++] = c;
+        esp_rx_arm(esp);
+        return;
+    }
+    if(esp->rx_state == ESP_RX_DATA)
+    {
+#if (ESP_DEBUG)
+        printf("ESP: rx timeout session %d, %u byte(s) lost\n", esp->rx_conn, esp->rx_size);
+#endif // ESP_DEBUG
+        esp_rx_io_done(esp, esp->rx_conn);
+    }
+    esp->rx_state = ESP_RX_LINE;
+    esp->strlen = 0;
 }
 
+// +IPD,<conn>,<len> header received
 static inline bool esp_test_rx(ESP8266* esp)
 {
-    int i;
+    int i = sizeof(str_DATA)-1;
     ESP_SESSION* session;
-    uint32_t conn_num;
-    for(i = 0; i< (sizeof(str_DATA)-1); i++)
-        if(str_DATA[i] != esp->str[i])
-            return false;
-
+    uint32_t conn_num, overflow;
+    char* buf;
+    if(esp->strlen < i + 3)
+        return false;
     conn_num = esp->str[i++] - '0';
 #if (ESP_DEBUG_FLOW)
     printf("ESP: test rx session %d\n", conn_num);
 #endif // ESP_DEBUG_FLOW
 
-    if(conn_num > ESP_CONNECT_COUNT)
+    if(conn_num >= ESP_CONNECT_COUNT)
         return false;
     if(esp->str[i++] != ',')
         return false;
     session = &esp->sessions[conn_num];
     esp->rx_size = atou(&esp->str[i], esp->strlen - i);
     esp->rx_conn = conn_num;
-    esp->is_receive = true;
-    if(session->rx ==0)
+    // part, not fit in user IO is buffered till next read
+    esp->rx_reserved = 0;
+    overflow = esp->rx_size;
+    if(session->rx)
+        overflow = (io_get_free(session->rx) >= esp->rx_size) ? 0 : esp->rx_size - io_get_free(session->rx);
+    if(overflow)
     {
-        if(session->rx_buffer)
-            session->rx_buffer = realloc(session->rx_buffer, esp->rx_size);
-        else
-            session->rx_buffer = malloc(esp->rx_size);
-        session->rx_buffer_len = 0;
+        buf = realloc(session->rx_buffer, session->rx_buffer_len + overflow);
+        if(buf == NULL)
+        {
+#if (ESP_DEBUG)
+            printf("ESP: out of memory, session %d\n", conn_num);
+#endif // ESP_DEBUG
+            return true;
+        }
+        session->rx_buffer = buf;
+        esp->rx_reserved = overflow;
     }
     return true;
 }
 
-static inline int esp_rx_receive(ESP8266* esp, IO* io, int pos)
+// payload goes with single copy to user IO, rest - to session buffer
+static inline unsigned int esp_rx_data(ESP8266* esp, const char* data, unsigned int len)
 {
     ESP_SESSION* session = &esp->sessions[esp->rx_conn];
-    IO* rx = session->rx;
-    char* ptr;
-    int chunk = io->data_size - pos;
-    if(chunk > esp->rx_size)
-        chunk = esp->rx_size;
-    esp->rx_size -= chunk;
-#if(ESP_DEBUG_FLOW)
-    printf("chunk:%u io:%u\n", chunk, rx);
-#endif // ESP_DEBUG_FLOW
-    if(esp->rx_size == 0)
-        esp->is_receive = false;
-
-    if(rx == NULL)
+    unsigned int chunk = 0;
+    if(len > esp->rx_size)
+        len = esp->rx_size;
+    if(session->rx != NULL)
     {
-        if(session->rx_buffer == NULL)
-        {
-            session->rx_buffer = malloc(chunk);
-            session->rx_buffer_len = 0;
-        }
-        ptr = session->rx_buffer;
-        memcpy(&ptr[session->rx_buffer_len], io_data(io)+pos, chunk);
-        session->rx_buffer_len += chunk;
-    }else{
-        ptr = io_data(rx);
-        memcpy(&ptr[rx->data_size], io_data(io)+pos, chunk);
-        rx->data_size += chunk;
-        if(esp->rx_size == 0)
-            esp_rx_io_complete(esp, esp->rx_conn);
+        chunk = io_get_free(session->rx);
+        if(chunk > len)
+            chunk = len;
+        memcpy((uint8_t*)io_data(session->rx) + session->rx->data_size, data, chunk);
+        session->rx->data_size += chunk;
     }
-    return chunk;
+    // out of memory on header - rest is lost
+    if(len - chunk > esp->rx_reserved)
+        chunk = len - esp->rx_reserved;
+    if((len > chunk) && (session->rx_buffer != NULL))
+    {
+        memcpy(session->rx_buffer + session->rx_buffer_len, data + chunk, len - chunk);
+        session->rx_buffer_len += len - chunk;
+        esp->rx_reserved -= len - chunk;
+    }
+    esp->rx_size -= len;
+#if(ESP_DEBUG_FLOW)
+    printf("chunk:%u io:%u\n", len, session->rx);
+#endif // ESP_DEBUG_FLOW
+    if((session->rx != NULL) && ((esp->rx_size == 0) || (io_get_free(session->rx) == 0)))
+        esp_rx_io_done(esp, esp->rx_conn);
+    return len;
 }
 
 static inline void uart_rx(ESP8266* esp, IO* io)
 {
-    char* ptr = (char*)io_data(io);
-    char c;
-
-    for(int i = 0; i < io->data_size; i++)
+    const char* ptr = (const char*)io_data(io);
+    const char* end = ptr + io->data_size;
+    const char* eol;
+    const char* colon;
+    unsigned int len;
+    esp->rx_bytes += io->data_size;
+    while(ptr < end)
     {
-        c = ptr[i];
-        if(esp->is_receive)
+        if(esp->rx_state == ESP_RX_DATA)
         {
-            i+=esp_rx_receive(esp, io, i) -1;
-            esp->strlen = 0;
-        }else{
-            if(c == ':') if (esp_test_rx(esp))
-                    continue;
-            if( (esp->state == ESP_TRY_SEND) && (c == ' ') && (esp->str[0] == '>') )
+            ptr += esp_rx_data(esp, ptr, end - ptr);
+            if(esp->rx_size == 0)
             {
-                io_write_exo(HAL_IO_REQ(HAL_UART, IPC_WRITE), esp->uart.port, esp->sessions[esp->tx_conn].tx);
-                esp->strlen = 0;
-                esp->state = ESP_BUSY;
-                continue;
-
+                esp->rx_state = ESP_RX_LINE;
+                if(esp->rx_timer_active)
+                {
+                    timer_stop(esp->rx_timer, ESP_TIMER_RX, HAL_WIFI);
+                    esp->rx_timer_active = false;
+                }
             }
-            esp_received(esp, ptr[i]);
+            continue;
+        }
+        eol = memchr(ptr, '\n', end - ptr);
+        len = (eol ? eol + 1 : end) - ptr;
+        // +IPD header is terminated by ':', not by line end
+        if(esp_line_is_ipd(esp, ptr, len) && ((colon = memchr(ptr, ':', len)) != NULL))
+        {
+            esp_line_append(esp, ptr, colon - ptr);
+            ptr = colon + 1;
+            if(esp_test_rx(esp) && esp->rx_size)
+                esp->rx_state = ESP_RX_DATA;
+            esp->strlen = 0;
+            continue;
+        }
+        esp_line_append(esp, ptr, eol ? len - 1 : len);
+        ptr += len;
+        if(eol)
+            esp_line_complete(esp);
+        else if( (esp->state == ESP_TRY_SEND) && (esp->strlen >= 2) && (esp->str[0] == '>') && (esp->str[1] == ' ') )
+        {
+            io_write_exo(HAL_IO_REQ(HAL_UART, IPC_WRITE), esp->uart.port, esp->sessions[esp->tx_conn].tx);
+            esp->strlen = 0;
+            esp->state = ESP_BUSY;
         }
     }
+    esp_rx_arm(esp);
 }
 
 static inline void esp_uart_tx_complete(ESP8266* esp)
@@ -734,7 +830,7 @@ static inline void esp_listen(ESP8266* esp, IPC* ipc)
 //--------------- TCP requests ----------
 static void esp_close_session(ESP8266* esp, HANDLE conn)
 {
-    if(conn > ESP_CONNECT_COUNT)
+    if(conn >= ESP_CONNECT_COUNT)
     {
         error(ERROR_INVALID_PARAMS);
         return;
@@ -754,7 +850,7 @@ static void esp_open_session(ESP8266* esp, HANDLE conn)
 #if (ESP_DEBUG_FLOW)
     printf("ESP: try to open session %d rx:%x\n", conn, esp->sessions[conn].rx);
 #endif // ESP_DEBUG_FLOW
-    if((conn > ESP_CONNECT_COUNT) && (conn !=0) )  // session 0 - only server, passive listen
+    if((conn >= ESP_CONNECT_COUNT) && (conn !=0) )  // session 0 - only server, passive listen
     {
         error(ERROR_INVALID_PARAMS);
         return;
@@ -789,7 +885,7 @@ static inline void esp_tcp_read(ESP8266* esp, HANDLE handle, IO* io, HANDLE proc
     TCP_STACK* tcp_stack;
     ESP_SESSION* session;
     int chunk;
-    if(handle > ESP_CONNECT_COUNT)
+    if(handle >= ESP_CONNECT_COUNT)
         return;
     session = &esp->sessions[handle];
     io->data_size = io->stack_size = 0;
@@ -822,10 +918,14 @@ static inline void esp_tcp_read(ESP8266* esp, HANDLE handle, IO* io, HANDLE proc
             session->rx_buffer_len -= chunk;
         }else{
             memcpy(io_data(io), session->rx_buffer, session->rx_buffer_len);
-            free(session->rx_buffer);
             io->data_size = session->rx_buffer_len;
             session->rx_buffer_len = 0;
-            session->rx_buffer = NULL;
+            // space is still reserved for +IPD in progress
+            if((esp->rx_state != ESP_RX_DATA) || (esp->rx_conn != handle))
+            {
+                free(session->rx_buffer);
+                session->rx_buffer = NULL;
+            }
         }
         session->rx = NULL;
         error(ERROR_OK);
@@ -848,7 +948,7 @@ static inline void esp_tcp_read(ESP8266* esp, HANDLE handle, IO* io, HANDLE proc
 static inline void esp_tcp_write(ESP8266* esp, uint32_t conn, IO* io, HANDLE process)
 {
     ESP_SESSION* session;
-    if(conn > ESP_CONNECT_COUNT)
+    if(conn >= ESP_CONNECT_COUNT)
         return;
 #if (ESP_DEBUG)
     printf("ESP: tx req %d size:%u\n", conn, io->data_size);
@@ -920,7 +1020,10 @@ static void wifi_request(ESP8266* esp, IPC* ipc)
         esp_close(esp);
         break;
     case IPC_TIMEOUT:
-        esp_timeout(esp);
+        if(ipc->param1 == ESP_TIMER_RX)
+            esp_rx_timeout(esp);
+        else
+            esp_timeout(esp);
         break;
     case IPC_CREATE_TCB:
         esp_create_text_tcb(esp, (IO*)ipc->param2, ipc->param3, ipc->process);
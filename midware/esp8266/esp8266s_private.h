@@ -48,6 +48,12 @@ typedef struct {
     char* remote_host;
 }ESP_SESSION;
 
+typedef enum{
+    ESP_RX_LINE = 0,
+    ESP_RX_DATA,
+    ESP_RX_STATE_MAX
+}ESP_RX_STATE;
+
 typedef struct {
     ESP_REQ_TYPE type;
     uint32_t  param;
@@ -56,6 +62,7 @@ typedef struct {
 
 typedef struct _ESP8266{
     HANDLE timer;
+    HANDLE rx_timer;
     HANDLE process;
     ESP_STATE state;
     ESP_JOIN_STATE join_state;
@@ -65,7 +72,11 @@ typedef struct _ESP8266{
     uint32_t req_tail;
     ESP_SESSION sessions[ESP_CONNECT_COUNT];
     uint32_t rx_conn;   // current rx session  +IPD
-    bool is_receive;    //
+    ESP_RX_STATE rx_state;
+    bool rx_timer_active;
+    uint32_t rx_bytes;  // total received from uart
+    uint32_t rx_bytes_armed;
+    uint32_t rx_reserved; // space left in session rx_buffer for current +IPD
     uint32_t tx_conn;   // current tx session
     uint32_t rx_size;   // rest to receive
     char str[ESP_MAX_STRING+1];
@@ -11,26 +11,28 @@
 #include "../../userspace/error.h"
 #include "macs.h"
 #include "ips.h"
+#include "icmps.h"
+#include <string.h>
 
-#define ARP_CACHE_ITEM(tcpips, i)                    ((ARP_CACHE_ENTRY*)array_at((tcpips)->arps.cache, i))
-
-typedef struct {
-    IP ip;
-    //zero MAC means unresolved yet
-    MAC mac;
-    //time to live. Zero means static ARP
-    unsigned int ttl;
-} ARP_CACHE_ENTRY;
+#define ARP_HASH_MASK                               (ARP_HASH_SIZE - 1)
+#define ARP_CACHE_ITEM(tcpips, i)                   (&(tcpips)->arps.cache[(i)])
 
 static const MAC __MAC_BROADCAST =                  {{0xff, 0xff, 0xff, 0xff, 0xff, 0xff}};
 static const MAC __MAC_REQUEST =                    {{0x00, 0x00, 0x00, 0x00, 0x00, 0x00}};
 
 void arps_init(TCPIPS* tcpips)
 {
-    array_create(&tcpips->arps.cache, sizeof(ARP_CACHE_ENTRY), 1);
+    unsigned int i;
+    for (i = 0; i < ARP_HASH_SIZE; ++i)
+    {
+        ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip = 0;
+        ARP_CACHE_ITEM(tcpips, i)->pending_count = 0;
+    }
+    tcpips->arps.count = 0;
 }
 
-static void arps_cmd_request(TCPIPS* tcpips, const IP* ip)
+//broadcast for resolve, unicast for refresh
+static void arps_cmd_request(TCPIPS* tcpips, const IP* ip, const MAC* dst)
 {
 #if (ARP_DEBUG_FLOW)
     printf("ARP: request to ");
@@ -61,7 +63,7 @@ static void arps_cmd_request(TCPIPS* tcpips, const IP* ip)
     arp->dst_ip.u32.ip = ip->u32.ip;
 
     io->data_size = sizeof(ARP_PACKET);
-    macs_tx(tcpips, io, &__MAC_BROADCAST, ETHERTYPE_ARP);
+    macs_tx(tcpips, io, dst, ETHERTYPE_ARP);
 }
 
 static inline void arps_cmd_reply(TCPIPS* tcpips, MAC* mac, IP* ip)
@@ -100,75 +102,104 @@ static inline void arps_cmd_reply(TCPIPS* tcpips, MAC* mac, IP* ip)
     macs_tx(tcpips, io, mac, ETHERTYPE_ARP);
 }
 
-static int arps_index(TCPIPS* tcpips, const IP* ip)
+static inline unsigned int arps_hash(const IP* ip)
 {
-    int i;
-    for (i = 0; i < array_size(tcpips->arps.cache); ++i)
+    uint32_t hash = ip->u32.ip * 0x9e3779b1;
+    return (hash >> 16) & ARP_HASH_MASK;
+}
+
+static ARP_CACHE_ENTRY* arps_find(TCPIPS* tcpips, const IP* ip)
+{
+    unsigned int i;
+    for (i = arps_hash(ip); ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip; i = (i + 1) & ARP_HASH_MASK)
     {
         if (ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip == ip->u32.ip)
-            return i;
+            return ARP_CACHE_ITEM(tcpips, i);
     }
-    return -1;
+    return NULL;
 }
 
-static void arps_remove_item(TCPIPS* tcpips, int idx)
+static void arps_remove_item(TCPIPS* tcpips, ARP_CACHE_ENTRY* arp)
 {
+    unsigned int i, j, pending_count;
+    IO* pending[ARP_PENDING_MAX];
     IP ip;
-    ip.u32.ip = 0;
-    if (mac_compare(&ARP_CACHE_ITEM(tcpips, idx)->mac, &__MAC_REQUEST))
-        ip.u32.ip = ARP_CACHE_ITEM(tcpips, idx)->ip.u32.ip;
+    ip.u32.ip = arp->ip.u32.ip;
+    pending_count = arp->pending_count;
+    for (i = 0; i < pending_count; ++i)
+        pending[i] = arp->pending[i];
 #if (ARP_DEBUG)
-    else
+    if (!mac_compare(&arp->mac, &__MAC_REQUEST))
     {
         printf("ARP: route to ");
-        ip_print(&ARP_CACHE_ITEM(tcpips, idx)->ip);
+        ip_print(&ip);
         printf(" removed\n");
     }
 #endif
-    array_remove(&tcpips->arps.cache, idx);
-
-    //inform route on incomplete ARP if not resolved
-    if (ip.u32.ip)
-        routes_not_resolved(tcpips, &ip);
-}
-
-static void arps_insert_item(TCPIPS* tcpips, const IP* ip, const MAC* mac, unsigned int timeout)
-{
-    int i, idx;
-    unsigned int ttl;
-    //don't add dups
-    if (arps_index(tcpips, ip) >= 0)
-        return;
-    //remove first non-static if no place
-    if (array_size(tcpips->arps.cache) == ARP_CACHE_SIZE_MAX)
+    //backward shift, so probe chains are never broken
+    i = arp - tcpips->arps.cache;
+    for (j = (i + 1) & ARP_HASH_MASK; ARP_CACHE_ITEM(tcpips, j)->ip.u32.ip; j = (j + 1) & ARP_HASH_MASK)
     {
-        //first is static, can't remove
-        if (ARP_CACHE_ITEM(tcpips, 0)->ttl == 0)
-            return;
-        arps_remove_item(tcpips, 0);
+        //move back, if free slot is between home slot and current
+        if (((j - arps_hash(&ARP_CACHE_ITEM(tcpips, j)->ip)) & ARP_HASH_MASK) >= ((j - i) & ARP_HASH_MASK))
+        {
+            *ARP_CACHE_ITEM(tcpips, i) = *ARP_CACHE_ITEM(tcpips, j);
+            i = j;
+        }
     }
-    idx = array_size(tcpips->arps.cache);
-    ttl = 0;
-    //add all static routes to the end of cache
-    if (timeout)
+    ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip = 0;
+    ARP_CACHE_ITEM(tcpips, i)->pending_count = 0;
+    --tcpips->arps.count;
+
+    //drop frames of incomplete ARP after entry is gone - upper layer can tx in return
+    for (i = 0; i < pending_count; ++i)
     {
-        ttl = tcpips->seconds + timeout;
-        for (i = 0; i < array_size(tcpips->arps.cache); ++i)
-            if ((ARP_CACHE_ITEM(tcpips, i)->ttl > ttl) || (ARP_CACHE_ITEM(tcpips, i)->ttl == 0))
-            {
-                idx = i;
-                break;
-            }
+#if (ICMP)
+        icmps_no_route(tcpips, pending[i]);
+#endif //ICMP
+        tcpips_release_io(tcpips, pending[i]);
     }
-    if (array_insert(&tcpips->arps.cache, idx))
+}
+
+//least recently used non-static
+static bool arps_evict(TCPIPS* tcpips)
+{
+    unsigned int i;
+    ARP_CACHE_ENTRY* arp = NULL;
+    for (i = 0; i < ARP_HASH_SIZE; ++i)
     {
-        ARP_CACHE_ITEM(tcpips, idx)->ip.u32.ip = ip->u32.ip;
-        ARP_CACHE_ITEM(tcpips, idx)->mac.u32.hi = mac->u32.hi;
-        ARP_CACHE_ITEM(tcpips, idx)->mac.u32.lo = mac->u32.lo;
-        ARP_CACHE_ITEM(tcpips, idx)->ttl = ttl;
+        if (ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip == 0 || ARP_CACHE_ITEM(tcpips, i)->ttl == 0)
+            continue;
+        if (arp == NULL || (int)(ARP_CACHE_ITEM(tcpips, i)->used - arp->used) < 0)
+            arp = ARP_CACHE_ITEM(tcpips, i);
     }
+    if (arp == NULL)
+        return false;
+    arps_remove_item(tcpips, arp);
+    return true;
+}
+
+static ARP_CACHE_ENTRY* arps_insert_item(TCPIPS* tcpips, const IP* ip, const MAC* mac, unsigned int timeout)
+{
+    unsigned int i;
+    ARP_CACHE_ENTRY* arp;
+    //don't add dups
+    if ((arp = arps_find(tcpips, ip)) != NULL)
+        return arp;
+    if (tcpips->arps.count >= ARP_CACHE_SIZE_MAX && !arps_evict(tcpips))
+        return NULL;
+    for (i = arps_hash(ip); ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip; i = (i + 1) & ARP_HASH_MASK) {}
+    arp = ARP_CACHE_ITEM(tcpips, i);
+    arp->ip.u32.ip = ip->u32.ip;
+    arp->mac.u32.hi = mac->u32.hi;
+    arp->mac.u32.lo = mac->u32.lo;
+    //static routes has zero ttl
+    arp->ttl = timeout ? tcpips->seconds + timeout : 0;
+    arp->used = arp->requested = tcpips->seconds;
+    arp->pending_count = 0;
+    ++tcpips->arps.count;
 #if (ARP_DEBUG)
-    if (mac->u32.hi && mac->u32.lo)
+    if (!mac_compare(mac, &__MAC_REQUEST))
     {
         printf("ARP: route added ");
         ip_print(ip);
@@ -177,95 +208,127 @@ static void arps_insert_item(TCPIPS* tcpips, const IP* ip, const MAC* mac, unsig
         printf("\n");
     }
 #endif
+    return arp;
 }
 
-static void arps_update_item(TCPIPS* tcpips, const IP* ip, const MAC* mac)
+static void arps_update_item(TCPIPS* tcpips, ARP_CACHE_ENTRY* arp, const MAC* mac)
 {
-    int idx = arps_index(tcpips, ip);
-    if (idx < 0)
-        return;
-    ARP_CACHE_ITEM(tcpips, idx)->mac.u32.hi = mac->u32.hi;
-    ARP_CACHE_ITEM(tcpips, idx)->mac.u32.lo = mac->u32.lo;
-    ARP_CACHE_ITEM(tcpips, idx)->ttl = tcpips->seconds + ARP_CACHE_TIMEOUT;
+    unsigned int i;
+    arp->mac.u32.hi = mac->u32.hi;
+    arp->mac.u32.lo = mac->u32.lo;
+    arp->ttl = tcpips->seconds + ARP_CACHE_TIMEOUT;
 #if (ARP_DEBUG)
-    printf("ARP: route resolved ");
-    ip_print(ip);
-    printf(" -> ");
-    mac_print(mac);
-    printf("\n");
-#endif
-}
-
-static bool arps_lookup(TCPIPS* tcpips, const IP* ip, MAC* mac)
-{
-    int idx = arps_index(tcpips, ip);
-    if (idx >= 0)
+    if (arp->pending_count)
     {
-        mac->u32.hi = ARP_CACHE_ITEM(tcpips, idx)->mac.u32.hi;
-        mac->u32.lo = ARP_CACHE_ITEM(tcpips, idx)->mac.u32.lo;
-        return true;
+        printf("ARP: route resolved ");
+        ip_print(&arp->ip);
+        printf(" -> ");
+        mac_print(mac);
+        printf("\n");
     }
-    mac->u32.hi = 0;
-    mac->u32.lo = 0;
-    return false;
+#endif
+    //forward queued to MAC
+    for (i = 0; i < arp->pending_count; ++i)
+        macs_tx(tcpips, arp->pending[i], mac, ETHERTYPE_IP);
+    arp->pending_count = 0;
 }
 
 void arps_link_changed(TCPIPS* tcpips, bool link)
 {
+    unsigned int i;
     if (link)
     {
         //announce IP
         if (tcpips->ips.ip.u32.ip)
-            arps_cmd_request(tcpips, &tcpips->ips.ip);
+            arps_cmd_request(tcpips, &tcpips->ips.ip, &__MAC_BROADCAST);
     }
     else
     {
-        //flush ARP cache, except static routes
-        while (array_size(tcpips->arps.cache) && ARP_CACHE_ITEM(tcpips, 0)->ttl)
-            arps_remove_item(tcpips, 0);
+        //flush ARP cache, except static routes. Removed slot is refilled by shift, check it again
+        for (i = 0; i < ARP_HASH_SIZE; )
+        {
+            if (ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip && ARP_CACHE_ITEM(tcpips, i)->ttl)
+                arps_remove_item(tcpips, ARP_CACHE_ITEM(tcpips, i));
+            else
+                ++i;
+        }
     }
 }
 
 void arps_timer(TCPIPS* tcpips, unsigned int seconds)
 {
-    while (array_size(tcpips->arps.cache) && ARP_CACHE_ITEM(tcpips, 0)->ttl && (ARP_CACHE_ITEM(tcpips, 0)->ttl <= seconds))
-        arps_remove_item(tcpips, 0);
+    unsigned int i;
+    ARP_CACHE_ENTRY* arp;
+    for (i = 0; i < ARP_HASH_SIZE; ++i)
+    {
+        arp = ARP_CACHE_ITEM(tcpips, i);
+        if (arp->ip.u32.ip == 0 || arp->ttl == 0)
+            continue;
+        if (arp->ttl <= seconds)
+        {
+            arps_remove_item(tcpips, arp);
+            //slot is refilled by shift
+            --i;
+            continue;
+        }
+        if (seconds - arp->requested < ARP_RETRY_INTERVAL)
+            continue;
+        if (mac_compare(&arp->mac, &__MAC_REQUEST))
+        {
+            //retry with rate limit
+            arp->requested = seconds;
+            arps_cmd_request(tcpips, &arp->ip, &__MAC_BROADCAST);
+        }
+        //refresh entry in use before expiry, so active flow is never stalled on resolve
+        else if ((arp->ttl - seconds <= ARP_CACHE_REFRESH) && (seconds - arp->used <= ARP_CACHE_REFRESH))
+        {
+            arp->requested = seconds;
+            arps_cmd_request(tcpips, &arp->ip, &arp->mac);
+        }
+    }
 }
 
 static inline void arps_add_static(TCPIPS* tcpips, IPC* ipc)
 {
     IP ip;
     MAC mac;
-    int idx;
     ip.u32.ip = ipc->param1;
     mac.u32.hi = ipc->param2;
     mac.u32.lo = ipc->param3;
-    idx = arps_index(tcpips, &ip);
-    if (idx >= 0)
+    if (arps_find(tcpips, &ip) != NULL)
     {
         error(ERROR_ALREADY_CONFIGURED);
         return;
     }
-    arps_insert_item(tcpips, &ip, &mac, 0);
+    if (arps_insert_item(tcpips, &ip, &mac, 0) == NULL)
+    {
+        error(ERROR_TOO_MANY_HANDLES);
+        return;
+    }
     ipc->param2 = 0;
 }
 
 static inline void arps_remove(TCPIPS* tcpips, IP* ip)
 {
-    int idx;
-    idx = arps_index(tcpips, ip);
-    if (idx < 0)
+    ARP_CACHE_ENTRY* arp = arps_find(tcpips, ip);
+    if (arp == NULL)
     {
         error(ERROR_ALREADY_CONFIGURED);
         return;
     }
-    arps_remove_item(tcpips, idx);
+    arps_remove_item(tcpips, arp);
 }
 
 static void arps_flush(TCPIPS* tcpips)
 {
-    while (array_size(tcpips->arps.cache))
-        arps_remove_item(tcpips, 0);
+    unsigned int i;
+    for (i = 0; i < ARP_HASH_SIZE; )
+    {
+        if (ARP_CACHE_ITEM(tcpips, i)->ip.u32.ip)
+            arps_remove_item(tcpips, ARP_CACHE_ITEM(tcpips, i));
+        else
+            ++i;
+    }
 }
 
 #if (ARP_DEBUG)
@@ -273,16 +336,18 @@ static inline void arps_show_table(TCPIPS* tcpips)
 {
     int i;
     ARP_CACHE_ENTRY* arp;
-    if (array_size(tcpips->arps.cache) == 0)
+    if (tcpips->arps.count == 0)
     {
         printf("ARP: table is empty\n");
         return;
     }
     printf("       IP             MAC          TTL\n");
     printf("-----------------------------------------\n");
-    for (i = 0; i < array_size(tcpips->arps.cache); ++i)
+    for (i = 0; i < ARP_HASH_SIZE; ++i)
     {
         arp = ARP_CACHE_ITEM(tcpips, i);
+        if (arp->ip.u32.ip == 0)
+            continue;
         printf("  ");
         ip_print(&arp->ip);
         printf("  ");
@@ -328,6 +393,7 @@ void arps_request(TCPIPS* tcpips, IPC* ipc)
 
 void arps_rx(TCPIPS* tcpips, IO *io)
 {
+    ARP_CACHE_ENTRY* arp_item;
     ARP_PACKET* arp = io_data(io);
     if (io->data_size < sizeof(ARP_PACKET))
     {
@@ -339,6 +405,25 @@ void arps_rx(TCPIPS* tcpips, IO *io)
         tcpips_release_io(tcpips, io);
         return;
     }
+    //probe, sender has no address yet
+    if (arp->src_ip.u32.ip == 0)
+    {
+        tcpips_release_io(tcpips, io);
+        return;
+    }
+    //RFC 826: update sender, if already known. Static routes are never updated
+    arp_item = arps_find(tcpips, &arp->src_ip);
+    if (arp_item != NULL && arp_item->ttl)
+    {
+#if (ARP_DEBUG_FLOW)
+        printf("ARP: update from ");
+        ip_print(&arp->src_ip);
+        printf(" is ");
+        mac_print(&arp->src_mac);
+        printf("\n");
+#endif
+        arps_update_item(tcpips, arp_item, &arp->src_mac);
+    }
     switch (be2short(arp->op_be))
     {
     case ARP_REQUEST:
@@ -354,34 +439,67 @@ void arps_rx(TCPIPS* tcpips, IO *io)
         break;
     case ARP_REPLY:
         if (mac_compare(&tcpips->macs.mac, &arp->dst_mac))
-        {
-            arps_update_item(tcpips, &arp->src_ip, &arp->src_mac);
-            routes_resolved(tcpips, &arp->src_ip, &arp->src_mac);
-#if (ARP_DEBUG_FLOW)
-            printf("ARP: reply from ");
-            ip_print(&arp->src_ip);
-            printf(" is ");
-            mac_print(&arp->src_mac);
-            printf("\n");
-#endif
-        }
+            arps_insert_item(tcpips, &arp->src_ip, &arp->src_mac, ARP_CACHE_TIMEOUT);
         break;
     }
     tcpips_release_io(tcpips, io);
 }
 
-bool arps_resolve(TCPIPS* tcpips, const IP* ip, MAC* mac)
+bool arps_resolve(TCPIPS* tcpips, IO* io, const IP* ip, MAC* mac)
 {
+    ARP_CACHE_ENTRY* arp;
     if (ip->u32.ip == BROADCAST)
     {
         mac->u32.lo = __MAC_BROADCAST.u32.lo;
         mac->u32.hi = __MAC_BROADCAST.u32.hi;
         return true;
     }
-    if (arps_lookup(tcpips, ip, mac))
+    arp = arps_find(tcpips, ip);
+    if (arp != NULL && !mac_compare(&arp->mac, &__MAC_REQUEST))
+    {
+        arp->used = tcpips->seconds;
+        mac->u32.hi = arp->mac.u32.hi;
+        mac->u32.lo = arp->mac.u32.lo;
         return true;
-    //request mac
-    arps_insert_item(tcpips, ip, &__MAC_REQUEST, ARP_CACHE_INCOMPLETE_TIMEOUT);
-    arps_cmd_request(tcpips, ip);
+    }
+    if (arp == NULL)
+    {
+        //request mac
+        if ((arp = arps_insert_item(tcpips, ip, &__MAC_REQUEST, ARP_CACHE_INCOMPLETE_TIMEOUT)) == NULL)
+        {
+#if (ICMP)
+            icmps_no_route(tcpips, io);
+#endif //ICMP
+            tcpips_release_io(tcpips, io);
+            return false;
+        }
+        arps_cmd_request(tcpips, ip, &__MAC_BROADCAST);
+    }
+    //queue before address is resolved. Oldest is dropped on overflow
+    if (arp->pending_count == ARP_PENDING_MAX)
+    {
+        tcpips_release_io(tcpips, arp->pending[0]);
+        memmove(arp->pending, arp->pending + 1, (ARP_PENDING_MAX - 1) * sizeof(IO*));
+        --arp->pending_count;
+    }
+    arp->pending[arp->pending_count++] = io;
+    return false;
+}
+
+bool arps_drop(TCPIPS* tcpips)
+{
+    unsigned int i;
+    ARP_CACHE_ENTRY* arp;
+    for (i = 0; i < ARP_HASH_SIZE; ++i)
+    {
+        arp = ARP_CACHE_ITEM(tcpips, i);
+        if (arp->ip.u32.ip && arp->pending_count)
+        {
+            tcpips_release_io(tcpips, arp->pending[0]);
+            memmove(arp->pending, arp->pending + 1, (arp->pending_count - 1) * sizeof(IO*));
+            --arp->pending_count;
+            return true;
+        }
+    }
     return false;
 }
@@ -9,7 +9,6 @@
 
 #include "tcpips.h"
 #include "../../userspace/eth.h"
-#include "../../userspace/array.h"
 #include "../../userspace/ipc.h"
 #include "../../userspace/arp.h"
 #include <stdint.h>
@@ -40,7 +39,23 @@ typedef struct {
 #define RARP_REPLY                      4
 
 typedef struct {
-    ARRAY* cache;
+    //zero IP means free slot
+    IP ip;
+    //zero MAC means unresolved yet
+    MAC mac;
+    //time to live. Zero means static ARP
+    unsigned int ttl;
+    //last use and last request time, for LRU and retry rate limit
+    unsigned int used, requested;
+    //frames, waiting for resolve
+    unsigned int pending_count;
+    IO* pending[ARP_PENDING_MAX];
+} ARP_CACHE_ENTRY;
+
+typedef struct {
+    //open addressed, linear probing
+    ARP_CACHE_ENTRY cache[ARP_HASH_SIZE];
+    unsigned int count;
 } ARPS;
 
 //from tcpip
@@ -52,7 +67,9 @@ void arps_request(TCPIPS* tcpips, IPC* ipc);
 //from mac
 void arps_rx(TCPIPS* tcpips, IO* io);
 
-//from route. If false returned, sender must queue request for asynchronous answer
-bool arps_resolve(TCPIPS* tcpips, const IP* ip, MAC* mac);
+//from route. If false returned, io is queued until address is resolved
+bool arps_resolve(TCPIPS* tcpips, IO* io, const IP* ip, MAC* mac);
+//from tcpip on low memory. Drop first queued frame
+bool arps_drop(TCPIPS* tcpips);
 
 #endif // ARPS_H
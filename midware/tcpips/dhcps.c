@@ -5,6 +5,7 @@
 #include "endian.h"
 #include "udp.h"
 #include "arp.h"
+#include "dhcp.h"
 
 #include "ip.h"
 #include "mac.h"
@@ -27,52 +28,225 @@
                                    DHCP_OPTION_ROUTER |     \
                                    DHCP_OPTION_SUBNETMASK)
 
+#define DHCP_LEASE_FREE             0
+#define DHCP_LEASE_OFFERED          1
+#define DHCP_LEASE_BOUND            2
+//released or expired. Client is remembered and gets same address, until it's allocated to other one
+#define DHCP_LEASE_EXPIRED          3
+#define DHCP_LEASE_DECLINED         4
+
+#define DHCP_LEASE_NONE             0xff
+#define DHCP_HASH_MASK              (DHCP_HASH_SIZE - 1)
+
 //------- pool procedures -----
-static void dhcp_init_pool(DHCP_POOL* pool, IP* start_ip)
+static inline unsigned int dhcps_mac_hash(const MAC* mac)
+{
+    uint32_t hash = (mac->u32.hi ^ mac->u32.lo) * 0x9e3779b1;
+    return (hash >> 16) & DHCP_HASH_MASK;
+}
+
+static inline bool dhcps_linked(DHCP_LEASE* lease)
+{
+    return (lease->state != DHCP_LEASE_FREE) && (lease->state != DHCP_LEASE_DECLINED);
+}
+
+static inline void dhcps_set_free(TCPIPS* tcpips, unsigned int idx)
+{
+    tcpips->dhcps.free[idx >> 5] |= 1u << (idx & 31);
+}
+
+static inline void dhcps_clear_free(TCPIPS* tcpips, unsigned int idx)
+{
+    tcpips->dhcps.free[idx >> 5] &= ~(1u << (idx & 31));
+}
+
+static inline bool dhcps_is_free(TCPIPS* tcpips, unsigned int idx)
+{
+    return (tcpips->dhcps.free[idx >> 5] & (1u << (idx & 31))) != 0;
+}
+
+static inline uint32_t dhcps_ip(TCPIPS* tcpips, unsigned int idx)
+{
+    return HTONL(HTONL(tcpips->dhcps.first.u32.ip) + idx);
+}
+
+static unsigned int dhcps_index(TCPIPS* tcpips, uint32_t ip)
+{
+    unsigned int idx = HTONL(ip) - HTONL(tcpips->dhcps.first.u32.ip);
+    if ((tcpips->dhcps.first.u32.ip == 0) || (idx >= DHCP_POOL_SIZE))
+        return DHCP_LEASE_NONE;
+    return idx;
+}
+
+static unsigned int dhcps_find(TCPIPS* tcpips, const MAC* mac)
 {
-    uint32_t i;
-    for (i = DHCP_POOL_SIZE; i > 0; pool++, i--)
+    unsigned int idx;
+    DHCP_LEASE* lease;
+    for (idx = tcpips->dhcps.mac_hash[dhcps_mac_hash(mac)]; idx != DHCP_LEASE_NONE; idx = lease->next)
     {
-        pool->mac.u32.hi = pool->mac.u32.lo = 0;
-        pool->ip.u32.ip = start_ip->u32.ip + ((i-1) << 24);
+        lease = &tcpips->dhcps.leases[idx];
+        if ((lease->mac.u32.hi == mac->u32.hi) && (lease->mac.u32.lo == mac->u32.lo))
+            return idx;
     }
+    return DHCP_LEASE_NONE;
+}
+
+static void dhcps_link(TCPIPS* tcpips, unsigned int idx, const MAC* mac)
+{
+    unsigned int hash = dhcps_mac_hash(mac);
+    DHCP_LEASE* lease = &tcpips->dhcps.leases[idx];
+    lease->mac.u32.hi = mac->u32.hi;
+    lease->mac.u32.lo = mac->u32.lo;
+    lease->next = tcpips->dhcps.mac_hash[hash];
+    tcpips->dhcps.mac_hash[hash] = idx;
+}
+
+static void dhcps_unlink(TCPIPS* tcpips, unsigned int idx)
+{
+    uint8_t* cur;
+    DHCP_LEASE* lease = &tcpips->dhcps.leases[idx];
+    for (cur = &tcpips->dhcps.mac_hash[dhcps_mac_hash(&lease->mac)]; *cur != DHCP_LEASE_NONE; cur = &tcpips->dhcps.leases[*cur].next)
+    {
+        if (*cur == idx)
+        {
+            *cur = lease->next;
+            break;
+        }
+    }
+    lease->mac.u32.hi = lease->mac.u32.lo = 0;
+}
+
+static void dhcps_set_expire(TCPIPS* tcpips, unsigned int idx, unsigned int seconds)
+{
+    tcpips->dhcps.leases[idx].expire = tcpips->seconds + seconds;
+    if (tcpips->dhcps.leases[idx].expire < tcpips->dhcps.expire)
+        tcpips->dhcps.expire = tcpips->dhcps.leases[idx].expire;
+}
+
+//free address, searched from cursor. Remembered expired client is forgotten
+static unsigned int dhcps_allocate(TCPIPS* tcpips)
+{
+    unsigned int i, word, idx;
+    uint32_t bits;
+    idx = tcpips->dhcps.cursor;
+    for (i = 0; i <= (DHCP_POOL_SIZE + 31) / 32; ++i)
+    {
+        word = idx >> 5;
+        bits = tcpips->dhcps.free[word] & (0xffffffff << (idx & 31));
+        if (bits)
+        {
+            idx = (word << 5) + __builtin_ctz(bits);
+            tcpips->dhcps.cursor = idx + 1 < DHCP_POOL_SIZE ? idx + 1 : 0;
+            if (dhcps_linked(&tcpips->dhcps.leases[idx]))
+                dhcps_unlink(tcpips, idx);
+            return idx;
+        }
+        idx = (word + 1) << 5;
+        if (idx >= DHCP_POOL_SIZE)
+            idx = 0;
+    }
+    return DHCP_LEASE_NONE;
+}
+
+static void dhcps_notify(TCPIPS* tcpips, unsigned int idx, unsigned int seconds)
+{
+    if (tcpips->app != INVALID_HANDLE)
+        ipc_post_inline(tcpips->app, HAL_CMD(HAL_DHCPS, DHCPS_LEASE_CHANGED), dhcps_ip(tcpips, idx), seconds, 0);
 }
 
-static uint32_t dhcp_get_ip(DHCP_POOL* pool, MAC* mac, bool is_assign)
+static void dhcps_bind(TCPIPS* tcpips, unsigned int idx, unsigned int seconds)
 {
-    uint32_t i;
-    uint32_t prom_ip = 0;
-    DHCP_POOL* void_entry;
+    dhcps_clear_free(tcpips, idx);
+    tcpips->dhcps.leases[idx].state = DHCP_LEASE_BOUND;
+    dhcps_set_expire(tcpips, idx, seconds);
+    dhcps_notify(tcpips, idx, seconds);
+}
+
+static void dhcps_forget(TCPIPS* tcpips, unsigned int idx)
+{
+    if (tcpips->dhcps.leases[idx].state == DHCP_LEASE_BOUND)
+        dhcps_notify(tcpips, idx, 0);
+    dhcps_unlink(tcpips, idx);
+    tcpips->dhcps.leases[idx].state = DHCP_LEASE_FREE;
+    dhcps_set_free(tcpips, idx);
+}
+
+static void dhcps_expire(TCPIPS* tcpips, unsigned int idx)
+{
+    DHCP_LEASE* lease = &tcpips->dhcps.leases[idx];
+    if (lease->state == DHCP_LEASE_BOUND)
+        dhcps_notify(tcpips, idx, 0);
+    lease->state = lease->state == DHCP_LEASE_DECLINED ? DHCP_LEASE_FREE : DHCP_LEASE_EXPIRED;
+    dhcps_set_free(tcpips, idx);
+}
+
+static uint32_t dhcps_offer(TCPIPS* tcpips, const MAC* mac, uint32_t requested)
+{
+    unsigned int idx;
+    DHCP_LEASE* lease;
     if ((mac->u32.hi == 0) && (mac->u32.lo == 0))
         return 0;
-    for (i = DHCP_POOL_SIZE; i > 0; pool++, i--)
+    if (tcpips->dhcps.first.u32.ip == 0)
+        return 0;
+    //previous address of client, then requested, then any free
+    if ((idx = dhcps_find(tcpips, mac)) == DHCP_LEASE_NONE)
     {
-        if ((mac->u32.hi == pool->mac.u32.hi) && (mac->u32.lo == pool->mac.u32.lo))
-            return pool->ip.u32.ip;
-        if ((pool->mac.u32.hi == 0) && (pool->mac.u32.lo == 0))
+        idx = dhcps_index(tcpips, requested);
+        if ((idx != DHCP_LEASE_NONE) && dhcps_is_free(tcpips, idx))
         {
-            prom_ip = pool->ip.u32.ip;
-            void_entry = pool;
+            if (dhcps_linked(&tcpips->dhcps.leases[idx]))
+                dhcps_unlink(tcpips, idx);
         }
-
+        else if ((idx = dhcps_allocate(tcpips)) == DHCP_LEASE_NONE)
+            return 0;
+        dhcps_link(tcpips, idx, mac);
     }
-    if (prom_ip && is_assign)
+    lease = &tcpips->dhcps.leases[idx];
+    if (lease->state != DHCP_LEASE_BOUND)
     {
-        void_entry->mac.u32.hi = mac->u32.hi;
-        void_entry->mac.u32.lo = mac->u32.lo;
+        dhcps_clear_free(tcpips, idx);
+        lease->state = DHCP_LEASE_OFFERED;
+        dhcps_set_expire(tcpips, idx, DHCP_OFFER_TIME);
     }
-    return prom_ip;
+    return dhcps_ip(tcpips, idx);
 }
 
-static void dhcp_release_ip(DHCP_POOL* pool, MAC* mac)
+//address is client's own or unused. Restoring of saved leases
+static unsigned int dhcps_claim(TCPIPS* tcpips, const MAC* mac, uint32_t ip)
 {
-    uint32_t i;
-    for (i = 0; i < DHCP_POOL_SIZE; pool++, i++)
+    unsigned int idx, own;
+    if ((idx = dhcps_index(tcpips, ip)) == DHCP_LEASE_NONE)
+        return DHCP_LEASE_NONE;
+    own = dhcps_find(tcpips, mac);
+    if (own == idx)
+        return idx;
+    //leased to other client
+    if (tcpips->dhcps.leases[idx].state != DHCP_LEASE_FREE)
+        return DHCP_LEASE_NONE;
+    if (own != DHCP_LEASE_NONE)
+        dhcps_forget(tcpips, own);
+    dhcps_link(tcpips, idx, mac);
+    return idx;
+}
+
+static void dhcps_init_pool(TCPIPS* tcpips, const IP* first)
+{
+    unsigned int i;
+    tcpips->dhcps.first.u32.ip = first->u32.ip;
+    for (i = 0; i < DHCP_POOL_SIZE; ++i)
     {
-        if ((mac->u32.hi == pool->mac.u32.hi) && (mac->u32.lo == pool->mac.u32.lo))
-            pool->mac.u32.hi = pool->mac.u32.lo = 0;
+        tcpips->dhcps.leases[i].state = DHCP_LEASE_FREE;
+        tcpips->dhcps.leases[i].mac.u32.hi = tcpips->dhcps.leases[i].mac.u32.lo = 0;
     }
+    for (i = 0; i < DHCP_HASH_SIZE; ++i)
+        tcpips->dhcps.mac_hash[i] = DHCP_LEASE_NONE;
+    memset(tcpips->dhcps.free, 0, sizeof(tcpips->dhcps.free));
+    for (i = 0; i < DHCP_POOL_SIZE; ++i)
+        dhcps_set_free(tcpips, i);
+    tcpips->dhcps.cursor = 0;
+    tcpips->dhcps.expire = 0xffffffff;
 }
+
 //------- options -----
 static void* dhcp_add_option_u32(uint8_t* ptr, uint32_t value, uint8_t option)
 {
@@ -126,6 +300,9 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
     DHCP_TYPE* hdr = io_data(io);
     uint8_t* ptr;
     uint8_t msg_type;
+    uint32_t requested, server_id;
+    unsigned int idx;
+    MAC mac;
     if (io->data_size < sizeof(DHCP_TYPE))
         return false;
     if (hdr->magic != DHCP_MAGIC)
@@ -139,12 +316,15 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
     ptr = hdr->options;
     msg_type = hdr->msg_type;
     hdr->msg_type = DHCP_OFFER;
-    hdr->yiaddr.u32.ip = dhcp_get_option_u32(ptr, DHCP_IPADDRESS);
+    requested = dhcp_get_option_u32(ptr, DHCP_IPADDRESS);
+    server_id = dhcp_get_option_u32(ptr, DHCP_SERVERID);
+    hdr->yiaddr.u32.ip = requested;
+    memcpy(mac.u8, hdr->chaddr, sizeof(MAC));
     memset(hdr->options, 0, DHCP_OPTION_LEN + 1);
     io->data_size = sizeof(DHCP_TYPE) + DHCP_OPTION_LEN;
 #if (DHCPS_DEBUG)
     printf("DHCPS: request type %d from ", msg_type);
-    mac_print((MAC*)&hdr->chaddr);
+    mac_print(&mac);
     printf(" yiaddr ");
     ip_print((const IP*)&hdr->yiaddr.u32.ip);
     printf("\n");
@@ -152,7 +332,22 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
     switch (msg_type)
     {
     case DHCP_REQUEST: // send ACK or NAK
-        if ((hdr->yiaddr.u32.ip == 0) || (hdr->yiaddr.u32.ip != dhcp_get_ip(tcpips->dhcps.pool, (MAC*)&hdr->chaddr, false)))
+        //client selected other server, offer is not required anymore
+        if (server_id && (server_id != tcpips->ips.ip.u32.ip))
+        {
+            idx = dhcps_find(tcpips, &mac);
+            if ((idx != DHCP_LEASE_NONE) && (tcpips->dhcps.leases[idx].state == DHCP_LEASE_OFFERED))
+                dhcps_expire(tcpips, idx);
+            return false;
+        }
+        //RFC 2131 4.3.2: no record of client, remain silent. Lease can be granted by other server
+        if ((idx = dhcps_find(tcpips, &mac)) == DHCP_LEASE_NONE)
+            return false;
+        //RENEWING/REBINDING client has no requested address option
+        if (requested == 0)
+            requested = hdr->ciaddr.u32.ip;
+        //wrong address: moved from other network, or lease is lost
+        if (requested != dhcps_ip(tcpips, idx))
         {
             hdr->msg_type = DHCP_NAK;
             hdr->yiaddr.u32.ip = 0;
@@ -163,7 +358,9 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
 #endif
         } else
         {
+            dhcps_bind(tcpips, idx, DHCP_LEASE_TIME);
             hdr->msg_type = DHCP_ACK;
+            hdr->yiaddr.u32.ip = requested;
             dhcp_add_options(tcpips, ptr, DHCP_OPTION_DHCP_OFFER);
 #if (DHCPS_DEBUG)
     printf("DHCPS: ACK \n");
@@ -171,11 +368,11 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
         }
         break;
     case DHCP_DISCOVER: // send OFFER
-        hdr->yiaddr.u32.ip = dhcp_get_ip(tcpips->dhcps.pool, (MAC*)&hdr->chaddr, true);
+        hdr->yiaddr.u32.ip = dhcps_offer(tcpips, &mac, requested);
         if (hdr->yiaddr.u32.ip == 0)
         {
 #if (DHCPS_DEBUG)
-            printf("DHCPS: pool full! /n");
+            printf("DHCPS: pool full! \n");
 #endif
             return false;
         }
@@ -187,15 +384,29 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
 #endif
         break;
     case DHCP_INFORM:
-        if ((hdr->ciaddr.u32.ip == 0) || (hdr->ciaddr.u32.ip != dhcp_get_ip(tcpips->dhcps.pool, (MAC*)&hdr->chaddr, false)))
+        idx = dhcps_find(tcpips, &mac);
+        if ((hdr->ciaddr.u32.ip == 0) || (idx == DHCP_LEASE_NONE) || (hdr->ciaddr.u32.ip != dhcps_ip(tcpips, idx)))
             return false;
         hdr->msg_type = DHCP_ACK;
         hdr->yiaddr.u32.ip = 0;
         dhcp_add_options(tcpips, ptr, DHCP_OPTION_DHCP_INFORM);
         break;
     case DHCP_DECLINE:
-        case DHCP_RELEASE:
-        dhcp_release_ip(tcpips->dhcps.pool, (MAC*)&hdr->chaddr);
+        //address is used by other host. Don't offer it for a while
+        idx = dhcps_find(tcpips, &mac);
+        if ((idx != DHCP_LEASE_NONE) && (dhcps_ip(tcpips, idx) == requested))
+        {
+            dhcps_forget(tcpips, idx);
+            dhcps_clear_free(tcpips, idx);
+            tcpips->dhcps.leases[idx].state = DHCP_LEASE_DECLINED;
+            dhcps_set_expire(tcpips, idx, DHCP_DECLINE_TIME);
+        }
+        return false;
+    case DHCP_RELEASE:
+        //remember client, address is reused last
+        idx = dhcps_find(tcpips, &mac);
+        if ((idx != DHCP_LEASE_NONE) && (dhcps_ip(tcpips, idx) == hdr->ciaddr.u32.ip) && (tcpips->dhcps.leases[idx].state == DHCP_LEASE_BOUND))
+            dhcps_expire(tcpips, idx);
         return false;
     default:
         return false;
@@ -203,17 +414,90 @@ bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src)
     return true;
 }
 
+void dhcps_timer(TCPIPS* tcpips, unsigned int seconds)
+{
+    unsigned int i;
+    DHCP_LEASE* lease;
+    if (seconds < tcpips->dhcps.expire)
+        return;
+    tcpips->dhcps.expire = 0xffffffff;
+    for (i = 0; i < DHCP_POOL_SIZE; ++i)
+    {
+        lease = &tcpips->dhcps.leases[i];
+        if ((lease->state != DHCP_LEASE_OFFERED) && (lease->state != DHCP_LEASE_BOUND) && (lease->state != DHCP_LEASE_DECLINED))
+            continue;
+        if (lease->expire <= seconds)
+            dhcps_expire(tcpips, i);
+        else if (lease->expire < tcpips->dhcps.expire)
+            tcpips->dhcps.expire = lease->expire;
+    }
+}
+
+static inline void dhcps_get_leases(TCPIPS* tcpips, IPC* ipc)
+{
+    unsigned int i;
+    DHCP_LEASE_RECORD* rec;
+    IO* io = (IO*)ipc->param2;
+    io->data_size = 0;
+    for (i = 0; i < DHCP_POOL_SIZE; ++i)
+    {
+        if (tcpips->dhcps.leases[i].state != DHCP_LEASE_BOUND)
+            continue;
+        if (io_get_free(io) < sizeof(DHCP_LEASE_RECORD))
+        {
+            error(ERROR_IO_BUFFER_TOO_SMALL);
+            return;
+        }
+        rec = (DHCP_LEASE_RECORD*)((uint8_t*)io_data(io) + io->data_size);
+        rec->ip.u32.ip = dhcps_ip(tcpips, i);
+        rec->mac.u32.hi = tcpips->dhcps.leases[i].mac.u32.hi;
+        rec->mac.u32.lo = tcpips->dhcps.leases[i].mac.u32.lo;
+        rec->remaining = tcpips->dhcps.leases[i].expire - tcpips->seconds;
+        io->data_size += sizeof(DHCP_LEASE_RECORD);
+    }
+    ipc->param3 = io->data_size;
+}
+
+static inline void dhcps_set_leases(TCPIPS* tcpips, IO* io)
+{
+    unsigned int offset, idx;
+    DHCP_LEASE_RECORD* rec;
+    for (offset = 0; offset + sizeof(DHCP_LEASE_RECORD) <= io->data_size; offset += sizeof(DHCP_LEASE_RECORD))
+    {
+        rec = (DHCP_LEASE_RECORD*)((uint8_t*)io_data(io) + offset);
+        if ((rec->remaining == 0) || ((rec->mac.u32.hi == 0) && (rec->mac.u32.lo == 0)))
+            continue;
+        if ((idx = dhcps_claim(tcpips, &rec->mac, rec->ip.u32.ip)) == DHCP_LEASE_NONE)
+            continue;
+        dhcps_clear_free(tcpips, idx);
+        tcpips->dhcps.leases[idx].state = DHCP_LEASE_BOUND;
+        dhcps_set_expire(tcpips, idx, rec->remaining);
+    }
+}
+
 void dhcps_init(TCPIPS* tcpips)
 {
-    memset(tcpips->dhcps.pool, 0, sizeof(tcpips->dhcps.pool));
+    IP first;
+    first.u32.ip = 0;
+    dhcps_init_pool(tcpips, &first);
+    tcpips->dhcps.net_mask.u32.ip = 0;
 }
 
 void dhcps_request(TCPIPS* tcpips, IPC* ipc)
 {
-    if (HAL_ITEM(ipc->cmd) == IPC_WRITE)
+    switch (HAL_ITEM(ipc->cmd))
     {
-        dhcp_init_pool(tcpips->dhcps.pool, (IP*)&ipc->param2);
+    case IPC_WRITE:
+        dhcps_init_pool(tcpips, (IP*)&ipc->param2);
         tcpips->dhcps.net_mask.u32.ip = ipc->param3;
+        break;
+    case DHCPS_GET_LEASES:
+        dhcps_get_leases(tcpips, ipc);
+        break;
+    case DHCPS_SET_LEASES:
+        dhcps_set_leases(tcpips, (IO*)ipc->param2);
+        break;
+    default:
+        error(ERROR_NOT_SUPPORTED);
     }
 }
-
@@ -15,7 +15,10 @@
 #include "endian.h"
 #include <string.h>
 
+//addresses from first, not more than 255
 #define DHCP_POOL_SIZE   5
+//MAC lookup table size, power of 2
+#define DHCP_HASH_SIZE   4
 
 #define DHCP_SERVER_PORT      67
 #define DHCP_CLIENT_PORT      68
@@ -34,7 +37,12 @@
 #define DHCP_INFORM           8
 
 #define DHCP_MAGIC            0x63538263
+//all times are in seconds
 #define DHCP_LEASE_TIME       86000
+//offered address is reserved for client until REQUEST
+#define DHCP_OFFER_TIME       60
+//declined address is not offered again
+#define DHCP_DECLINE_TIME     600
 #define DHCP_OPTION_LEN       160
 
 enum DHCP_OPTIONS {
@@ -95,15 +103,28 @@ typedef struct {
 
 typedef struct {
     MAC mac;
-    IP ip;
-} DHCP_POOL;
+    unsigned int expire;
+    uint8_t state;
+    //MAC hash chain, index in pool
+    uint8_t next;
+} DHCP_LEASE;
 
 typedef struct {
-    DHCP_POOL pool[DHCP_POOL_SIZE];
+    //lease of first + index
+    DHCP_LEASE leases[DHCP_POOL_SIZE];
+    uint8_t mac_hash[DHCP_HASH_SIZE];
+    //free and expired addresses bitmap
+    uint32_t free[(DHCP_POOL_SIZE + 31) / 32];
+    //next free address is searched from here, so released ones are reused last
+    uint8_t cursor;
+    //nearest expire time of all leases
+    unsigned int expire;
+    IP first;
     IP net_mask;
 } _DHCPS;
 
 void dhcps_init(TCPIPS* tcpips);
+void dhcps_timer(TCPIPS* tcpips, unsigned int seconds);
 bool dhcps_rx(TCPIPS* tcpips, IO* io, IP* src);
 void dhcps_request(TCPIPS* tcpips, IPC* ipc);
 
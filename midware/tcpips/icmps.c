@@ -145,12 +145,22 @@ static inline void icmps_rx_echo_reply(TCPIPS* tcpips, IO* io, IP* src)
 static inline void icmps_rx_destination_unreachable(TCPIPS* tcpips, IO* io)
 {
     ICMP_HEADER* icmp = io_data(io);
+    IP_HEADER* original;
     //useless if no original header provided
     if (io->data_size < sizeof(ICMP_HEADER) + sizeof(IP_HEADER) + 8)
     {
         ips_release_io(tcpips, io);
         return;
     }
+    //RFC 1191: next hop MTU in low half of unused field. Not an error, connection is still alive
+    if (icmp->code == ICMP_FRAGMENTATION_NEEDED_AND_DF_SET)
+    {
+        original = (IP_HEADER*)(((uint8_t*)io_data(io)) + sizeof(ICMP_HEADER));
+        if (original->src.u32.ip == tcpips->ips.ip.u32.ip)
+            ips_pmtu_update(tcpips, &original->dst, be2short(icmp->unused + 2), be2short(original->total_len_be));
+        ips_release_io(tcpips, io);
+        return;
+    }
 #if (ICMP_DEBUG)
     printf("ICMP: Destination unreachable(%d) ", icmp->code);
 #endif
@@ -16,32 +16,40 @@
 
 #if (IP_FRAGMENTATION)
 
-typedef struct _ASSEMBLY_SLOT {
-    struct _ASSEMBLY_SLOT* next;
-    unsigned int size;
-} ASSEMBLY_SLOT;
+//RFC 815 hole descriptor, stored in hole itself. Offsets are from data start
+typedef struct {
+    uint16_t first, end, next;
+} IP_HOLE;
+
+#define IP_HEADER_MAX                           60
+#define IP_HOLE_NONE                            0xffff
+#define IP_HOLE_INFINITY                        0xffff
+#define IP_ASSEMBLY_NONE                        0xff
 
 #define LONG_IP_FRAME_MAX_DATA_SIZE             (IP_MAX_LONG_SIZE - sizeof(IP_HEADER))
-#define LONG_IP_FRAME_MAX_SIZE                  (IP_MAX_LONG_SIZE + sizeof(MAC_HEADER) + sizeof(IP_STACK) + sizeof(ASSEMBLY_SLOT))
+//header is placed before data on assembly. Tail hole descriptor can follow max data
+#define LONG_IP_FRAME_MAX_SIZE                  (IP_MAX_LONG_SIZE + sizeof(MAC_HEADER) + sizeof(IP_STACK) + IP_HEADER_MAX - sizeof(IP_HEADER) + sizeof(IP_HOLE))
 
-typedef struct {
-    IO* io;
-    ASSEMBLY_SLOT* head;
-    unsigned int ttl;
-    IP src;
-    uint16_t id;
-    bool got_last;
-} IPS_ASSEMBLY;
+#define IP_ASSEMBLY_DATA(as)                    (((uint8_t*)io_data((as)->io)) + IP_HEADER_MAX)
+#define IP_HOLE_AT(as, offset)                  ((IP_HOLE*)(IP_ASSEMBLY_DATA(as) + (offset)))
 #endif //IP_FRAGMENTATION
 
 #define IP_DF                                   (1 << 6)
 #define IP_MF                                   (1 << 5)
 #define IP_FLAGS_MASK                           (7 << 5)
 
+#define IP_PMTU_PLATEAU_COUNT                   5
+
+//RFC 1191 plateau table, guess for routers, not reporting next hop mtu
+static const uint16_t __IP_PMTU_PLATEAU[IP_PMTU_PLATEAU_COUNT] =   {1492, 1006, 508, 296, 68};
+
 void ips_init(TCPIPS* tcpips)
 {
+    unsigned int i;
     tcpips->ips.ip.u32.ip = IP_MAKE(0, 0, 0, 0);
     tcpips->ips.up = false;
+    for (i = 0; i < IP_PMTU_CACHE_SIZE; ++i)
+        tcpips->ips.pmtu[i].dst.u32.ip = 0;
 
 #if (IP_FIREWALL)
     tcpips->ips.firewall_enabled = false;
@@ -50,7 +58,11 @@ void ips_init(TCPIPS* tcpips)
 #if (IP_FRAGMENTATION)
     tcpips->ips.io_allocated = 0;
     array_create(&tcpips->ips.free_io, sizeof(IO*), 1);
-    array_create(&tcpips->ips.assembly_io, sizeof(IPS_ASSEMBLY), 1);
+    for (i = 0; i < IP_MAX_LONG_PACKETS; ++i)
+        tcpips->ips.assembly[i].io = NULL;
+    for (i = 0; i < IP_FRAGMENTATION_HASH_SIZE; ++i)
+        tcpips->ips.assembly_hash[i] = IP_ASSEMBLY_NONE;
+    tcpips->ips.assembly_mem = 0;
 #endif //IP_FRAGMENTATION
 }
 
@@ -83,107 +95,166 @@ static void ips_release_long(TCPIPS* tcpips, IO* io)
         *iop = io;
 }
 
-static inline IPS_ASSEMBLY* ips_allocate_assembly(TCPIPS* tcpips, const IP* src, uint16_t id)
+static inline unsigned int ips_assembly_hash(const IP* src, const IP* dst, uint16_t id, uint8_t proto)
 {
-    IO* io;
-    IPS_ASSEMBLY* as;
-    ASSEMBLY_SLOT* asl;
-    if (array_size(tcpips->ips.assembly_io) >= IP_MAX_LONG_PACKETS)
-    {
-        error(ERROR_TOO_MANY_HANDLES);
-        return NULL;
-    }
-    io = ips_allocate_long(tcpips);
-    if (io == NULL)
-        return NULL;
-    as = array_append(&tcpips->ips.assembly_io);
-    as->got_last = false;
-    as->io = io;
-    as->head = io_data(io);
-    asl = io_data(io);
-    asl->next = NULL;
-    asl->size = LONG_IP_FRAME_MAX_DATA_SIZE;
-    as->ttl = tcpips->seconds + IP_FRAGMENTATION_ASSEMBLY_TIMEOUT;
-    as->src.u32.ip = src->u32.ip;
-    as->id = id;
-    as->got_last = false;
-    return as;
+    uint32_t h = (src->u32.ip ^ dst->u32.ip ^ ((uint32_t)id << 8) ^ proto) * 0x9e3779b1;
+    return (h >> 16) & (IP_FRAGMENTATION_HASH_SIZE - 1);
 }
 
-static inline void ips_free_assembly(TCPIPS* tcpips, const IP* src, uint16_t id)
+//unlink from hash, frame is kept
+static void ips_assembly_remove(TCPIPS* tcpips, IP_ASSEMBLY* as)
 {
-    int i;
-    IPS_ASSEMBLY* as;
-    for (i = 0; i < array_size(tcpips->ips.assembly_io); ++i)
+    uint8_t* cur;
+    uint8_t idx = as - tcpips->ips.assembly;
+    for (cur = &tcpips->ips.assembly_hash[ips_assembly_hash(&as->src, &as->dst, as->id, as->proto)]; *cur != IP_ASSEMBLY_NONE;
+         cur = &tcpips->ips.assembly[*cur].next)
     {
-        as = array_at(tcpips->ips.assembly_io, i);
-        if (as->src.u32.ip == src->u32.ip && as->id == id)
+        if (*cur == idx)
         {
-            array_remove(&tcpips->ips.assembly_io, i);
-            return;
+            *cur = as->next;
+            break;
         }
     }
+    tcpips->ips.assembly_mem -= as->extent;
+    as->io = NULL;
 }
 
-static IPS_ASSEMBLY* ips_find_assembly(TCPIPS* tcpips, const IP* src, uint16_t id)
+static void ips_assembly_free(TCPIPS* tcpips, IP_ASSEMBLY* as)
 {
-    int i;
-    IPS_ASSEMBLY* as;
-    for (i = 0; i < array_size(tcpips->ips.assembly_io); ++i)
+    ips_release_long(tcpips, as->io);
+    ips_assembly_remove(tcpips, as);
+}
+
+static IP_ASSEMBLY* ips_assembly_oldest(TCPIPS* tcpips, IP_ASSEMBLY* except)
+{
+    unsigned int i;
+    IP_ASSEMBLY* res = NULL;
+    for (i = 0; i < IP_MAX_LONG_PACKETS; ++i)
+    {
+        if (tcpips->ips.assembly[i].io == NULL || &tcpips->ips.assembly[i] == except)
+            continue;
+        if (res == NULL || (int)(tcpips->ips.assembly[i].ttl - res->ttl) < 0)
+            res = &tcpips->ips.assembly[i];
+    }
+    return res;
+}
+
+static bool ips_assembly_evict(TCPIPS* tcpips, IP_ASSEMBLY* except)
+{
+    IP_ASSEMBLY* as = ips_assembly_oldest(tcpips, except);
+    if (as == NULL)
+        return false;
+#if (IP_DEBUG)
+    printf("IP: fragment assembly evicted\n");
+#endif //IP_DEBUG
+    ips_assembly_free(tcpips, as);
+    return true;
+}
+
+static IP_ASSEMBLY* ips_assembly_find(TCPIPS* tcpips, const IP_HEADER* hdr)
+{
+    uint8_t idx;
+    IP_ASSEMBLY* as;
+    uint16_t id = be2short(hdr->id_be);
+    for (idx = tcpips->ips.assembly_hash[ips_assembly_hash(&hdr->src, &hdr->dst, id, hdr->proto)]; idx != IP_ASSEMBLY_NONE; idx = as->next)
     {
-        as = array_at(tcpips->ips.assembly_io, i);
-        if (as->src.u32.ip == src->u32.ip && as->id == id)
+        as = &tcpips->ips.assembly[idx];
+        if (as->src.u32.ip == hdr->src.u32.ip && as->dst.u32.ip == hdr->dst.u32.ip && as->id == id && as->proto == hdr->proto)
             return as;
     }
-    //not found? allocate
-    return ips_allocate_assembly(tcpips, src, id);
+    return NULL;
 }
 
-static bool ips_insert_assembly(IPS_ASSEMBLY* as, IO* io, unsigned int offset)
+static IP_ASSEMBLY* ips_assembly_create(TCPIPS* tcpips, const IP_HEADER* hdr)
 {
-    ASSEMBLY_SLOT* asl;
-    ASSEMBLY_SLOT* prev;
-    ASSEMBLY_SLOT* n;
-    unsigned int cur_offset;
-    for (asl = as->head, prev = NULL; asl != NULL; prev = asl, asl = asl->next)
-    {
-        cur_offset = (unsigned int)asl - (unsigned int)io_data(as->io);
-        if (cur_offset > offset)
+    unsigned int i, hash;
+    IO* io;
+    IP_HOLE* hole;
+    IP_ASSEMBLY* as = NULL;
+    for (i = 0; i < IP_MAX_LONG_PACKETS; ++i)
+        if (tcpips->ips.assembly[i].io == NULL)
+        {
+            as = &tcpips->ips.assembly[i];
             break;
-        //fit
-        if (cur_offset <= offset && cur_offset - offset + asl->size >= io->data_size)
+        }
+    if (as == NULL)
+    {
+        as = ips_assembly_oldest(tcpips, NULL);
+        ips_assembly_free(tcpips, as);
+    }
+    //frame can be also used by tx long
+    while ((io = ips_allocate_long(tcpips)) == NULL)
+    {
+        if (!ips_assembly_evict(tcpips, NULL))
+            return NULL;
+    }
+    as->io = io;
+    as->src.u32.ip = hdr->src.u32.ip;
+    as->dst.u32.ip = hdr->dst.u32.ip;
+    as->id = be2short(hdr->id_be);
+    as->proto = hdr->proto;
+    as->hdr_size = 0;
+    as->extent = as->size = 0;
+    as->ttl = tcpips->seconds + IP_FRAGMENTATION_ASSEMBLY_TIMEOUT;
+    //whole datagram is single hole
+    as->hole = 0;
+    hole = IP_HOLE_AT(as, 0);
+    hole->first = 0;
+    hole->end = IP_HOLE_INFINITY;
+    hole->next = IP_HOLE_NONE;
+    hash = ips_assembly_hash(&as->src, &as->dst, as->id, as->proto);
+    as->next = tcpips->ips.assembly_hash[hash];
+    tcpips->ips.assembly_hash[hash] = as - tcpips->ips.assembly;
+    return as;
+}
+
+//RFC 815. Each hole, overlapped by fragment, is replaced by parts before and after fragment
+static void ips_assembly_insert(IP_ASSEMBLY* as, const void* data, unsigned int first, unsigned int end, bool more)
+{
+    IP_HOLE hole;
+    IP_HOLE* n;
+    uint16_t* link = &as->hole;
+    while (*link != IP_HOLE_NONE)
+    {
+        hole = *IP_HOLE_AT(as, *link);
+        if (first >= hole.end || end <= hole.first)
         {
-            //insert in top of free slot
-            if (cur_offset == offset)
-            {
-                n = (ASSEMBLY_SLOT*)((unsigned int)asl + io->data_size);
-                if (prev)
-                    prev->next = n;
-                else
-                    as->head = n;
-                n->next = asl->next;
-                n->size = asl->size - io->data_size;
-            }
-            //no need to change prev
-            else
-            {
-                //bottom
-                if (offset - cur_offset + io->data_size == asl->size)
-                    asl->size -= io->data_size;
-                //in the middle
-                else
-                {
-                    n = (ASSEMBLY_SLOT*)((unsigned int)asl + io->data_size + offset - cur_offset);
-                    n->next = asl->next;
-                    n->size = asl->size - (offset - cur_offset) - io->data_size;
-                    asl->size = offset - cur_offset;
-                }
-            }
-            memcpy((void*)((unsigned int)asl + io->data_size + offset - cur_offset), io_data(io), io->data_size);
-            return true;
+            link = &IP_HOLE_AT(as, *link)->next;
+            continue;
+        }
+        *link = hole.next;
+        if (end < hole.end && more)
+        {
+            n = IP_HOLE_AT(as, end);
+            n->first = end;
+            n->end = hole.end;
+            n->next = *link;
+            *link = end;
         }
+        if (first > hole.first)
+        {
+            n = IP_HOLE_AT(as, hole.first);
+            n->first = hole.first;
+            n->end = first;
+            n->next = *link;
+            *link = hole.first;
+            link = &n->next;
+        }
+        //skip created after-hole, it's not overlapped
+        if (end < hole.end && more)
+            link = &IP_HOLE_AT(as, end)->next;
     }
-    return false;
+    //nothing is expected after last fragment
+    if (!more)
+        for (link = &as->hole; *link != IP_HOLE_NONE; )
+        {
+            if (*link >= end)
+                *link = IP_HOLE_AT(as, *link)->next;
+            else
+                link = &IP_HOLE_AT(as, *link)->next;
+        }
+    //descriptors, overlapped by fragment, are already unlinked
+    memcpy(IP_ASSEMBLY_DATA(as) + first, data, end - first);
 }
 #endif //IP_FRAGMENTATION
 
@@ -239,6 +310,11 @@ void ips_request(TCPIPS* tcpips, IPC* ipc)
         ips_disable_firewall(tcpips);
         break;
 #endif //IP_FIREWALL
+    case IP_ADD_ROUTE:
+    case IP_REMOVE_ROUTE:
+    case IP_FLUSH_ROUTES:
+        routes_request(tcpips, ipc);
+        break;
     default:
         error(ERROR_NOT_SUPPORTED);
         break;
@@ -260,25 +336,90 @@ void ips_link_changed(TCPIPS* tcpips, bool link)
     }
 }
 
-#if (IP_FRAGMENTATION)
 void ips_timer(TCPIPS* tcpips, unsigned int seconds)
 {
     int i;
-    IPS_ASSEMBLY* as;
-    for (i = 0; i < array_size(tcpips->ips.assembly_io); ++i)
+#if (IP_FRAGMENTATION)
+    IP_ASSEMBLY* as;
+#endif //IP_FRAGMENTATION
+    IP dst;
+    //path MTU aging. Try larger after timeout
+    for (i = 0; i < IP_PMTU_CACHE_SIZE; ++i)
+    {
+        if (tcpips->ips.pmtu[i].dst.u32.ip && (int)(seconds - tcpips->ips.pmtu[i].expire) >= 0)
+        {
+            dst.u32.ip = tcpips->ips.pmtu[i].dst.u32.ip;
+            tcpips->ips.pmtu[i].dst.u32.ip = 0;
+            tcps_pmtu_changed(tcpips, &dst);
+        }
+    }
+#if (IP_FRAGMENTATION)
+    for (i = 0; i < IP_MAX_LONG_PACKETS; ++i)
     {
-        as = array_at(tcpips->ips.assembly_io, i);
-        if (as->ttl < seconds)
+        as = &tcpips->ips.assembly[i];
+        if (as->io != NULL && as->ttl < seconds)
         {
 #if (IP_DEBUG)
             printf("IP: Fragment assembly timeout\n");
 #endif //IP_DEBUG
-            ips_release_long(tcpips, as->io);
-            ips_free_assembly(tcpips, &as->src, as->id);
+            ips_assembly_free(tcpips, as);
         }
     }
-}
 #endif //IP_FRAGMENTATION
+}
+
+unsigned int ips_pmtu(TCPIPS* tcpips, const IP* dst)
+{
+    unsigned int i;
+    for (i = 0; i < IP_PMTU_CACHE_SIZE; ++i)
+        if (tcpips->ips.pmtu[i].dst.u32.ip == dst->u32.ip)
+            return tcpips->ips.pmtu[i].mtu;
+    return TCPIP_MTU;
+}
+
+void ips_pmtu_update(TCPIPS* tcpips, const IP* dst, unsigned int mtu, unsigned int original_size)
+{
+    unsigned int i;
+    IP_PMTU* pmtu;
+    //old router, guess next plateau below original datagram
+    if (mtu == 0 || mtu >= original_size)
+    {
+        for (i = 0; (i < IP_PMTU_PLATEAU_COUNT - 1) && (__IP_PMTU_PLATEAU[i] >= original_size); ++i) {}
+        mtu = __IP_PMTU_PLATEAU[i];
+    }
+    if (mtu < IP_PMTU_MIN)
+        mtu = IP_PMTU_MIN;
+    //never increase by ICMP
+    if (mtu >= ips_pmtu(tcpips, dst))
+        return;
+    //same dst, else free, else oldest
+    pmtu = NULL;
+    for (i = 0; i < IP_PMTU_CACHE_SIZE; ++i)
+        if (tcpips->ips.pmtu[i].dst.u32.ip == dst->u32.ip)
+        {
+            pmtu = &tcpips->ips.pmtu[i];
+            break;
+        }
+    for (i = 0; pmtu == NULL && i < IP_PMTU_CACHE_SIZE; ++i)
+        if (tcpips->ips.pmtu[i].dst.u32.ip == 0)
+            pmtu = &tcpips->ips.pmtu[i];
+    if (pmtu == NULL)
+    {
+        pmtu = &tcpips->ips.pmtu[0];
+        for (i = 1; i < IP_PMTU_CACHE_SIZE; ++i)
+            if ((int)(tcpips->ips.pmtu[i].expire - pmtu->expire) < 0)
+                pmtu = &tcpips->ips.pmtu[i];
+    }
+    pmtu->dst.u32.ip = dst->u32.ip;
+    pmtu->mtu = mtu;
+    pmtu->expire = tcpips->seconds + IP_PMTU_TIMEOUT;
+#if (IP_DEBUG)
+    printf("IP: path MTU to ");
+    ip_print(dst);
+    printf(" is %d\n", mtu);
+#endif //IP_DEBUG
+    tcps_pmtu_changed(tcpips, dst);
+}
 
 IO* ips_allocate_io(TCPIPS* tcpips, unsigned int size, uint8_t proto)
 {
@@ -358,7 +499,8 @@ void ips_tx(TCPIPS* tcpips, IO* io, const IP* dst)
     IP_HEADER* hdr;
     IP_STACK* ip_stack;
 #if (IP_FRAGMENTATION)
-    unsigned int offset, cur;
+    unsigned int offset, cur, size;
+    uint16_t id;
     IO* fragment;
 #endif //IP_FRAGMENTATION
     //drop if interface is not up
@@ -373,47 +515,50 @@ void ips_tx(TCPIPS* tcpips, IO* io, const IP* dst)
     hdr = io_data(io);
 
 #if (IP_FRAGMENTATION)
+    //fallback for long frames, fragments are fitted in path MTU
     if (ip_stack->is_long)
     {
+        id = tcpips->ips.id++;
+        size = (ips_pmtu(tcpips, dst) - ip_stack->hdr_size) & ~7;
         for (offset = ip_stack->hdr_size; offset < io->data_size; offset += cur)
         {
-            fragment = tcpips_allocate_io(tcpips);
+            fragment = macs_allocate_io(tcpips);
             if (fragment == NULL)
             {
 #if (IP_DEBUG)
                 printf("IP: fragmentation failed - out of free blocks\n");
 #endif //IP_DEBUG
-                if (offset > ip_stack->hdr_size)
-                    ++tcpips->ips.id;
                 ips_release_io(tcpips, io);
                 return;
             }
-            cur = IP_FRAME_MAX_DATA_SIZE;
+            cur = size;
             if (offset + cur > io->data_size)
                 cur = io->data_size - offset;
             //hdr
             memcpy(io_data(fragment), io_data(io), ip_stack->hdr_size);
             //data
             memcpy((uint8_t*)io_data(fragment) + ip_stack->hdr_size, (uint8_t*)io_data(io) + offset, cur);
+            fragment->data_size = ip_stack->hdr_size + cur;
 
             hdr = io_data(fragment);
-            short2be(hdr->id_be, tcpips->ips.id);
+            short2be(hdr->id_be, id);
             hdr->proto = ip_stack->proto;
-            short2be(hdr->flags_offset_be, offset >> 3);
-            //MF
+            short2be(hdr->flags_offset_be, (offset - ip_stack->hdr_size) >> 3);
             if (offset + cur < io->data_size)
-                hdr->flags_offset_be[0] |= IP_FLAGS_MASK;
+                hdr->flags_offset_be[0] |= IP_MF;
+            ips_tx_internal(tcpips, fragment, dst, ip_stack->hdr_size);
         }
         ips_release_io(tcpips, io);
-        ++tcpips->ips.id;
         return;
     }
 #endif //IP_FRAGMENTATION
 
     short2be(hdr->id_be, tcpips->ips.id++);
     hdr->proto = ip_stack->proto;
-    //flags, offset
-    hdr->flags_offset_be[0] = hdr->flags_offset_be[1] = 0;
+    //flags, offset. TCP segment is fitted in path MTU, don't fragment.
+    //Path MTU is not reduced below IP_PMTU_MIN, smaller hop must fragment it
+    hdr->flags_offset_be[0] = ((ip_stack->proto == PROTO_TCP) && (ips_pmtu(tcpips, dst) > IP_PMTU_MIN)) ? IP_DF : 0;
+    hdr->flags_offset_be[1] = 0;
     io_pop(io, sizeof(IP_STACK));
     ips_tx_internal(tcpips, io, dst, ip_stack->hdr_size);
 }
@@ -458,11 +603,16 @@ static void ips_process(TCPIPS* tcpips, IO* io, IP* src)
 static inline void ips_insert_fragment(TCPIPS* tcpips, IO* io, unsigned int offset, bool more)
 {
     IP_HEADER* hdr;
-    IPS_ASSEMBLY* as;
+    IP_ASSEMBLY* as;
     IO* assembled;
+    IP src;
+    uint16_t crc;
+    unsigned int end;
     IP_STACK* ip_stack = io_stack(io);
     hdr = (IP_HEADER*)(((uint8_t*)io_data(io)) - ip_stack->hdr_size);
-    as = ips_find_assembly(tcpips, &hdr->src, be2short(hdr->id_be));
+    end = offset + io->data_size;
+    if ((as = ips_assembly_find(tcpips, hdr)) == NULL)
+        as = ips_assembly_create(tcpips, hdr);
     if (as == NULL)
     {
 #if (IP_DEBUG)
@@ -474,65 +624,70 @@ static inline void ips_insert_fragment(TCPIPS* tcpips, IO* io, unsigned int offs
 #if (IP_DEBUG_FLOW)
     printf("IP: fragmented frame insert: offset %d, more: %d\n", offset, more);
 #endif //IP_DEBUG
-    //fit?
-    if (io->data_size + offset > LONG_IP_FRAME_MAX_DATA_SIZE)
+    //fit? Only last fragment can be not aligned. Last fragment defines size, no data is after
+    if ((end > LONG_IP_FRAME_MAX_DATA_SIZE) || (more && ((io->data_size & 7) || (end == LONG_IP_FRAME_MAX_DATA_SIZE))) ||
+        (as->size && (end > as->size || (!more && end != as->size))) || (!more && end < as->extent))
     {
 #if (IP_DEBUG)
-        printf("IP: fragmented frame too big to fit\n");
+        printf("IP: invalid fragment\n");
 #endif //IP_DEBUG
 #if (ICMP)
         icmps_tx_error(tcpips, io, ICMP_ERROR_PARAMETER, 2);
 #endif //ICMP
         tcpips_release_io(tcpips, io);
-        //assembly drop
-        ips_release_long(tcpips, as->io);
-        ips_free_assembly(tcpips, &as->src, as->id);
+        ips_assembly_free(tcpips, as);
         return;
     }
-    //first frame?
-    if (offset == 0)
+    //memory budget, oldest are dropped first
+    if (end > as->extent)
     {
-        //unhide header
-        io->data_offset -= ip_stack->hdr_size;
-        io->data_size += ip_stack->hdr_size;
+        tcpips->ips.assembly_mem += end - as->extent;
+        as->extent = end;
+        while (tcpips->ips.assembly_mem > IP_FRAGMENTATION_MEM_MAX && ips_assembly_evict(tcpips, as)) {}
+        if (tcpips->ips.assembly_mem > IP_FRAGMENTATION_MEM_MAX)
+        {
+            tcpips_release_io(tcpips, io);
+            ips_assembly_free(tcpips, as);
+            return;
+        }
     }
-    if (!ips_insert_assembly(as, io, offset))
+    if (!more)
+        as->size = end;
+    //header of first fragment is used for datagram
+    if (offset == 0)
     {
-#if (IP_DEBUG)
-        printf("IP: possible duplicated frame\n");
-#endif //IP_DEBUG
-        tcpips_release_io(tcpips, io);
-        return;
+        as->hdr_size = ip_stack->hdr_size;
+        memcpy(IP_ASSEMBLY_DATA(as) - as->hdr_size, hdr, as->hdr_size);
     }
+    ips_assembly_insert(as, io_data(io), offset, end, more);
     tcpips_release_io(tcpips, io);
-    if (!more)
-        as->got_last = true;
-    //got last and no fragments? received all
-    if (as->got_last && as->head->next->next == NULL)
-    {
+    if (as->hole != IP_HOLE_NONE)
+        return;
 #if (IP_DEBUG_FLOW)
-        printf("IP: Assembly complete\n");
+    printf("IP: Assembly complete\n");
 #endif //IP_DEBUG_FLOW
-        assembled = as->io;
-        assembled->data_size = (unsigned int)as->head - (unsigned int)io_data(as->io);
-        ips_free_assembly(tcpips, &as->src, as->id);
-        hdr = io_data(assembled);
-        ip_stack = io_push(assembled, sizeof(IP_STACK));
-        ip_stack->hdr_size = (hdr->ver_ihl & 0xf) << 2;
-        ip_stack->proto = hdr->proto;
-        ip_stack->is_long = true;
-        //update header
-        io->data_offset += ip_stack->hdr_size;
-        io->data_size -= ip_stack->hdr_size;
-        //total len
-        short2be(hdr->total_len_be, io->data_size);
-        //flags, offset
-        hdr->flags_offset_be[0] = hdr->flags_offset_be[1] = 0;
-        //update checksum
-        short2be(hdr->header_crc_be, 0);
-        short2be(hdr->header_crc_be, ip_checksum(io_data(assembled), ip_stack->hdr_size));
-        ips_process(tcpips, assembled, &hdr->src);
-    }
+    assembled = as->io;
+    assembled->data_offset += IP_HEADER_MAX - as->hdr_size;
+    assembled->data_size = as->hdr_size + as->size;
+    ips_assembly_remove(tcpips, as);
+    hdr = io_data(assembled);
+    ip_stack = io_push(assembled, sizeof(IP_STACK));
+    ip_stack->hdr_size = (hdr->ver_ihl & 0xf) << 2;
+    ip_stack->proto = hdr->proto;
+    ip_stack->is_long = true;
+    //only total len and flags/offset changed, update checksum incrementally
+    crc = ip_checksum_update32(be2short(hdr->header_crc_be), ((uint32_t)be2short(hdr->total_len_be) << 16) | be2short(hdr->flags_offset_be),
+                               assembled->data_size << 16);
+    //total len
+    short2be(hdr->total_len_be, assembled->data_size);
+    //flags, offset
+    hdr->flags_offset_be[0] = hdr->flags_offset_be[1] = 0;
+    short2be(hdr->header_crc_be, crc);
+    src.u32.ip = hdr->src.u32.ip;
+    //hide header
+    assembled->data_offset += ip_stack->hdr_size;
+    assembled->data_size -= ip_stack->hdr_size;
+    ips_process(tcpips, assembled, &src);
 }
 #endif //IP_FRAGMENTATION
 
@@ -15,10 +15,30 @@
 
 #define IP_FRAME_MAX_DATA_SIZE                          (TCPIP_MTU - sizeof(IP_HEADER))
 
+typedef struct {
+    //zero dst means free slot
+    IP dst;
+    uint16_t mtu;
+    unsigned int expire;
+} IP_PMTU;
+
+#if (IP_FRAGMENTATION)
+typedef struct {
+    IO* io;
+    IP src, dst;
+    unsigned int ttl;
+    //first hole offset. Received data extent, total size once last fragment is received
+    uint16_t id, hole, extent, size;
+    uint8_t proto, hdr_size, next;
+} IP_ASSEMBLY;
+#endif //IP_FRAGMENTATION
+
 typedef struct {
     IP ip;
     uint16_t id;
     bool up;
+    //RFC 1191 path MTU cache
+    IP_PMTU pmtu[IP_PMTU_CACHE_SIZE];
 #if (IP_FIREWALL)
     bool firewall_enabled;
     IP src, mask;
@@ -26,7 +46,10 @@ typedef struct {
 #if (IP_FRAGMENTATION)
     unsigned int io_allocated;
     ARRAY* free_io;
-    ARRAY* assembly_io;
+    //each assembly is holding long frame
+    IP_ASSEMBLY assembly[IP_MAX_LONG_PACKETS];
+    uint8_t assembly_hash[IP_FRAGMENTATION_HASH_SIZE];
+    unsigned int assembly_mem;
 #endif //IP_FRAGMENTATION
 } IPS;
 
@@ -65,15 +88,18 @@ typedef struct {
 void ips_init(TCPIPS* tcpips);
 void ips_request(TCPIPS* tcpips, IPC* ipc);
 void ips_link_changed(TCPIPS* tcpips, bool link);
-#if (IP_FRAGMENTATION)
 void ips_timer(TCPIPS* tcpips, unsigned int seconds);
-#endif //IP_FRAGMENTATION
 
 //allocate IP io. If more than (MTU - MAC header - IP header) and fragmentation enabled, will be allocated long frame
 IO* ips_allocate_io(TCPIPS* tcpips, unsigned int size, uint8_t proto);
 //release previously allocated io. IO is not actually freed, just put in queue of free ios
 void ips_release_io(TCPIPS* tcpips, IO* io);
 void ips_tx(TCPIPS* tcpips, IO* io, const IP* dst);
+//path MTU to dst, TCPIP_MTU if unknown
+unsigned int ips_pmtu(TCPIPS* tcpips, const IP* dst);
+
+//from icmp. Fragmentation needed with next hop mtu, or zero from old router
+void ips_pmtu_update(TCPIPS* tcpips, const IP* dst, unsigned int mtu, unsigned int original_size);
 
 //from mac
 void ips_rx(TCPIPS* tcpips, IO* io);
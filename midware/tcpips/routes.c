@@ -8,80 +8,181 @@
 #include "tcpips_private.h"
 #include "arps.h"
 #include "macs.h"
-#include "icmps.h"
+#include "../../userspace/stdio.h"
+#include "../../userspace/endian.h"
+#include "../../userspace/error.h"
+#include <string.h>
 
-#define ROUTE_QUEUE_ITEM(tcpips, i)                    ((ROUTE_QUEUE_ENTRY*)array_at((tcpips)->routes.tx_queue, i))
+#define ROUTE_ITEM(tcpips, i)                       ((ROUTE_ENTRY*)array_at((tcpips)->routes.table, i))
+#define ROUTE_CACHE_MASK                            (IP_ROUTE_CACHE_SIZE - 1)
 
 typedef struct {
-    IO* io;
-    IP ip;
-} ROUTE_QUEUE_ENTRY;
+    IP dst;
+    IP mask;
+    //zero gateway means on-link
+    IP gateway;
+    uint8_t prefix_len;
+    uint8_t metric;
+} ROUTE_ENTRY;
+
+static void routes_flush_cache(TCPIPS* tcpips)
+{
+    memset(tcpips->routes.cache, 0, sizeof(tcpips->routes.cache));
+}
 
 void routes_init(TCPIPS* tcpips)
 {
-    array_create(&tcpips->routes.tx_queue, sizeof(ROUTE_QUEUE_ENTRY), 1);
+    array_create(&tcpips->routes.table, sizeof(ROUTE_ENTRY), 1);
+    routes_flush_cache(tcpips);
 }
 
-bool routes_drop(TCPIPS* tcpips)
+static inline unsigned int routes_hash(const IP* ip)
 {
-    if (array_size(tcpips->routes.tx_queue))
-    {
-        tcpips_release_io(tcpips, ROUTE_QUEUE_ITEM(tcpips, 0)->io);
-        array_remove(&tcpips->routes.tx_queue, 0);
-        return true;
-    }
-    return false;
+    uint32_t hash = ip->u32.ip * 0x9e3779b1;
+    return (hash >> 16) & ROUTE_CACHE_MASK;
 }
 
-void routes_link_changed(TCPIPS* tcpips, bool link)
+static void routes_lookup(TCPIPS* tcpips, const IP* target, IP* next_hop)
 {
-    if (!link)
+    unsigned int i;
+    ROUTE_ENTRY* route;
+    ROUTE_CACHE_ENTRY* cache = &tcpips->routes.cache[routes_hash(target)];
+    if (cache->dst.u32.ip == target->u32.ip)
     {
-        //drop all routes
-        while (routes_drop(tcpips)) {}
+        next_hop->u32.ip = cache->next_hop.u32.ip;
+        return;
+    }
+    next_hop->u32.ip = target->u32.ip;
+    for (i = 0; i < array_size(tcpips->routes.table); ++i)
+    {
+        route = ROUTE_ITEM(tcpips, i);
+        if ((target->u32.ip & route->mask.u32.ip) == route->dst.u32.ip)
+        {
+            if (route->gateway.u32.ip)
+                next_hop->u32.ip = route->gateway.u32.ip;
+            break;
+        }
     }
+    cache->dst.u32.ip = target->u32.ip;
+    cache->next_hop.u32.ip = next_hop->u32.ip;
 }
 
-void routes_resolved(TCPIPS* tcpips, const IP* ip, const MAC* mac)
+static inline void routes_add(TCPIPS* tcpips, IPC* ipc)
 {
-    int i;
-    for (i = 0; i < array_size(tcpips->routes.tx_queue); ++i)
-        if (ROUTE_QUEUE_ITEM(tcpips, i)->ip.u32.ip == ip->u32.ip)
+    unsigned int i;
+    ROUTE_ENTRY* route;
+    IP dst, mask;
+    uint8_t prefix_len = ipc->param3 & 0xff;
+    uint8_t metric = (ipc->param3 >> 8) & 0xff;
+    if (prefix_len > 32)
+    {
+        error(ERROR_INVALID_PARAMS);
+        return;
+    }
+    int2be(mask.u8, prefix_len ? 0xffffffff << (32 - prefix_len) : 0);
+    dst.u32.ip = ipc->param1 & mask.u32.ip;
+    for (i = 0; i < array_size(tcpips->routes.table); ++i)
+    {
+        route = ROUTE_ITEM(tcpips, i);
+        if (route->dst.u32.ip == dst.u32.ip && route->prefix_len == prefix_len && route->gateway.u32.ip == ipc->param2)
         {
-            //forward to MAC
-            macs_tx(tcpips, ROUTE_QUEUE_ITEM(tcpips, i)->io, mac, ETHERTYPE_IP);
-            array_remove(&tcpips->routes.tx_queue, i);
+            error(ERROR_ALREADY_CONFIGURED);
+            return;
         }
+    }
+    if (array_size(tcpips->routes.table) >= IP_ROUTES_MAX)
+    {
+        error(ERROR_TOO_MANY_HANDLES);
+        return;
+    }
+    //keep longest prefix, than lowest metric first
+    for (i = 0; i < array_size(tcpips->routes.table); ++i)
+    {
+        route = ROUTE_ITEM(tcpips, i);
+        if (route->prefix_len < prefix_len || (route->prefix_len == prefix_len && route->metric > metric))
+            break;
+    }
+    if (array_insert(&tcpips->routes.table, i) == NULL)
+        return;
+    route = ROUTE_ITEM(tcpips, i);
+    route->dst.u32.ip = dst.u32.ip;
+    route->mask.u32.ip = mask.u32.ip;
+    route->gateway.u32.ip = ipc->param2;
+    route->prefix_len = prefix_len;
+    route->metric = metric;
+    routes_flush_cache(tcpips);
+    ipc->param2 = 0;
+#if (IP_DEBUG)
+    printf("IP: route added ");
+    ip_print(&route->dst);
+    printf("/%d via ", prefix_len);
+    ip_print(&route->gateway);
+    printf(" metric %d\n", metric);
+#endif //IP_DEBUG
 }
 
-void routes_not_resolved(TCPIPS* tcpips, const IP* ip)
+static inline void routes_remove(TCPIPS* tcpips, IPC* ipc)
 {
-    int i;
-    for (i = 0; i < array_size(tcpips->routes.tx_queue); ++i)
-        if (ROUTE_QUEUE_ITEM(tcpips, i)->ip.u32.ip == ip->u32.ip)
+    unsigned int i;
+    ROUTE_ENTRY* route;
+    bool found = false;
+    uint8_t prefix_len = ipc->param3 & 0xff;
+    for (i = 0; i < array_size(tcpips->routes.table); )
+    {
+        route = ROUTE_ITEM(tcpips, i);
+        //zero gateway matches any
+        if (route->dst.u32.ip == (ipc->param1 & route->mask.u32.ip) && route->prefix_len == prefix_len &&
+            (ipc->param2 == 0 || route->gateway.u32.ip == ipc->param2))
         {
-#if (ICMP)
-            icmps_no_route(tcpips, ROUTE_QUEUE_ITEM(tcpips, i)->io);
-#endif //ICMP
-            //drop if not resolved
-            tcpips_release_io(tcpips, ROUTE_QUEUE_ITEM(tcpips, i)->io);
-            array_remove(&tcpips->routes.tx_queue, i);
+            array_remove(&tcpips->routes.table, i);
+            found = true;
         }
+        else
+            ++i;
+    }
+    if (!found)
+    {
+        error(ERROR_NOT_FOUND);
+        return;
+    }
+    routes_flush_cache(tcpips);
+    ipc->param2 = 0;
+}
+
+static inline void routes_flush(TCPIPS* tcpips)
+{
+    array_clear(&tcpips->routes.table);
+    routes_flush_cache(tcpips);
+}
+
+void routes_request(TCPIPS* tcpips, IPC* ipc)
+{
+    switch (HAL_ITEM(ipc->cmd))
+    {
+    case IP_ADD_ROUTE:
+        routes_add(tcpips, ipc);
+        break;
+    case IP_REMOVE_ROUTE:
+        routes_remove(tcpips, ipc);
+        break;
+    case IP_FLUSH_ROUTES:
+        routes_flush(tcpips);
+        break;
+    default:
+        error(ERROR_NOT_SUPPORTED);
+        break;
+    }
 }
 
 void routes_tx(TCPIPS* tcpips, IO* io, const IP* target)
 {
-    ROUTE_QUEUE_ENTRY* item;
-    //for gateway support forward should be declared here
     MAC mac;
-    if (arps_resolve(tcpips, target, &mac))
-        macs_tx(tcpips, io, &mac, ETHERTYPE_IP);
+    IP next_hop;
+    if (target->u32.ip == BROADCAST)
+        next_hop.u32.ip = target->u32.ip;
     else
-    {
-        //queue before address is resolved
-        array_append(&tcpips->routes.tx_queue);
-        item = ROUTE_QUEUE_ITEM(tcpips, array_size(tcpips->routes.tx_queue) - 1);
-        item->io = io;
-        item->ip.u32.ip = target->u32.ip;
-    }
+        routes_lookup(tcpips, target, &next_hop);
+    //not resolved frames are queued by ARP
+    if (arps_resolve(tcpips, io, &next_hop, &mac))
+        macs_tx(tcpips, io, &mac, ETHERTYPE_IP);
 }
@@ -8,28 +8,32 @@
 #define ROUTES_H
 
 /*
-    routing. Lookup router address by target IP. For now is just stub, always returning target IP.
+    routing. Lookup next hop address by target IP. Longest prefix match, with per-destination cache.
+    Target is on-link, if no route found or route has no gateway.
  */
 
 #include "tcpips.h"
 #include "../../userspace/eth.h"
 #include "../../userspace/ip.h"
 #include "../../userspace/array.h"
+#include "../../userspace/ipc.h"
+#include "sys_config.h"
 
 typedef struct {
-    ARRAY* tx_queue;
+    IP dst;
+    IP next_hop;
+} ROUTE_CACHE_ENTRY;
+
+typedef struct {
+    //sorted by prefix length, than by metric - first match is the best
+    ARRAY* table;
+    ROUTE_CACHE_ENTRY cache[IP_ROUTE_CACHE_SIZE];
 } ROUTES;
 
 //called from tcpip
 void routes_init(TCPIPS* tcpips);
-bool routes_drop(TCPIPS* tcpips);
-void routes_link_changed(TCPIPS* tcpips, bool link);
-
-//called from arp
-void routes_resolved(TCPIPS* tcpips, const IP* ip, const MAC* mac);
-void routes_not_resolved(TCPIPS* tcpips, const IP* ip);
-
 //called from ip
+void routes_request(TCPIPS* tcpips, IPC* ipc);
 void routes_tx(TCPIPS* tcpips, IO* io, const IP* target);
 
 #endif // ROUTES_H
@@ -0,0 +1,82 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#include "tcpcc.h"
+
+static void newreno_init(TCP_CC* cc, unsigned int mss)
+{
+    cc->mss = mss;
+    //initial window, RFC 5681 3.1
+    if (mss > 2190)
+        cc->cwnd = 2 * mss;
+    else if (mss > 1095)
+        cc->cwnd = 3 * mss;
+    else
+        cc->cwnd = 4 * mss;
+    cc->ssthresh = 0xffffffff;
+    cc->dup_acks = 0;
+    cc->recovery = false;
+}
+
+static void newreno_ack(TCP_CC* cc, unsigned int acked, unsigned int flight, bool partial)
+{
+    cc->dup_acks = 0;
+    if (cc->recovery)
+    {
+        //deflate by amount of new data acked, add back one mss
+        if (partial)
+        {
+            cc->cwnd = (cc->cwnd > acked ? cc->cwnd - acked : 0) + cc->mss;
+            return;
+        }
+        //full ack - exit fast recovery
+        if (flight < cc->mss)
+            flight = cc->mss;
+        cc->cwnd = flight + cc->mss < cc->ssthresh ? flight + cc->mss : cc->ssthresh;
+        cc->recovery = false;
+        return;
+    }
+    //slow start
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd += acked < cc->mss ? acked : cc->mss;
+    //congestion avoidance: about one mss per RTT
+    else
+        cc->cwnd += cc->mss * cc->mss / cc->cwnd ? cc->mss * cc->mss / cc->cwnd : 1;
+}
+
+static bool newreno_dup_ack(TCP_CC* cc)
+{
+    //inflate window by segment, that left the network
+    if (cc->recovery)
+    {
+        cc->cwnd += cc->mss;
+        return false;
+    }
+    return ++cc->dup_acks == TCP_CC_DUP_ACK_THRESH;
+}
+
+static void newreno_loss(TCP_CC* cc, unsigned int flight, bool timeout)
+{
+    cc->ssthresh = flight / 2 > 2 * cc->mss ? flight / 2 : 2 * cc->mss;
+    cc->dup_acks = 0;
+    if (timeout)
+    {
+        cc->cwnd = cc->mss;
+        cc->recovery = false;
+    }
+    else
+    {
+        cc->cwnd = cc->ssthresh + TCP_CC_DUP_ACK_THRESH * cc->mss;
+        cc->recovery = true;
+    }
+}
+
+const TCP_CC_OPS __TCP_CC_NEWRENO = {
+    newreno_init,
+    newreno_ack,
+    newreno_dup_ack,
+    newreno_loss
+};
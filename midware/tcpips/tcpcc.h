@@ -0,0 +1,35 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+#ifndef TCPCC_H
+#define TCPCC_H
+
+#include "../../userspace/types.h"
+
+//duplicate acks before fast retransmit
+#define TCP_CC_DUP_ACK_THRESH                       3
+
+//state is shared between algorithms, all sizes are in bytes
+typedef struct {
+    uint32_t cwnd, ssthresh;
+    uint16_t mss, dup_acks;
+    bool recovery;
+} TCP_CC;
+
+typedef struct {
+    void (*tcp_cc_init)(TCP_CC*, unsigned int mss);
+    //new data acked. Partial is set, if ack is not covering all data, sent before loss detection
+    void (*tcp_cc_ack)(TCP_CC*, unsigned int acked, unsigned int flight, bool partial);
+    //return true, if fast retransmit required
+    bool (*tcp_cc_dup_ack)(TCP_CC*);
+    //loss detected by duplicate acks or by retransmission timeout
+    void (*tcp_cc_loss)(TCP_CC*, unsigned int flight, bool timeout);
+} TCP_CC_OPS;
+
+//RFC 5681, RFC 6582
+extern const TCP_CC_OPS __TCP_CC_NEWRENO;
+
+#endif // TCPCC_H
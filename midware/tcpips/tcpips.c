@@ -85,7 +85,7 @@ IO* tcpips_allocate_io(TCPIPS* tcpips)
 #endif
         }
         //try to drop first in queue, waiting for resolve
-        else if (routes_drop(tcpips))
+        else if (arps_drop(tcpips))
         {
             io = tcpips_allocate_io_internal(tcpips);
 #if (TCPIP_DEBUG)
@@ -238,7 +238,6 @@ static void tcpips_link_changed_internal(TCPIPS* tcpips, ETH_CONN_TYPE conn)
     }
     macs_link_changed(tcpips, tcpips->connected);
     arps_link_changed(tcpips, tcpips->connected);
-    routes_link_changed(tcpips, tcpips->connected);
 #if (ICMP)
     icmps_link_changed(tcpips, tcpips->connected);
 #endif //ICMP
@@ -315,9 +314,10 @@ static inline void tcpips_timer(TCPIPS* tcpips)
         //forward to others
         arps_timer(tcpips, tcpips->seconds);
         icmps_timer(tcpips, tcpips->seconds);
-#if (IP_FRAGMENTATION)
         ips_timer(tcpips, tcpips->seconds);
-#endif //IP_FRAGMENTATION
+#if (DHCPS)
+        dhcps_timer(tcpips, tcpips->seconds);
+#endif //DHCPS
         timer_start_ms(tcpips->timer, 1000);
     }
 }
@@ -11,7 +11,9 @@
 #include "../../userspace/endian.h"
 #include "../../userspace/systime.h"
 #include "../../userspace/error.h"
+#include "../../userspace/stdlib.h"
 #include "icmps.h"
+#include "tcpcc.h"
 #include <string.h>
 
 #define TCP_MSS_MAX                                      (IP_FRAME_MAX_DATA_SIZE - sizeof(TCP_HEADER))
@@ -19,6 +21,22 @@
 
 #define MSL_MS                                           60000
 
+//rest of frames are for tx and other protocols
+#define TCP_OOO_TOTAL_MAX                                (TCPIP_MAX_FRAMES_COUNT / 2)
+
+#define TCP_TIMER_IDLE                                   0xffffffff
+#define TCP_TW_AT(tcpips, i)                             ((TCP_TW*)array_at((tcpips)->tcps.tw, (i)))
+#define TCP_TIMER_AT(tcpips, pos)                        ((TCP_TIMER*)array_at((tcpips)->tcps.timers, (pos)))
+
+//cookie: 5 bits of time counter, 3 bits of MSS index, 24 bits of hash. Time counter is incremented every 65s
+#define TCP_COOKIE_TIME_SHIFT                            16
+#define TCP_COOKIE_MSS_COUNT                             4
+
+#define TCP_WSCALE_MAX                                   14
+//3 blocks with 2 bytes header, aligned
+#define TCP_SACK_BLOCKS_MAX                              3
+#define TCP_SACK_OPT_SIZE                                ((2 + TCP_SACK_BLOCKS_MAX * 8 + 3) & ~3)
+
 #pragma pack(push, 1)
 typedef struct {
     uint8_t src_port_be[2];
@@ -40,9 +58,22 @@ typedef struct {
 } TCP_OPT;
 #pragma pack(pop)
 
+//half-open connection. Full TCB is allocated only after final ACK
 typedef struct {
-    HANDLE process;
+    IP remote_addr;
+    uint32_t irs, iss, time;
+    uint16_t remote_port, mss;
+    uint8_t snd_wscale;
+    bool wscale_ok, sack_ok, rexmit;
+} TCP_SYN;
+
+typedef struct {
+    HANDLE process, next;
     uint16_t port;
+    uint8_t syn_count;
+    //SYN answered with cookie, SYN or final ACK dropped
+    unsigned int cookies, drops;
+    TCP_SYN syn[TCP_SYN_BACKLOG];
 } TCP_LISTEN_HANDLE;
 
 typedef enum {
@@ -55,30 +86,84 @@ typedef enum {
     TCP_STATE_FIN_WAIT_2,
     TCP_STATE_CLOSING,
     TCP_STATE_LAST_ACK,
+    //TCB is destroyed at once, compact entry is kept instead
+    TCP_STATE_TIME_WAIT,
     TCP_STATE_MAX
 } TCP_STATE;
 
+typedef struct {
+    uint32_t expire;
+    HANDLE handle;
+} TCP_TIMER;
+
+//TIME WAIT is kept without TCB
+typedef struct {
+    IP remote_addr;
+    uint32_t snd_nxt, rcv_nxt, expire;
+    uint16_t remote_port, local_port;
+} TCP_TW;
+
+//retransmission queue entry. Data is not copied, segment is rebuilt from user tx on retransmit
+typedef struct {
+    uint32_t seq;
+    uint16_t len;
+    bool fin, sacked, rexmit;
+} TCP_SEG;
+
 typedef struct {
     HANDLE process;
     IP remote_addr;
     IO* rx;
     IO* rx_tmp;
+    //write in progress. Following writes are chained by pointer, pushed over TCP_STACK
     IO* tx;
-    HANDLE timer;
-    unsigned int tx_cur, rx_cur;
-    uint32_t snd_una, snd_nxt, rcv_nxt;
+    IO* tx_queue;
+    HANDLE hash_next;
+    //position in timers heap
+    unsigned int timer_pos;
+    unsigned int tx_cur;
+    //send buffer, starting from snd_una. Pushed and urgent data end are offsets from snd_una, 0 if none
+    uint8_t* snd_buf;
+    unsigned int snd_head, snd_len, snd_psh, snd_urg;
+    uint32_t snd_una, snd_nxt, rcv_nxt, recover, sack_last;
+    unsigned int rx_wnd, tx_wnd;
+    TCP_SEG seg[TCP_TX_SEGMENTS_MAX];
+    //out-of-order queue, sorted by seq, not overlapped
+    IO* ooo[TCP_OOO_SEGMENTS_MAX];
+    //zero-copy frames, not taken by user yet
+    IO* zc[TCP_ZC_FRAMES_MAX];
+    //zero-copy frames, taken by user and not released yet
+    IO* zc_out[TCP_ZC_FRAMES_MAX];
+    //RFC 6298. srtt is scaled by 8, rttvar by 4. One segment is timed at once
+    uint32_t rtt_seq, rtt_start;
+    unsigned int srtt, rttvar, rto, retransmits, options;
+    //RFC 5482 user timeout, ms, 0 - limited by retry count only. Counted from last ack progress
+    unsigned int user_timeout;
+    uint32_t una_time;
+    //keep-alive, s. Idle 0 - disabled
+    uint16_t ka_idle, ka_interval;
+    uint8_t ka_count, ka_probes;
+    const TCP_CC_OPS* cc_ops;
+    TCP_CC cc;
 
     TCP_STATE state;
-    uint16_t remote_port, local_port, mss, rx_wnd, tx_wnd, retry;
-    bool active, transmit, fin;
+    //mss is effective, limited by path MTU. peer_mss is announced by remote
+    uint16_t remote_port, local_port, mss, peer_mss, retry;
+    uint8_t seg_head, seg_count, ooo_count, zc_count, zc_held, snd_wscale, rcv_wscale;
+    //rx_fin: remote FIN is acked, but processing is deferred until user reads all data
+    bool active, transmit, fin, fin_sent, rx_fin, rtt_timing, wnd_update, wscale_ok, sack_ok, ack_pending, zc_wait;
 } TCP_TCB;
 
+#if (TCP_SYN_COOKIES)
+static const uint16_t __TCP_COOKIE_MSS[TCP_COOKIE_MSS_COUNT] =      {536, 1220, 1440, 1460};
+#endif //TCP_SYN_COOKIES
+
 #if (TCP_DEBUG_PACKETS)
 static const char* __TCP_FLAGS[TCP_FLAGS_COUNT] =                   {"FIN", "SYN", "RST", "PSH", "ACK", "URG"};
 #endif //TCP_DEBUG_PACKETS
 #if (TCP_DEBUG_FLOW)
 static const char* __TCP_STATES[TCP_STATE_MAX] =                    {"CLOSED", "LISTEN", "SYN SENT", "SYN RECEIVED", "ESTABLISHED", "FIN WAIT1",
-                                                                     "FIN WAIT2", "CLOSING", "LAST ACK"};
+                                                                     "FIN WAIT2", "CLOSING", "LAST ACK", "TIME WAIT"};
 #endif //TCP_DEBUG_FLOW
 
 static inline unsigned int tcps_data_offset(IO* io)
@@ -105,6 +190,44 @@ static inline unsigned int tcps_seg_len(IO* io)
     return res;
 }
 
+static inline uint32_t tcps_seg_seq(IO* io)
+{
+    TCP_HEADER* tcp = io_data(io);
+    return be2int(tcp->seq_be);
+}
+
+//remove size sequence bytes from segment start. SYN is not expected
+static void tcps_seg_trim_front(IO* io, unsigned int size)
+{
+    unsigned int data_off, data_len;
+    TCP_HEADER* tcp = io_data(io);
+    data_off = tcps_data_offset(io);
+    data_len = tcps_data_len(io);
+    //FIN is not in data, but occupying virtual byte
+    if (size > data_len)
+        size = data_len;
+    memmove((uint8_t*)io_data(io) + data_off, (uint8_t*)io_data(io) + data_off + size, data_len - size);
+    io->data_size -= size;
+    int2be(tcp->seq_be, be2int(tcp->seq_be) + size);
+}
+
+//leave only size sequence bytes in segment
+static void tcps_seg_trim_back(IO* io, unsigned int size)
+{
+    unsigned int data_len;
+    TCP_HEADER* tcp = io_data(io);
+    if (tcps_seg_len(io) <= size)
+        return;
+    //FIN is last virtual byte, remove it first
+    tcp->flags &= ~TCP_FLAG_FIN;
+    data_len = tcps_data_len(io);
+    //still don't fit? remove some data
+    if (data_len > size)
+        io->data_size -= data_len - size;
+    //remove PSH flag, cause it's goes after all bytes
+    tcp->flags &= ~TCP_FLAG_PSH;
+}
+
 static uint32_t tcps_delta(uint32_t from, uint32_t to)
 {
     if (to >= from)
@@ -124,6 +247,12 @@ static int tcps_diff(uint32_t from, uint32_t to)
     return 0x10000;
 }
 
+//sequence a is before b
+static inline bool tcps_seq_lt(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
 static unsigned int tcps_get_first_opt(IO* io)
 {
     TCP_OPT* opt;
@@ -194,6 +323,27 @@ static void tcps_append_mss(IO* io)
     tcps_append_opt(io, TCP_OPTS_MSS, mss_be, 2 + 2);
 }
 
+static void tcps_append_wscale(IO* io, uint8_t shift)
+{
+    tcps_append_opt(io, TCP_OPTS_WSCALE, &shift, 2 + 1);
+}
+
+static void tcps_append_sack_permitted(IO* io)
+{
+    tcps_append_opt(io, TCP_OPTS_SACK_PERMITTED, NULL, 2);
+}
+
+static void tcps_append_uto(IO* io, unsigned int ms)
+{
+    uint8_t uto_be[2];
+    unsigned int uto = ms / 1000;
+    //granularity: minutes if not fit in seconds
+    if (uto > 0x7fff)
+        uto = (uto / 60 > 0x7fff ? 0x7fff : uto / 60) | 0x8000;
+    short2be(uto_be, uto);
+    tcps_append_opt(io, TCP_OPTS_UTO, uto_be, 2 + 2);
+}
+
 #if (TCP_DEBUG_PACKETS)
 static void tcps_debug(IO* io, const IP* src, const IP* dst)
 {
@@ -243,6 +393,17 @@ static void tcps_debug(IO* io, const IP* src, const IP* dst)
             case TCP_OPTS_MSS:
                 printf("MSS:%d", be2short(opt->data));
                 break;
+            case TCP_OPTS_WSCALE:
+                printf("WS:%d", opt->data[0]);
+                break;
+            case TCP_OPTS_SACK_PERMITTED:
+                printf("SACK_PERM");
+                break;
+            case TCP_OPTS_SACK:
+                printf("SACK");
+                for (j = 0; j + 8 <= opt->len - 2; j += 8)
+                    printf(":%u-%u", be2int(opt->data + j), be2int(opt->data + j + 4));
+                break;
             default:
                 printf("K%d", opt->kind);
                 for (j = 0; j < opt->len - 2; ++j)
@@ -273,6 +434,9 @@ static inline void tcps_set_state(TCP_TCB* tcb, TCP_STATE state)
 #endif //TCP_DEBUG_FLOW
     tcb->state = state;
     tcb->retry = 0;
+    //mss is negotiated now
+    if (state == TCP_STATE_ESTABLISHED)
+        tcb->cc_ops->tcp_cc_init(&tcb->cc, tcb->mss);
 }
 
 static uint32_t tcps_gen_isn()
@@ -283,28 +447,194 @@ static uint32_t tcps_gen_isn()
     return (uptime.sec % 17179) + (uptime.usec >> 2);
 }
 
+static uint32_t tcps_ms()
+{
+    SYSTIME uptime;
+    get_uptime(&uptime);
+    return uptime.sec * 1000 + uptime.usec / 1000;
+}
+
+static void tcps_rtt_start(TCP_TCB* tcb, uint32_t seq)
+{
+    if (tcb->rtt_timing)
+        return;
+    tcb->rtt_seq = seq;
+    tcb->rtt_start = tcps_ms();
+    tcb->rtt_timing = true;
+}
+
+//called on snd_una update
+static void tcps_rtt_ack(TCP_TCB* tcb)
+{
+    unsigned int rtt;
+    int delta;
+    if (!tcb->rtt_timing || !tcps_seq_lt(tcb->rtt_seq, tcb->snd_una))
+        return;
+    tcb->rtt_timing = false;
+    rtt = tcps_ms() - tcb->rtt_start;
+    //clock granularity
+    if (rtt == 0)
+        rtt = 1;
+    if (tcb->srtt == 0)
+    {
+        tcb->srtt = rtt << 3;
+        tcb->rttvar = rtt << 1;
+    }
+    else
+    {
+        //SRTT = 7/8 SRTT + 1/8 R, RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|
+        delta = (int)rtt - (int)(tcb->srtt >> 3);
+        tcb->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        tcb->rttvar += delta - (tcb->rttvar >> 2);
+    }
+    //RTO = SRTT + max(4 * RTTVAR, RTO_MIN). Variance is bounded, so remote delayed ACK is not causing spurious retransmit
+    tcb->rto = (tcb->srtt >> 3) + (tcb->rttvar > TCP_RTO_MIN ? tcb->rttvar : TCP_RTO_MIN);
+    if (tcb->rto > TCP_RTO_MAX)
+        tcb->rto = TCP_RTO_MAX;
+}
+
+static void tcps_rto_backoff(TCP_TCB* tcb)
+{
+    //Karn's algorithm: retransmitted segment can't be timed
+    tcb->rtt_timing = false;
+    tcb->rto <<= 1;
+    if (tcb->rto > TCP_RTO_MAX)
+        tcb->rto = TCP_RTO_MAX;
+}
+
 static bool tcps_update_rx_wnd(TCP_TCB* tcb)
 {
-    bool need_update = tcb->rx_wnd < (TCP_MSS_MAX / 2);
+    unsigned int old_wnd = tcb->rx_wnd;
     tcb->rx_wnd = TCP_MSS_MAX;
     if (tcb->rx != NULL)
         tcb->rx_wnd += io_get_free(tcb->rx);
     if (tcb->rx_tmp != NULL)
         tcb->rx_wnd = io_get_free(tcb->rx_tmp);
-    return need_update;
+    //each segment holds frame until released by user
+    if (tcb->options & TCP_OPTION_ZERO_COPY)
+        tcb->rx_wnd = (TCP_ZC_FRAMES_MAX - tcb->zc_count - tcb->zc_held) * TCP_MSS_MAX;
+    //window was closed or opened by full segment. Don't wait for delayed ACK to tell remote
+    return (old_wnd < (TCP_MSS_MAX / 2)) || (tcb->rx_wnd >= old_wnd + TCP_MSS_MAX);
+}
+
+//re-arm kernel timer, if expire is earlier. Later expire is checked after kernel timer fires
+static void tcps_timer_arm(TCPIPS* tcpips, uint32_t expire)
+{
+    int ms;
+    if (tcpips->tcps.timer_active)
+    {
+        if ((int)(expire - tcpips->tcps.timer_expire) >= 0)
+            return;
+        timer_stop(tcpips->tcps.timer, ANY_HANDLE, HAL_TCP);
+    }
+    ms = (int)(expire - tcps_ms());
+    timer_start_ms(tcpips->tcps.timer, ms > 0 ? ms : 1);
+    tcpips->tcps.timer_expire = expire;
+    tcpips->tcps.timer_active = true;
+}
+
+static void tcps_timer_place(TCPIPS* tcpips, unsigned int pos, const TCP_TIMER* timer)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, timer->handle);
+    *TCP_TIMER_AT(tcpips, pos) = *timer;
+    tcb->timer_pos = pos;
+}
+
+static void tcps_timer_sift(TCPIPS* tcpips, unsigned int pos)
+{
+    TCP_TIMER timer;
+    unsigned int child, size;
+    timer = *TCP_TIMER_AT(tcpips, pos);
+    //up
+    for (; pos && ((int)(timer.expire - TCP_TIMER_AT(tcpips, (pos - 1) >> 1)->expire) < 0); pos = (pos - 1) >> 1)
+        tcps_timer_place(tcpips, pos, TCP_TIMER_AT(tcpips, (pos - 1) >> 1));
+    //down
+    size = array_size(tcpips->tcps.timers);
+    for (; (child = (pos << 1) + 1) < size; pos = child)
+    {
+        if ((child + 1 < size) && ((int)(TCP_TIMER_AT(tcpips, child + 1)->expire - TCP_TIMER_AT(tcpips, child)->expire) < 0))
+            ++child;
+        if ((int)(TCP_TIMER_AT(tcpips, child)->expire - timer.expire) >= 0)
+            break;
+        tcps_timer_place(tcpips, pos, TCP_TIMER_AT(tcpips, child));
+    }
+    tcps_timer_place(tcpips, pos, &timer);
+}
+
+static void tcps_timer_stop(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TIMER last;
+    unsigned int pos, size;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb->timer_pos == TCP_TIMER_IDLE)
+        return;
+    pos = tcb->timer_pos;
+    tcb->timer_pos = TCP_TIMER_IDLE;
+    size = array_size(tcpips->tcps.timers);
+    last = *TCP_TIMER_AT(tcpips, size - 1);
+    array_remove(&tcpips->tcps.timers, size - 1);
+    if (pos == size - 1)
+        return;
+    *TCP_TIMER_AT(tcpips, pos) = last;
+    tcps_timer_sift(tcpips, pos);
+}
+
+static void tcps_timer_set(TCPIPS* tcpips, HANDLE tcb_handle, unsigned int ms)
+{
+    TCP_TIMER* timer;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb->timer_pos == TCP_TIMER_IDLE)
+    {
+        if ((timer = array_append(&tcpips->tcps.timers)) == NULL)
+            return;
+        tcb->timer_pos = array_size(tcpips->tcps.timers) - 1;
+        timer->handle = tcb_handle;
+    }
+    timer = TCP_TIMER_AT(tcpips, tcb->timer_pos);
+    timer->expire = tcps_ms() + ms;
+    tcps_timer_sift(tcpips, tcb->timer_pos);
+    tcps_timer_arm(tcpips, TCP_TIMER_AT(tcpips, 0)->expire);
+}
+
+//retransmission timeout, but don't wait after user timeout is expired
+static unsigned int tcps_rto_left(TCP_TCB* tcb)
+{
+    int left;
+    if (tcb->user_timeout == 0)
+        return tcb->rto;
+    left = (int)(tcb->una_time + tcb->user_timeout - tcps_ms());
+    if (left <= 0)
+        return 1;
+    return (unsigned int)left < tcb->rto ? (unsigned int)left : tcb->rto;
 }
 
-static void tcps_timer_start(TCP_TCB* tcb)
+static void tcps_timer_start(TCPIPS* tcpips, HANDLE tcb_handle)
 {
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
     switch (tcb->state)
     {
+    case TCP_STATE_SYN_SENT:
+    case TCP_STATE_SYN_RECEIVED:
+        tcps_timer_set(tcpips, tcb_handle, tcps_rto_left(tcb));
+        break;
     case TCP_STATE_ESTABLISHED:
-#if !(TCP_KEEP_ALIVE)
+        //idle
         if (!tcb->transmit)
+        {
+            if (tcb->ka_idle)
+                tcps_timer_set(tcpips, tcb_handle, (tcb->ka_probes ? tcb->ka_interval : tcb->ka_idle) * 1000);
+            else
+                tcps_timer_stop(tcpips, tcb_handle);
             break;
-#endif //!TCP_KEEP_ALIVE
+        }
     default:
-        timer_start_ms(tcb->timer, TCP_TIMEOUT);
+        //unacked segments or zero window probe
+        if (tcb->seg_count || (tcb->snd_len && (tcb->tx_wnd == 0)))
+            tcps_timer_set(tcpips, tcb_handle, tcps_rto_left(tcb));
+        else
+            tcps_timer_set(tcpips, tcb_handle, TCP_TIMEOUT);
     }
 }
 
@@ -326,29 +656,115 @@ static void tcps_rx_flush(TCPIPS* tcpips, HANDLE tcb_handle)
     }
     if (tcb->rx_tmp)
     {
-        ips_release_io(tcpips, tcb->rx_tmp);
+        //segment in processing is released by tcps_rx
+        if (tcb->rx_tmp != tcpips->tcps.rx_io)
+            ips_release_io(tcpips, tcb->rx_tmp);
         tcb->rx_tmp = NULL;
     }
+    for (; tcb->zc_count; --tcb->zc_count)
+        if (tcb->zc[tcb->zc_count - 1] != tcpips->tcps.rx_io)
+            ips_release_io(tcpips, tcb->zc[tcb->zc_count - 1]);
+    if (tcb->zc_wait)
+    {
+        ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, TCP_GET_FRAME), tcb_handle, 0, ERROR_CONNECTION_CLOSED);
+        tcb->zc_wait = false;
+    }
 }
 
-static HANDLE tcps_find_listener(TCPIPS* tcpips, uint16_t port)
+static void tcps_ooo_remove(TCPIPS* tcpips, TCP_TCB* tcb, unsigned int index)
+{
+    --tcb->ooo_count;
+    --tcpips->tcps.ooo_count;
+    memmove(tcb->ooo + index, tcb->ooo + index + 1, (tcb->ooo_count - index) * sizeof(IO*));
+}
+
+static void tcps_ooo_flush(TCPIPS* tcpips, TCP_TCB* tcb)
+{
+    while (tcb->ooo_count)
+    {
+        if (tcb->ooo[0] != tcpips->tcps.rx_io)
+            ips_release_io(tcpips, tcb->ooo[0]);
+        tcps_ooo_remove(tcpips, tcb, 0);
+    }
+}
+
+//frame is queued on TCB and must not be released
+static bool tcps_rx_holds(TCP_TCB* tcb, IO* io)
+{
+    unsigned int i;
+    if (tcb->rx_tmp == io)
+        return true;
+    for (i = 0; i < tcb->ooo_count; ++i)
+        if (tcb->ooo[i] == io)
+            return true;
+    for (i = 0; i < tcb->zc_count; ++i)
+        if (tcb->zc[i] == io)
+            return true;
+    return false;
+}
+
+static inline unsigned int tcps_hash(const IP* remote_addr, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t hash = remote_addr->u32.ip ^ (((uint32_t)remote_port << 16) | local_port);
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return hash & (TCP_HASH_SIZE - 1);
+}
+
+static inline unsigned int tcps_listen_hash(uint16_t port)
+{
+    return (port ^ (port >> 8)) & (TCP_LISTEN_HASH_SIZE - 1);
+}
+
+static void tcps_hash_insert(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    unsigned int hash = tcps_hash(&tcb->remote_addr, tcb->remote_port, tcb->local_port);
+    tcb->hash_next = tcpips->tcps.tcb_hash[hash];
+    tcpips->tcps.tcb_hash[hash] = tcb_handle;
+}
+
+static void tcps_hash_remove(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    HANDLE* cur;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    for (cur = &tcpips->tcps.tcb_hash[tcps_hash(&tcb->remote_addr, tcb->remote_port, tcb->local_port)]; *cur != INVALID_HANDLE;
+         cur = &((TCP_TCB*)so_get(&tcpips->tcps.tcbs, *cur))->hash_next)
+    {
+        if (*cur == tcb_handle)
+        {
+            *cur = tcb->hash_next;
+            return;
+        }
+    }
+}
+
+static TCP_LISTEN_HANDLE* tcps_find_listen_handle(TCPIPS* tcpips, uint16_t port)
 {
     HANDLE handle;
     TCP_LISTEN_HANDLE* tlh;
-    for (handle = so_first(&tcpips->tcps.listen); handle != INVALID_HANDLE; handle = so_next(&tcpips->tcps.listen, handle))
+    for (handle = tcpips->tcps.listen_hash[tcps_listen_hash(port)]; handle != INVALID_HANDLE; handle = tlh->next)
     {
         tlh = so_get(&tcpips->tcps.listen, handle);
         if (tlh->port == port)
-            return tlh->process;
+            return tlh;
     }
-    return INVALID_HANDLE;
+    return NULL;
+}
+
+static HANDLE tcps_find_listener(TCPIPS* tcpips, uint16_t port)
+{
+    TCP_LISTEN_HANDLE* tlh = tcps_find_listen_handle(tcpips, port);
+    if (tlh == NULL)
+        return INVALID_HANDLE;
+    return tlh->process;
 }
 
 static HANDLE tcps_find_tcb(TCPIPS* tcpips, const IP* src, uint16_t remote_port, uint16_t local_port)
 {
     HANDLE handle;
     TCP_TCB* tcb;
-    for (handle = so_first(&tcpips->tcps.tcbs); handle != INVALID_HANDLE; handle = so_next(&tcpips->tcps.tcbs, handle))
+    for (handle = tcpips->tcps.tcb_hash[tcps_hash(src, remote_port, local_port)]; handle != INVALID_HANDLE; handle = tcb->hash_next)
     {
         tcb = so_get(&tcpips->tcps.tcbs, handle);
         if (tcb->remote_port == remote_port && tcb->local_port == local_port && tcb->remote_addr.u32.ip == src->u32.ip)
@@ -370,11 +786,24 @@ static HANDLE tcps_find_tcb_local_port(TCPIPS* tcpips, uint16_t local_port)
     return INVALID_HANDLE;
 }
 
+//effective mss. IP header options are not used, TCP options are not counted
+static bool tcps_update_mss(TCPIPS* tcpips, TCP_TCB* tcb)
+{
+    unsigned int mss = ips_pmtu(tcpips, &tcb->remote_addr) - sizeof(IP_HEADER) - sizeof(TCP_HEADER);
+    uint16_t old_mss = tcb->mss;
+    if (mss > tcb->peer_mss)
+        mss = tcb->peer_mss;
+    if (mss < TCP_MSS_MIN)
+        mss = TCP_MSS_MIN;
+    tcb->mss = mss;
+    return tcb->mss < old_mss;
+}
+
 static HANDLE tcps_create_tcb_internal(TCPIPS* tcpips, const IP* remote_addr, uint16_t remote_port, uint16_t local_port)
 {
     TCP_TCB* tcb;
     HANDLE handle;
-    if (so_count(&tcpips->tcps.tcbs) > TCP_HANDLES_LIMIT)
+    if (TCP_HANDLES_LIMIT && (so_count(&tcpips->tcps.tcbs) > TCP_HANDLES_LIMIT))
     {
         error(ERROR_TOO_MANY_HANDLES);
 #if (TCP_DEBUG)
@@ -386,42 +815,84 @@ static HANDLE tcps_create_tcb_internal(TCPIPS* tcpips, const IP* remote_addr, ui
     if (handle == INVALID_HANDLE)
         return handle;
     tcb = so_get(&tcpips->tcps.tcbs, handle);
-    tcb->timer = timer_create(handle, HAL_TCP);
-    if (tcb->timer == INVALID_HANDLE)
-    {
-        so_free(&tcpips->tcps.tcbs, handle);
-        return INVALID_HANDLE;
-    }
+    tcb->timer_pos = TCP_TIMER_IDLE;
     tcb->retry = 0;
     tcb->process = INVALID_HANDLE;
     tcb->remote_addr.u32.ip = remote_addr->u32.ip;
-    tcb->snd_una = tcb->snd_nxt = 0;
+    tcb->snd_una = tcb->snd_nxt = tcb->recover = 0;
     tcb->rcv_nxt = 0;
     tcb->state = TCP_STATE_CLOSED;
     tcb->remote_port = remote_port;
     tcb->local_port = local_port;
-    tcb->mss = TCP_MSS_MAX;
+    tcb->mss = tcb->peer_mss = TCP_MSS_MAX;
+    tcps_update_mss(tcpips, tcb);
     tcb->active = false;
     tcb->transmit = false;
-    tcb->fin = false;
-    tcb->rx = tcb->tx = tcb->rx_tmp = NULL;
+    tcb->fin = tcb->fin_sent = tcb->rx_fin = false;
+    tcb->rx = tcb->tx = tcb->tx_queue = tcb->rx_tmp = NULL;
     tcb->tx_cur = 0;
+    tcb->snd_buf = NULL;
+    tcb->snd_head = tcb->snd_len = tcb->snd_psh = tcb->snd_urg = 0;
+    tcb->seg_head = tcb->seg_count = 0;
+    tcb->ooo_count = 0;
+    tcb->zc_count = tcb->zc_held = 0;
+    tcb->zc_wait = false;
+    tcb->snd_wscale = 0;
+    tcb->rcv_wscale = TCP_WINDOW_SCALE;
+    tcb->wscale_ok = tcb->sack_ok = false;
+    tcb->options = 0;
+    tcb->user_timeout = TCP_USER_TIMEOUT;
+    tcb->una_time = tcps_ms();
+    tcb->ka_idle = TCP_KEEP_ALIVE ? TCP_KEEP_ALIVE_IDLE : 0;
+    tcb->ka_interval = TCP_KEEP_ALIVE_INTERVAL;
+    tcb->ka_count = TCP_KEEP_ALIVE_COUNT;
+    tcb->ka_probes = 0;
+    tcb->ack_pending = false;
+    tcb->srtt = tcb->rttvar = tcb->retransmits = 0;
+    tcb->rto = TCP_RTO_INITIAL;
+    tcb->rtt_timing = false;
+    tcb->cc_ops = &__TCP_CC_NEWRENO;
+    tcb->cc_ops->tcp_cc_init(&tcb->cc, tcb->mss);
     tcps_update_rx_wnd(tcb);
     tcb->tx_wnd = 0;
+    tcb->wnd_update = false;
+    tcps_hash_insert(tcpips, handle);
     return handle;
 }
 
+//next queued write to progress
+static void tcps_tx_next(TCP_TCB* tcb)
+{
+    tcb->tx = tcb->tx_queue;
+    tcb->tx_cur = 0;
+    if (tcb->tx == NULL)
+        return;
+    tcb->tx_queue = *((IO**)io_stack(tcb->tx));
+    io_pop(tcb->tx, sizeof(IO*));
+}
+
 static void tcps_destroy_tcb(TCPIPS* tcpips, HANDLE tcb_handle)
 {
+    IO** io;
+    unsigned int i;
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 #if (TCP_DEBUG_FLOW)
     printf("%s -> 0\n", __TCP_STATES[tcb->state]);
 #endif //TCP_DEBUG_FLOW
-    timer_stop(tcb->timer, tcb_handle, HAL_TCP);
-    timer_destroy(tcb->timer);
+    tcps_timer_stop(tcpips, tcb_handle);
     tcps_rx_flush(tcpips, tcb_handle);
-    if (tcb->tx)
+    tcps_ooo_flush(tcpips, tcb);
+    //user can still access frames, taken before close. Lost on out of memory, but never released twice
+    for (i = 0; i < tcb->zc_held; ++i)
+        if ((io = array_append(&tcpips->tcps.zc_closed)) != NULL)
+            *io = tcb->zc_out[i];
+    while (tcb->tx)
+    {
         io_complete_ex(tcb->process, HAL_IO_CMD(HAL_TCP, IPC_WRITE), tcb_handle, tcb->tx, ERROR_CONNECTION_CLOSED);
+        tcps_tx_next(tcb);
+    }
+    free(tcb->snd_buf);
+    tcps_hash_remove(tcpips, tcb_handle);
     so_free(&tcpips->tcps.tcbs, tcb_handle);
 }
 
@@ -431,6 +902,7 @@ static void tcps_close_connection(TCPIPS* tcpips, HANDLE tcb_handle, unsigned in
 
     switch (tcb->state)
     {
+    case TCP_STATE_SYN_SENT:
     case TCP_STATE_SYN_RECEIVED:
         if (tcb->active)
             ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_OPEN), tcb_handle, INVALID_HANDLE, error);
@@ -448,13 +920,84 @@ static void tcps_close_connection(TCPIPS* tcpips, HANDLE tcb_handle, unsigned in
     tcps_destroy_tcb(tcpips, tcb_handle);
 }
 
+static void tcps_tw_purge(TCPIPS* tcpips)
+{
+    unsigned int i;
+    uint32_t now = tcps_ms();
+    for (i = 0; i < array_size(tcpips->tcps.tw); )
+    {
+        //2MSL expired
+        if ((int)(now - TCP_TW_AT(tcpips, i)->expire) >= 0)
+            array_remove(&tcpips->tcps.tw, i);
+        else
+            ++i;
+    }
+}
+
+static TCP_TW* tcps_tw_find(TCPIPS* tcpips, const IP* src, uint16_t remote_port, uint16_t local_port)
+{
+    unsigned int i;
+    TCP_TW* tw;
+    tcps_tw_purge(tcpips);
+    for (i = 0; i < array_size(tcpips->tcps.tw); ++i)
+    {
+        tw = TCP_TW_AT(tcpips, i);
+        if (tw->remote_port == remote_port && tw->local_port == local_port && tw->remote_addr.u32.ip == src->u32.ip)
+            return tw;
+    }
+    return NULL;
+}
+
+static bool tcps_tw_local_port(TCPIPS* tcpips, uint16_t local_port)
+{
+    unsigned int i;
+    for (i = 0; i < array_size(tcpips->tcps.tw); ++i)
+    {
+        if (TCP_TW_AT(tcpips, i)->local_port == local_port)
+            return true;
+    }
+    return false;
+}
+
+//active close is completed. Replace TCB with compact entry for 2MSL
+static void tcps_time_wait(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+#if (TCP_TIME_WAIT)
+    unsigned int i, oldest;
+    TCP_TW* tw;
+    tcps_tw_purge(tcpips);
+    if (array_size(tcpips->tcps.tw) >= TCP_TW_MAX)
+    {
+        //new connections are more important, than old duplicates
+        for (i = 1, oldest = 0; i < array_size(tcpips->tcps.tw); ++i)
+        {
+            if ((int)(TCP_TW_AT(tcpips, i)->expire - TCP_TW_AT(tcpips, oldest)->expire) < 0)
+                oldest = i;
+        }
+        array_remove(&tcpips->tcps.tw, oldest);
+    }
+    if ((tw = array_append(&tcpips->tcps.tw)) != NULL)
+    {
+        tw->remote_addr.u32.ip = tcb->remote_addr.u32.ip;
+        tw->remote_port = tcb->remote_port;
+        tw->local_port = tcb->local_port;
+        tw->snd_nxt = tcb->snd_nxt;
+        tw->rcv_nxt = tcb->rcv_nxt;
+        tw->expire = tcps_ms() + TCP_TIME_WAIT;
+    }
+#endif //TCP_TIME_WAIT
+    tcps_set_state(tcb, TCP_STATE_TIME_WAIT);
+    tcps_destroy_tcb(tcpips, tcb_handle);
+}
+
 static inline uint16_t tcps_allocate_port(TCPIPS* tcpips)
 {
     unsigned int res;
     //from current to HI
     for (res = tcpips->tcps.dynamic; res <= TCPIP_DYNAMIC_RANGE_HI; ++res)
     {
-        if (tcps_find_tcb_local_port(tcpips, res) == INVALID_HANDLE)
+        if ((tcps_find_tcb_local_port(tcpips, res) == INVALID_HANDLE) && !tcps_tw_local_port(tcpips, res))
         {
             tcpips->tcps.dynamic = res == TCPIP_DYNAMIC_RANGE_HI ? TCPIP_DYNAMIC_RANGE_LO : res + 1;
             return (uint16_t)res;
@@ -464,7 +1007,7 @@ static inline uint16_t tcps_allocate_port(TCPIPS* tcpips)
     //from LO to current
     for (res = TCPIP_DYNAMIC_RANGE_LO; res < tcpips->tcps.dynamic; ++res)
     {
-        if (tcps_find_tcb_local_port(tcpips, res) == INVALID_HANDLE)
+        if ((tcps_find_tcb_local_port(tcpips, res) == INVALID_HANDLE) && !tcps_tw_local_port(tcpips, res))
         {
             tcpips->tcps.dynamic = res + 1;
             return res;
@@ -475,18 +1018,40 @@ static inline uint16_t tcps_allocate_port(TCPIPS* tcpips)
     return 0;
 }
 
-static inline bool tcps_set_mss(TCP_TCB* tcb, uint16_t mss)
+static inline bool tcps_set_mss(TCPIPS* tcpips, TCP_TCB* tcb, uint16_t mss)
 {
     if (mss < TCP_MSS_MIN || mss > TCP_MSS_MAX)
         return false;
-    tcb->mss = mss;
+    tcb->peer_mss = mss;
+    tcps_update_mss(tcpips, tcb);
     return true;
 }
 
+//mark segments, received by peer out of order
+static void tcps_sack_update(TCP_TCB* tcb, TCP_OPT* opt)
+{
+    int i;
+    unsigned int j;
+    uint32_t left, right;
+    TCP_SEG* seg;
+    for (i = 0; i + 8 <= opt->len - 2; i += 8)
+    {
+        left = be2int(opt->data + i);
+        right = be2int(opt->data + i + 4);
+        for (j = 0; j < tcb->seg_count; ++j)
+        {
+            seg = &tcb->seg[(tcb->seg_head + j) % TCP_TX_SEGMENTS_MAX];
+            if (!tcps_seq_lt(seg->seq, left) && !tcps_seq_lt(right, seg->seq + seg->len + (seg->fin ? 1 : 0)))
+                seg->sacked = true;
+        }
+    }
+}
+
 static void tcps_apply_options(TCPIPS* tcpips, IO* io, TCP_TCB* tcb)
 {
     int i;
     TCP_OPT* opt;
+    bool syn = (((TCP_HEADER*)io_data(io))->flags & TCP_FLAG_SYN) != 0;
     for (i = tcps_get_first_opt(io); i; i = tcps_get_next_opt(io, i))
     {
         opt = (TCP_OPT*)((uint8_t*)io_data(io) + i);
@@ -494,27 +1059,43 @@ static void tcps_apply_options(TCPIPS* tcpips, IO* io, TCP_TCB* tcb)
         {
         case TCP_OPTS_MSS:
 #if (ICMP)
-            if (!tcps_set_mss(tcb, be2short(opt->data)))
+            if (!tcps_set_mss(tcpips, tcb, be2short(opt->data)))
                 icmps_tx_error(tcpips, io, ICMP_ERROR_PARAMETER, ((IP_STACK*)io_stack(io))->hdr_size + sizeof(TCP_HEADER) + i);
 #else
             tcps_set_mss(tcpips, tcb, be2short(opt->data));
 #endif //ICMP
             break;
+        //negotiated only in SYN
+        case TCP_OPTS_WSCALE:
+            if (syn)
+            {
+                tcb->snd_wscale = opt->data[0] > TCP_WSCALE_MAX ? TCP_WSCALE_MAX : opt->data[0];
+                tcb->wscale_ok = true;
+            }
+            break;
+        case TCP_OPTS_SACK_PERMITTED:
+            if (syn)
+                tcb->sack_ok = TCP_SACK;
+            break;
+        case TCP_OPTS_SACK:
+            if (tcb->sack_ok)
+                tcps_sack_update(tcb, opt);
+            break;
         default:
             break;
         }
     }
 }
 
-static IO* tcps_allocate_io(TCPIPS* tcpips, TCP_TCB* tcb)
+static IO* tcps_allocate_io_ports(TCPIPS* tcpips, uint16_t local_port, uint16_t remote_port)
 {
     TCP_HEADER* tcp;
     IO* io = ips_allocate_io(tcpips, IP_FRAME_MAX_DATA_SIZE, PROTO_TCP);
     if (io == NULL)
         return NULL;
     tcp = io_data(io);
-    short2be(tcp->src_port_be, tcb->local_port);
-    short2be(tcp->dst_port_be, tcb->remote_port);
+    short2be(tcp->src_port_be, local_port);
+    short2be(tcp->dst_port_be, remote_port);
     int2be(tcp->seq_be, 0);
     int2be(tcp->ack_be, 0);
     tcp->data_off = (sizeof(TCP_HEADER) >> 2) << 4;
@@ -525,15 +1106,46 @@ static IO* tcps_allocate_io(TCPIPS* tcpips, TCP_TCB* tcb)
     return io;
 }
 
-static void tcps_tx(TCPIPS* tcpips, IO* io, TCP_TCB* tcb)
+static inline IO* tcps_allocate_io(TCPIPS* tcpips, TCP_TCB* tcb)
+{
+    return tcps_allocate_io_ports(tcpips, tcb->local_port, tcb->remote_port);
+}
+
+//last size bytes of io are already summed by caller
+static void tcps_tx_io_sum(TCPIPS* tcpips, IO* io, const IP* dst, unsigned int size, uint16_t sum)
 {
     TCP_HEADER* tcp = io_data(io);
-    short2be(tcp->window_be, tcb->rx_wnd);
-    short2be(tcp->checksum_be, tcp_checksum(io_data(io), io->data_size, &tcpips->ips.ip, &tcb->remote_addr));
+    unsigned int hdr_size = io->data_size - size;
+    sum = ip_sum_add(ip_sum(tcp, hdr_size, ip_pseudo_sum(&tcpips->ips.ip, dst, PROTO_TCP, io->data_size)), sum, hdr_size);
+    short2be(tcp->checksum_be, (uint16_t)~sum);
 #if (TCP_DEBUG_PACKETS)
-    tcps_debug(io, &tcpips->ips.ip, &tcb->remote_addr);
+    tcps_debug(io, &tcpips->ips.ip, dst);
 #endif //TCP_DEBUG_PACKETS
-    ips_tx(tcpips, io, &tcb->remote_addr);
+    ips_tx(tcpips, io, dst);
+}
+
+static inline void tcps_tx_io(TCPIPS* tcpips, IO* io, const IP* dst)
+{
+    tcps_tx_io_sum(tcpips, io, dst, 0, 0);
+}
+
+static void tcps_tx_sum(TCPIPS* tcpips, IO* io, TCP_TCB* tcb, unsigned int size, uint16_t sum)
+{
+    TCP_HEADER* tcp = io_data(io);
+    unsigned int wnd = tcb->rx_wnd;
+    //window in SYN is never scaled
+    if (tcb->wscale_ok && !(tcp->flags & TCP_FLAG_SYN))
+        wnd >>= tcb->rcv_wscale;
+    short2be(tcp->window_be, wnd > 0xffff ? 0xffff : wnd);
+    //ack is piggybacked
+    if (tcp->flags & TCP_FLAG_ACK)
+        tcb->ack_pending = false;
+    tcps_tx_io_sum(tcpips, io, &tcb->remote_addr, size, sum);
+}
+
+static inline void tcps_tx(TCPIPS* tcpips, IO* io, TCP_TCB* tcb)
+{
+    tcps_tx_sum(tcpips, io, tcb, 0, 0);
 }
 
 static void tcps_tx_rst(TCPIPS* tcpips, HANDLE tcb_handle, uint32_t seq)
@@ -567,11 +1179,50 @@ static void tcps_tx_rst_ack(TCPIPS* tcpips, HANDLE tcb_handle, uint32_t ack)
     tcps_tx(tcpips, tx, tcb);
 }
 
-static void tcps_tx_ack(TCPIPS* tcpips, HANDLE tcb_handle)
+//report out-of-order queue to peer. Most recently received block goes first
+static void tcps_append_sack(IO* io, TCP_TCB* tcb)
+{
+    uint32_t blocks[TCP_OOO_SEGMENTS_MAX][2];
+    uint8_t data[TCP_SACK_BLOCKS_MAX * 8];
+    unsigned int i, j, first, count;
+    uint32_t seq;
+    for (i = 0, count = 0; i < tcb->ooo_count; ++i)
+    {
+        seq = tcps_seg_seq(tcb->ooo[i]);
+        if (count && (blocks[count - 1][1] == seq))
+            blocks[count - 1][1] += tcps_seg_len(tcb->ooo[i]);
+        else
+        {
+            blocks[count][0] = seq;
+            blocks[count][1] = seq + tcps_seg_len(tcb->ooo[i]);
+            ++count;
+        }
+    }
+    for (first = 0; first < count; ++first)
+        if (!tcps_seq_lt(tcb->sack_last, blocks[first][0]) && tcps_seq_lt(tcb->sack_last, blocks[first][1]))
+            break;
+    j = 0;
+    if (first < count)
+    {
+        int2be(data, blocks[first][0]);
+        int2be(data + 4, blocks[first][1]);
+        ++j;
+    }
+    for (i = 0; (i < count) && (j < TCP_SACK_BLOCKS_MAX); ++i)
+    {
+        if (i == first)
+            continue;
+        int2be(data + j * 8, blocks[i][0]);
+        int2be(data + j * 8 + 4, blocks[i][1]);
+        ++j;
+    }
+    tcps_append_opt(io, TCP_OPTS_SACK, data, 2 + j * 8);
+}
+
+static void tcps_tx_ack_internal(TCPIPS* tcpips, TCP_TCB* tcb)
 {
     IO* tx;
     TCP_HEADER* tcp_tx;
-    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 
     if ((tx = tcps_allocate_io(tcpips, tcb)) == NULL)
         return;
@@ -581,16 +1232,23 @@ static void tcps_tx_ack(TCPIPS* tcpips, HANDLE tcb_handle)
     tcp_tx->flags |= TCP_FLAG_ACK;
     int2be(tcp_tx->seq_be, tcb->snd_nxt);
     int2be(tcp_tx->ack_be, tcb->rcv_nxt);
+    if (tcb->sack_ok && tcb->ooo_count)
+        tcps_append_sack(tx, tcb);
     tcps_tx(tcpips, tx, tcb);
-    tcps_timer_start(tcb);
 }
 
-static void tcps_tx_text_ack_fin(TCPIPS* tcpips, HANDLE tcb_handle)
+static void tcps_tx_ack(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    tcps_tx_ack_internal(tcpips, tcb);
+    tcps_timer_start(tcpips, tcb_handle);
+}
+
+//RFC 1122: already acked sequence, remote must reply with ACK
+static void tcps_tx_keep_alive(TCPIPS* tcpips, HANDLE tcb_handle)
 {
     IO* io;
     TCP_HEADER* tcp;
-    TCP_STACK* tcp_stack;
-    unsigned int size;
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 
     if ((io = tcps_allocate_io(tcpips, tcb)) == NULL)
@@ -598,55 +1256,286 @@ static void tcps_tx_text_ack_fin(TCPIPS* tcpips, HANDLE tcb_handle)
 
     tcp = io_data(io);
     tcp->flags |= TCP_FLAG_ACK;
-    int2be(tcp->seq_be, tcb->snd_una);
+    int2be(tcp->seq_be, tcb->snd_nxt - 1);
     int2be(tcp->ack_be, tcb->rcv_nxt);
-    //if no transmit window, request window update, wait timeout, than try again
-    if (tcb->tx_wnd)
+    tcps_tx(tcpips, io, tcb);
+}
+
+static void tcps_delay_ack(TCPIPS* tcpips, TCP_TCB* tcb)
+{
+    tcb->ack_pending = true;
+    if (!tcpips->tcps.ack_timer_active)
     {
-        if (tcb->tx != NULL)
-        {
-            size = tcb->tx->data_size - tcb->tx_cur;
-            if (size > tcb->tx_wnd)
-                size = tcb->tx_wnd;
-            memcpy((uint8_t*)io_data(io) + io->data_size, (uint8_t*)io_data(tcb->tx) + tcb->tx_cur, size);
-            io->data_size += size;
-            //apply flags
-            tcp_stack = io_stack(tcb->tx);
-            if ((tcp_stack->flags & TCP_PSH) && (tcb->tx_cur + size >= tcb->tx->data_size))
-                tcp->flags |= TCP_FLAG_PSH;
-            if ((tcp_stack->flags & TCP_URG) && (tcp_stack->urg_len > tcb->tx_cur))
-            {
-                tcp->flags |= TCP_FLAG_URG;
-                short2be(tcp->urgent_pointer_be, tcp_stack->urg_len - tcb->tx_cur);
-            }
-        }
-        else
-            size = 0;
-        if (tcb->fin && (tcb->snd_una != tcb->snd_nxt) && (size < tcb->tx_wnd))
-            tcp->flags |= TCP_FLAG_FIN;
-        tcps_tx(tcpips, io, tcb);
+        tcpips->tcps.ack_expire = tcps_ms() + TCP_DELAYED_ACK_MS;
+        tcpips->tcps.ack_timer_active = true;
+        tcps_timer_arm(tcpips, tcpips->tcps.ack_expire);
     }
-    tcps_timer_start(tcb);
 }
 
-static void tcps_tx_syn(TCPIPS* tcpips, HANDLE tcb_handle)
+static inline unsigned int tcps_tx_size(TCP_TCB* tcb)
 {
-    IO* io;
-    TCP_HEADER* tcp;
-    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    return tcb->snd_len;
+}
 
-    if ((io = tcps_allocate_io(tcpips, tcb)) == NULL)
-        return;
+//move user data to send buffer. Every user write is completed, once all is buffered
+static void tcps_snd_fill(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_STACK* tcp_stack;
+    unsigned int size, pos, chunk;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    while (tcb->tx != NULL)
+    {
+        tcp_stack = io_stack(tcb->tx);
+        //urgent pointer is relative to write start
+        if ((tcb->tx_cur == 0) && (tcp_stack->flags & TCP_URG))
+            tcb->snd_urg = tcb->snd_len + tcp_stack->urg_len;
+        size = tcb->tx->data_size - tcb->tx_cur;
+        if (size > TCP_SND_BUF_SIZE - tcb->snd_len)
+            size = TCP_SND_BUF_SIZE - tcb->snd_len;
+        pos = (tcb->snd_head + tcb->snd_len) % TCP_SND_BUF_SIZE;
+        chunk = TCP_SND_BUF_SIZE - pos;
+        if (chunk > size)
+            chunk = size;
+        memcpy(tcb->snd_buf + pos, (uint8_t*)io_data(tcb->tx) + tcb->tx_cur, chunk);
+        memcpy(tcb->snd_buf, (uint8_t*)io_data(tcb->tx) + tcb->tx_cur + chunk, size - chunk);
+        tcb->snd_len += size;
+        tcb->tx_cur += size;
+        if (tcb->tx_cur < tcb->tx->data_size)
+            return;
+        if (tcp_stack->flags & TCP_PSH)
+            tcb->snd_psh = tcb->snd_len;
+        io_pop(tcb->tx, sizeof(TCP_STACK));
+        io_complete(tcb->process, HAL_IO_CMD(HAL_TCP, IPC_WRITE), tcb_handle, tcb->tx);
+        tcps_tx_next(tcb);
+    }
+}
+
+//release acked data from send buffer and refill from user write
+static void tcps_snd_ack(TCPIPS* tcpips, HANDLE tcb_handle, unsigned int size)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    //SYN/FIN are not in buffer
+    if (size > tcb->snd_len)
+        size = tcb->snd_len;
+    tcb->snd_head = (tcb->snd_head + size) % TCP_SND_BUF_SIZE;
+    tcb->snd_len -= size;
+    tcb->snd_psh = tcb->snd_psh > size ? tcb->snd_psh - size : 0;
+    tcb->snd_urg = tcb->snd_urg > size ? tcb->snd_urg - size : 0;
+    tcps_snd_fill(tcpips, tcb_handle);
+}
+
+static bool tcps_tx_seg(TCPIPS* tcpips, HANDLE tcb_handle, const TCP_SEG* seg)
+{
+    IO* io;
+    TCP_HEADER* tcp;
+    unsigned int offset, pos, chunk;
+    uint16_t sum = 0;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+
+    if ((io = tcps_allocate_io(tcpips, tcb)) == NULL)
+        return false;
+
+    tcp = io_data(io);
+    tcp->flags |= TCP_FLAG_ACK;
+    if (seg->fin)
+        tcp->flags |= TCP_FLAG_FIN;
+    int2be(tcp->seq_be, seg->seq);
+    int2be(tcp->ack_be, tcb->rcv_nxt);
+    //options are not counted in mss
+    if (tcb->sack_ok && tcb->ooo_count && (seg->len + TCP_SACK_OPT_SIZE <= tcb->mss))
+        tcps_append_sack(io, tcb);
+    if (seg->len)
+    {
+        //segment is never behind snd_una - acked part is cut in tcps_seg_ack
+        offset = tcps_delta(tcb->snd_una, seg->seq);
+        pos = (tcb->snd_head + offset) % TCP_SND_BUF_SIZE;
+        chunk = TCP_SND_BUF_SIZE - pos;
+        if (chunk > seg->len)
+            chunk = seg->len;
+        //payload is summed while copying, second chunk starts at chunk offset
+        sum = ip_copy_sum((uint8_t*)io_data(io) + io->data_size, tcb->snd_buf + pos, chunk, 0);
+        sum = ip_sum_add(sum, ip_copy_sum((uint8_t*)io_data(io) + io->data_size + chunk, tcb->snd_buf, seg->len - chunk, 0), chunk);
+        io->data_size += seg->len;
+        //apply flags
+        if ((tcb->snd_psh > offset) && (tcb->snd_psh <= offset + seg->len))
+            tcp->flags |= TCP_FLAG_PSH;
+        if (tcb->snd_urg > offset)
+        {
+            tcp->flags |= TCP_FLAG_URG;
+            short2be(tcp->urgent_pointer_be, tcb->snd_urg - offset);
+        }
+    }
+    tcps_tx_sum(tcpips, io, tcb, seg->len, sum);
+    return true;
+}
+
+//send new data up to peer window. Return true if anything sent
+static bool tcps_output(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_SEG* seg;
+    unsigned int flight, unsent, size, wnd;
+    bool fin;
+    bool res = false;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+
+    while (!tcb->fin_sent && (tcb->seg_count < TCP_TX_SEGMENTS_MAX))
+    {
+        flight = tcps_delta(tcb->snd_una, tcb->snd_nxt);
+        unsent = tcps_tx_size(tcb) - flight;
+        wnd = tcb->tx_wnd < tcb->cc.cwnd ? tcb->tx_wnd : tcb->cc.cwnd;
+        size = unsent;
+        if (size > tcb->mss)
+            size = tcb->mss;
+        if (flight + size > wnd)
+            size = wnd > flight ? wnd - flight : 0;
+        //sender side silly window avoidance: wait for ack, if window is small.
+        //Nagle: don't send small segment, while anything is unacked
+        if ((size < tcb->mss) && flight && ((size < unsent) || !(tcb->options & TCP_OPTION_NO_DELAY)))
+            break;
+        //FIN goes with last data segment
+        fin = tcb->fin && (size == unsent) && (tcb->tx == NULL);
+        if ((size == 0) && !fin)
+            break;
+        seg = &tcb->seg[(tcb->seg_head + tcb->seg_count) % TCP_TX_SEGMENTS_MAX];
+        seg->seq = tcb->snd_nxt;
+        seg->len = size;
+        seg->fin = fin;
+        seg->sacked = seg->rexmit = false;
+        if (!tcps_tx_seg(tcpips, tcb_handle, seg))
+            break;
+        //user timeout is counted from here, if nothing was in flight
+        if (tcb->seg_count++ == 0)
+            tcb->una_time = tcps_ms();
+        tcps_rtt_start(tcb, seg->seq);
+        tcb->snd_nxt += size;
+        if (fin)
+        {
+            ++tcb->snd_nxt;
+            tcb->fin_sent = true;
+        }
+        res = true;
+    }
+    return res;
+}
+
+//remove acked segments from retransmission queue
+static void tcps_seg_ack(TCP_TCB* tcb)
+{
+    TCP_SEG* seg;
+    int diff;
+    while (tcb->seg_count)
+    {
+        seg = &tcb->seg[tcb->seg_head];
+        diff = tcps_diff(seg->seq, tcb->snd_una);
+        if (diff <= 0)
+            break;
+        //partially acked
+        if (diff < seg->len + (seg->fin ? 1 : 0))
+        {
+            seg->seq += diff;
+            seg->len -= diff;
+            break;
+        }
+        tcb->seg_head = (tcb->seg_head + 1) % TCP_TX_SEGMENTS_MAX;
+        --tcb->seg_count;
+    }
+}
+
+static void tcps_retransmit(TCPIPS* tcpips, HANDLE tcb_handle, TCP_SEG* seg)
+{
+    TCP_SEG part;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    //Karn's algorithm: don't sample ambiguous ack
+    tcb->rtt_timing = false;
+    ++tcb->retransmits;
+    seg->rexmit = true;
+    //segment was queued before path MTU reduction, send by parts
+    part = *seg;
+    while (part.len > tcb->mss)
+    {
+        part.len = tcb->mss;
+        part.fin = false;
+        if (!tcps_tx_seg(tcpips, tcb_handle, &part))
+            return;
+        part.seq += tcb->mss;
+        part.len = seg->len - tcps_delta(seg->seq, part.seq);
+        part.fin = seg->fin;
+    }
+    tcps_tx_seg(tcpips, tcb_handle, &part);
+}
+
+//start new recovery. On timeout peer could renege SACKed data
+static void tcps_seg_reset(TCP_TCB* tcb, bool timeout)
+{
+    unsigned int i;
+    TCP_SEG* seg;
+    for (i = 0; i < tcb->seg_count; ++i)
+    {
+        seg = &tcb->seg[(tcb->seg_head + i) % TCP_TX_SEGMENTS_MAX];
+        seg->rexmit = false;
+        if (timeout)
+            seg->sacked = false;
+    }
+}
+
+//retransmit next lost segment before recover point. Head is lost on partial ack,
+//others only if SACKed data is after them
+static void tcps_retransmit_hole(TCPIPS* tcpips, HANDLE tcb_handle, bool head_lost)
+{
+    unsigned int i;
+    TCP_SEG* seg;
+    TCP_SEG* hole = NULL;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    for (i = 0; i < tcb->seg_count; ++i)
+    {
+        seg = &tcb->seg[(tcb->seg_head + i) % TCP_TX_SEGMENTS_MAX];
+        if (!tcps_seq_lt(seg->seq, tcb->recover))
+            break;
+        if (seg->sacked)
+        {
+            //hole is confirmed by SACKed data after it
+            if (hole != NULL)
+            {
+                tcps_retransmit(tcpips, tcb_handle, hole);
+                return;
+            }
+            continue;
+        }
+        if (seg->rexmit || (hole != NULL))
+            continue;
+        if ((i == 0) && head_lost)
+        {
+            tcps_retransmit(tcpips, tcb_handle, seg);
+            return;
+        }
+        hole = seg;
+    }
+}
+
+static void tcps_tx_syn(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    IO* io;
+    TCP_HEADER* tcp;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+
+    if ((io = tcps_allocate_io(tcpips, tcb)) == NULL)
+        return;
 
     tcp = io_data(io);
 
     //SYN flag
     tcp->flags |= TCP_FLAG_SYN;
     tcps_append_mss(io);
+    tcps_append_wscale(io, tcb->rcv_wscale);
+#if (TCP_SACK)
+    tcps_append_sack_permitted(io);
+#endif //TCP_SACK
+    if (tcb->user_timeout)
+        tcps_append_uto(io, tcb->user_timeout);
 
     int2be(tcp->seq_be, tcb->snd_una);
     tcps_tx(tcpips, io, tcb);
-    tcps_timer_start(tcb);
+    tcps_timer_start(tcpips, tcb_handle);
 }
 
 static void tcps_tx_syn_ack(TCPIPS* tcpips, HANDLE tcb_handle)
@@ -663,17 +1552,86 @@ static void tcps_tx_syn_ack(TCPIPS* tcpips, HANDLE tcb_handle)
     //add ACK, SYN flags
     tcp->flags |= TCP_FLAG_ACK | TCP_FLAG_SYN;
     tcps_append_mss(io);
+    //only if offered by peer
+    if (tcb->wscale_ok)
+        tcps_append_wscale(io, tcb->rcv_wscale);
+    if (tcb->sack_ok)
+        tcps_append_sack_permitted(io);
 
     int2be(tcp->seq_be, tcb->snd_una);
     int2be(tcp->ack_be, tcb->rcv_nxt);
     tcps_tx(tcpips, io, tcb);
-    tcps_timer_start(tcb);
+    tcps_timer_start(tcpips, tcb_handle);
+}
+
+static void tcps_ooo_insert(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
+{
+    unsigned int i;
+    uint32_t seq, end, cur_seq, cur_end;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    switch (tcb->state)
+    {
+    case TCP_STATE_ESTABLISHED:
+    case TCP_STATE_FIN_WAIT_1:
+    case TCP_STATE_FIN_WAIT_2:
+        break;
+    default:
+        return;
+    }
+    seq = tcps_seg_seq(io);
+    end = seq + tcps_seg_len(io);
+    for (i = 0; i < tcb->ooo_count; ++i)
+    {
+        cur_seq = tcps_seg_seq(tcb->ooo[i]);
+        cur_end = cur_seq + tcps_seg_len(tcb->ooo[i]);
+        //before new
+        if (!tcps_seq_lt(seq, cur_end))
+            continue;
+        //after new
+        if (!tcps_seq_lt(cur_seq, end))
+            break;
+        if (!tcps_seq_lt(seq, cur_seq))
+        {
+            //already have all data
+            if (!tcps_seq_lt(cur_end, end))
+                return;
+            tcps_seg_trim_front(io, cur_end - seq);
+            seq = cur_end;
+            continue;
+        }
+        //new covers queued one
+        if (!tcps_seq_lt(end, cur_end))
+        {
+            ips_release_io(tcpips, tcb->ooo[i]);
+            tcps_ooo_remove(tcpips, tcb, i--);
+            continue;
+        }
+        tcps_seg_trim_back(io, cur_seq - seq);
+        break;
+    }
+    //queue is full: drop farthest segment
+    if ((tcb->ooo_count >= TCP_OOO_SEGMENTS_MAX) || (tcpips->tcps.ooo_count >= TCP_OOO_TOTAL_MAX))
+    {
+        if (i >= tcb->ooo_count)
+        {
+#if (TCP_DEBUG_FLOW)
+            printf("TCP: out-of-order queue full\n");
+#endif //TCP_DEBUG_FLOW
+            return;
+        }
+        ips_release_io(tcpips, tcb->ooo[tcb->ooo_count - 1]);
+        tcps_ooo_remove(tcpips, tcb, tcb->ooo_count - 1);
+    }
+    memmove(tcb->ooo + i + 1, tcb->ooo + i, (tcb->ooo_count - i) * sizeof(IO*));
+    tcb->ooo[i] = io;
+    tcb->sack_last = seq;
+    ++tcb->ooo_count;
+    ++tcpips->tcps.ooo_count;
 }
 
 static inline bool tcps_rx_otw_check_seq(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
 {
     int seq_delta, seg_len;
-    unsigned int data_off;
     uint32_t seq;
     TCP_HEADER* tcp;
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
@@ -707,42 +1665,19 @@ static inline bool tcps_rx_otw_check_seq(TCPIPS* tcpips, IO* io, HANDLE tcb_hand
             ++seq_delta;
             ++seq;
         }
-        data_off = tcps_data_offset(io);
-        seg_len -= -seq_delta;
-        //FIN is not in data, but occupying virtual byte
-        if (tcp->flags & TCP_FLAG_FIN)
-        {
-            memmove((uint8_t*)io_data(io) + data_off, (uint8_t*)io_data(io) + data_off + (-seq_delta), seg_len - 1);
-            io->data_size -= (-seq_delta) - 1;
-        }
-        else
-        {
-            memmove((uint8_t*)io_data(io) + data_off, (uint8_t*)io_data(io) + data_off + (-seq_delta), seg_len);
-            io->data_size -= -seq_delta;
-        }
+        tcps_seg_trim_front(io, -seq_delta);
+        seg_len = tcps_seg_len(io);
         seq += -seq_delta;
         seq_delta = 0;
     }
     //don't fit in rx window
-    if (seg_len > tcb->rx_wnd && tcb->rx_wnd > 0)
+    if ((seq_delta >= 0) && (seq_delta + seg_len > tcb->rx_wnd) && (tcb->rx_wnd > seq_delta))
     {
 #if (TCP_DEBUG_FLOW)
-        printf("TCP: chop rx wnd %d seq\n", seg_len - tcb->rx_wnd);
+        printf("TCP: chop rx wnd %d seq\n", seq_delta + seg_len - tcb->rx_wnd);
 #endif //TCP_DEBUG_FLOW
-        //FIN is last virtual byte, remove it first
-        if (tcp->flags & TCP_FLAG_FIN)
-        {
-            tcp->flags &= ~TCP_FLAG_FIN;
-            --seg_len;
-        }
-        //still don't fit? remove some data
-        if (seg_len > tcb->rx_wnd)
-        {
-            io->data_size = seg_len - tcb->rx_wnd;
-            seg_len = tcb->rx_wnd;
-        }
-        //remove PSH flag, cause it's goes after all bytes
-        tcp->flags &= ~TCP_FLAG_PSH;
+        tcps_seg_trim_back(io, tcb->rx_wnd - seq_delta);
+        seg_len = tcps_seg_len(io);
     }
     if (seq != tcb->rcv_nxt || seg_len > tcb->rx_wnd)
     {
@@ -752,10 +1687,13 @@ static inline bool tcps_rx_otw_check_seq(TCPIPS* tcpips, IO* io, HANDLE tcb_hand
         //RST bit is set, drop the segment and return:
         if (tcp->flags & TCP_FLAG_RST)
         {
-            tcps_timer_start(tcb);
+            tcps_timer_start(tcpips, tcb_handle);
             return false;
         }
-
+        //hold in window segment, until hole is filled
+        if ((seq_delta > 0) && (seq_delta + seg_len <= tcb->rx_wnd) && !(tcp->flags & TCP_FLAG_SYN))
+            tcps_ooo_insert(tcpips, io, tcb_handle);
+        //duplicate ack for sender fast retransmit
         tcps_tx_ack(tcpips, tcb_handle);
         return false;
     }
@@ -786,7 +1724,7 @@ static inline bool tcps_rx_otw_ack(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
         {
             //form a reset segment
             tcps_tx_rst(tcpips, tcb_handle, be2int(tcp->ack_be));
-            tcps_timer_start(tcb);
+            tcps_timer_start(tcpips, tcb_handle);
             return false;
         }
     }
@@ -802,29 +1740,42 @@ static inline bool tcps_rx_otw_ack(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
 
     if ((ack_diff > 0) || ((ack_diff == 0) && (tcb->snd_nxt == tcb->snd_una)))
         tcb->retry = 0;
+    //duplicate ack: no data, no window update, and something is in flight
+    if ((ack_diff == 0) && tcb->seg_count && (tcps_seg_len(io) == 0) && !tcb->wnd_update)
+    {
+        //fast retransmit, but only once per window
+        if (tcb->cc_ops->tcp_cc_dup_ack(&tcb->cc) && !tcps_seq_lt(tcb->snd_una, tcb->recover))
+        {
+#if (TCP_DEBUG_FLOW)
+            printf("TCP: fast retransmit\n");
+#endif //TCP_DEBUG_FLOW
+            tcb->cc_ops->tcp_cc_loss(&tcb->cc, snd_diff, false);
+            tcb->recover = tcb->snd_nxt;
+            tcps_seg_reset(tcb, false);
+            tcps_retransmit_hole(tcpips, tcb_handle, true);
+        }
+        //SACK reported more holes
+        else if (tcps_seq_lt(tcb->snd_una, tcb->recover))
+            tcps_retransmit_hole(tcpips, tcb_handle, false);
+    }
     //adjust ack
     if (ack_diff > 0)
     {
         tcb->snd_una += ack_diff;
-        if (tcb->tx != NULL)
-        {
-            if (ack_diff >= tcb->tx->data_size - tcb->tx_cur)
-            {
-                //return sent buffers to user
-                io_pop(tcb->tx, sizeof(TCP_STACK));
-                io_complete(tcb->process, HAL_IO_CMD(HAL_TCP, IPC_WRITE), tcb_handle, tcb->tx);
-                tcb->tx = NULL;
-                tcb->tx_cur = 0;
-            }
-            else
-                tcb->tx_cur += ack_diff;
-        }
+        tcb->una_time = tcps_ms();
+        tcb->cc_ops->tcp_cc_ack(&tcb->cc, ack_diff, snd_diff - ack_diff, tcps_seq_lt(tcb->snd_una, tcb->recover));
+        tcps_rtt_ack(tcb);
+        tcps_seg_ack(tcb);
+        tcps_snd_ack(tcpips, tcb_handle, ack_diff);
+        //segments, sent before loss detection are probably lost too. Resend one per ack
+        if (tcps_seq_lt(tcb->snd_una, tcb->recover))
+            tcps_retransmit_hole(tcpips, tcb_handle, true);
     }
 
     switch (tcb->state)
     {
     case TCP_STATE_FIN_WAIT_1:
-        if (tcb->snd_nxt == tcb->snd_una)
+        if (tcb->fin_sent && (tcb->snd_nxt == tcb->snd_una))
         {
             tcps_set_state(tcb, TCP_STATE_FIN_WAIT_2);
             //In addition to the processing for the ESTABLISHED state, if the retransmission queue is empty, the user’s CLOSE can be acknowledged
@@ -832,8 +1783,14 @@ static inline bool tcps_rx_otw_ack(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
         }
         break;
     case TCP_STATE_CLOSING:
+        if (tcb->fin_sent && (tcb->snd_nxt == tcb->snd_una))
+        {
+            tcps_time_wait(tcpips, tcb_handle);
+            return false;
+        }
+        break;
     case TCP_STATE_LAST_ACK:
-        if (tcb->snd_nxt == tcb->snd_una)
+        if (tcb->fin_sent && (tcb->snd_nxt == tcb->snd_una))
         {
             tcps_destroy_tcb(tcpips, tcb_handle);
             return false;
@@ -860,7 +1817,7 @@ static void tcps_rx_text(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
     case TCP_STATE_ESTABLISHED:
     case TCP_STATE_FIN_WAIT_1:
     case TCP_STATE_FIN_WAIT_2:
-        tcb->rx_cur = data_size = tcps_data_len(io);
+        data_size = tcps_data_len(io);
         if (data_size)
         {
             data_offset = tcps_data_offset(io);
@@ -877,6 +1834,13 @@ static void tcps_rx_text(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
             }
             tcb->rcv_nxt += data_size;
             tcb->retry = 0;
+            //frame goes to user as is. Window is never above free slots
+            if (tcb->options & TCP_OPTION_ZERO_COPY)
+            {
+                tcb->zc[tcb->zc_count++] = io;
+                tcps_update_rx_wnd(tcb);
+                break;
+            }
             //has user block
             if (tcb->rx != NULL)
             {
@@ -915,7 +1879,15 @@ static void tcps_rx_text(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
             {
                 //move to tmp
                 if (tcb->rx_tmp == NULL)
+                {
                     tcb->rx_tmp = io;
+                    //remove part, already copied to user
+                    if (data_offset > tcps_data_offset(io))
+                    {
+                        memmove((uint8_t*)io_data(io) + tcps_data_offset(io), (uint8_t*)io_data(io) + data_offset, data_size);
+                        io->data_size = tcps_data_offset(io) + data_size;
+                    }
+                }
                 //append to tmp
                 else
                 {
@@ -953,25 +1925,64 @@ static void tcps_rx_text(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
     }
 }
 
+static void tcps_remote_close(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    //return all rx buffers
+    tcps_rx_flush(tcpips, tcb_handle);
+    //inform user
+    ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_CLOSE), tcb_handle, 0, 0);
+    tcps_set_state(tcb, TCP_STATE_LAST_ACK);
+    tcb->fin = true;
+}
+
+//all data before remote FIN is taken by user. Timer is stopped by caller
+static void tcps_remote_close_deferred(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    tcps_remote_close(tcpips, tcb_handle);
+    tcps_output(tcpips, tcb_handle);
+    tcps_timer_start(tcpips, tcb_handle);
+}
+
+//pass oldest frame to user, waiting for it
+static void tcps_zc_deliver(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    IO* io;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (!tcb->zc_wait || (tcb->zc_count == 0))
+        return;
+    io = tcb->zc[0];
+    memmove(tcb->zc, tcb->zc + 1, (--tcb->zc_count) * sizeof(IO*));
+    tcb->zc_out[tcb->zc_held++] = io;
+    tcb->zc_wait = false;
+    //hide TCP header, IP stack is left for release
+    io_hide(io, tcps_data_offset(io));
+    ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, TCP_GET_FRAME), tcb_handle, (unsigned int)io, io->data_size);
+    if ((tcb->zc_count == 0) && tcb->rx_fin)
+    {
+        tcps_timer_stop(tcpips, tcb_handle);
+        tcps_remote_close_deferred(tcpips, tcb_handle);
+    }
+}
+
 static inline bool tcps_rx_otw_fin(TCPIPS* tcpips, HANDLE tcb_handle)
 {
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 
     //ack FIN
     ++tcb->rcv_nxt;
-    if (!tcb->fin)
+    //don't drop data, not read by user yet
+    if ((tcb->state == TCP_STATE_ESTABLISHED) && ((tcb->rx_tmp != NULL) || tcb->zc_count))
     {
-        tcb->fin = true;
-        ++tcb->snd_nxt;
+        tcb->rx_fin = true;
+        return true;
     }
+    tcb->fin = true;
     switch (tcb->state)
     {
     case TCP_STATE_ESTABLISHED:
-        //return all rx buffers
-        tcps_rx_flush(tcpips, tcb_handle);
-        //inform user
-        ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_CLOSE), tcb_handle, 0, 0);
-        //follow down
+        tcps_remote_close(tcpips, tcb_handle);
+        break;
     case TCP_STATE_SYN_RECEIVED:
         tcps_set_state(tcb, TCP_STATE_LAST_ACK);
         break;
@@ -980,7 +1991,8 @@ static inline bool tcps_rx_otw_fin(TCPIPS* tcpips, HANDLE tcb_handle)
         ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_CLOSE), tcb_handle, 0, 0);
         break;
     case TCP_STATE_FIN_WAIT_2:
-        tcps_destroy_tcb(tcpips, tcb_handle);
+        tcps_tx_ack(tcpips, tcb_handle);
+        tcps_time_wait(tcpips, tcb_handle);
         return false;
     default:
         break;
@@ -988,20 +2000,66 @@ static inline bool tcps_rx_otw_fin(TCPIPS* tcpips, HANDLE tcb_handle)
     return true;
 }
 
-static inline void tcps_rx_send(TCPIPS* tcpips, HANDLE tcb_handle)
+//deliver queued segments, if hole is filled. Return false, if TCB is destroyed
+static bool tcps_rx_otw_ooo(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    IO* io;
+    int seq_delta;
+    bool fin;
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    while (tcb->ooo_count)
+    {
+        io = tcb->ooo[0];
+        seq_delta = tcps_diff(tcb->rcv_nxt, tcps_seg_seq(io));
+        if (seq_delta > 0)
+            break;
+        tcps_ooo_remove(tcpips, tcb, 0);
+        //covered by in-order segment, received after it was queued
+        if ((int)tcps_seg_len(io) + seq_delta <= 0)
+        {
+            ips_release_io(tcpips, io);
+            continue;
+        }
+        tcps_seg_trim_front(io, -seq_delta);
+        //user buffer could be returned after segment was queued
+        tcps_seg_trim_back(io, tcb->rx_wnd);
+        if (tcps_seg_len(io) == 0)
+        {
+            ips_release_io(tcpips, io);
+            continue;
+        }
+#if (TCP_DEBUG_FLOW)
+        printf("TCP: out-of-order deliver %d seq\n", tcps_seg_len(io));
+#endif //TCP_DEBUG_FLOW
+        fin = (((TCP_HEADER*)io_data(io))->flags & TCP_FLAG_FIN) != 0;
+        tcps_rx_text(tcpips, io, tcb_handle);
+        if (!tcps_rx_holds(tcb, io))
+            ips_release_io(tcpips, io);
+        if (fin && !tcps_rx_otw_fin(tcpips, tcb_handle))
+            return false;
+    }
+    return true;
+}
+
+static inline void tcps_rx_send(TCPIPS* tcpips, HANDLE tcb_handle, bool need_ack, bool quick_ack)
 {
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 
     //ack from remote host - we transmitted all
-    if (tcb->state == TCP_STATE_ESTABLISHED && tcb->transmit && (tcb->snd_una == tcb->snd_nxt) && !tcb->fin && tcb->rx_cur == 0)
-    {
+    if (tcb->state == TCP_STATE_ESTABLISHED && tcb->transmit && (tcb->tx == NULL) && (tcb->snd_len == 0) && !tcb->fin)
         tcb->transmit = false;
-#if (TCP_KEEP_ALIVE)
-        tcps_timer_start(tcb);
-#endif //TCP_KEEP_ALIVE
-        return;
+    //ack is piggybacked on data
+    if (tcps_output(tcpips, tcb_handle) || !need_ack)
+        tcps_timer_start(tcpips, tcb_handle);
+    //every second segment is acked at once. Also don't wait for second segment, if window is too small for it
+    else if (quick_ack || tcb->ack_pending || (tcb->rx_wnd < 2 * tcb->mss) || (tcb->options & TCP_OPTION_QUICK_ACK) ||
+             (TCP_DELAYED_ACK_MS == 0))
+        tcps_tx_ack(tcpips, tcb_handle);
+    else
+    {
+        tcps_delay_ack(tcpips, tcb);
+        tcps_timer_start(tcpips, tcb_handle);
     }
-    tcps_tx_text_ack_fin(tcpips, tcb_handle);
 }
 
 static inline void tcps_rx_closed(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
@@ -1023,38 +2081,304 @@ static inline void tcps_rx_closed(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
     tcps_destroy_tcb(tcpips, tcb_handle);
 }
 
-static inline void tcps_rx_listen(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
+static void tcps_tx_tw_ack(TCPIPS* tcpips, const TCP_TW* tw)
+{
+    IO* io;
+    TCP_HEADER* tcp;
+    if ((io = tcps_allocate_io_ports(tcpips, tw->local_port, tw->remote_port)) == NULL)
+        return;
+    tcp = io_data(io);
+    tcp->flags |= TCP_FLAG_ACK;
+    int2be(tcp->seq_be, tw->snd_nxt);
+    int2be(tcp->ack_be, tw->rcv_nxt);
+    short2be(tcp->window_be, 0);
+    tcps_tx_io(tcpips, io, &tw->remote_addr);
+}
+
+//segment for connection in TIME WAIT. Return false if not processed
+static bool tcps_rx_time_wait(TCPIPS* tcpips, IO* io, const IP* src)
+{
+    TCP_HEADER* tcp = io_data(io);
+    TCP_TW* tw = tcps_tw_find(tcpips, src, be2short(tcp->src_port_be), be2short(tcp->dst_port_be));
+    if (tw == NULL)
+        return false;
+    //RFC 1337: RST is ignored, TIME WAIT is not truncated
+    if (tcp->flags & TCP_FLAG_RST)
+        return true;
+    //new SYN above old sequence is allowed to reuse tuple
+    if (((tcp->flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) == TCP_FLAG_SYN) && tcps_seq_lt(tw->rcv_nxt, be2int(tcp->seq_be)))
+    {
+        array_remove(&tcpips->tcps.tw, tw - TCP_TW_AT(tcpips, 0));
+        return false;
+    }
+    //remote retransmitted FIN, our ACK was lost. Restart 2MSL
+    if (tcp->flags & TCP_FLAG_FIN)
+        tw->expire = tcps_ms() + TCP_TIME_WAIT;
+    tcps_tx_tw_ack(tcpips, tw);
+    return true;
+}
+
+static void tcps_syn_options(IO* io, TCP_SYN* syn)
+{
+    int i;
+    TCP_OPT* opt;
+    uint16_t mss;
+    syn->mss = TCP_MSS_MAX;
+    syn->snd_wscale = 0;
+    syn->wscale_ok = syn->sack_ok = false;
+    for (i = tcps_get_first_opt(io); i; i = tcps_get_next_opt(io, i))
+    {
+        opt = (TCP_OPT*)((uint8_t*)io_data(io) + i);
+        switch(opt->kind)
+        {
+        case TCP_OPTS_MSS:
+            mss = be2short(opt->data);
+            if (mss >= TCP_MSS_MIN && mss <= TCP_MSS_MAX)
+                syn->mss = mss;
+            break;
+        case TCP_OPTS_WSCALE:
+            syn->snd_wscale = opt->data[0] > TCP_WSCALE_MAX ? TCP_WSCALE_MAX : opt->data[0];
+            syn->wscale_ok = true;
+            break;
+        case TCP_OPTS_SACK_PERMITTED:
+            syn->sack_ok = TCP_SACK;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void tcps_tx_syn_ack_listen(TCPIPS* tcpips, TCP_LISTEN_HANDLE* tlh, const TCP_SYN* syn)
+{
+    IO* io;
+    TCP_HEADER* tcp;
+
+    if ((io = tcps_allocate_io_ports(tcpips, tlh->port, syn->remote_port)) == NULL)
+        return;
+
+    tcp = io_data(io);
+    tcp->flags |= TCP_FLAG_ACK | TCP_FLAG_SYN;
+    tcps_append_mss(io);
+    if (syn->wscale_ok)
+        tcps_append_wscale(io, TCP_WINDOW_SCALE);
+    if (syn->sack_ok)
+        tcps_append_sack_permitted(io);
+
+    int2be(tcp->seq_be, syn->iss);
+    int2be(tcp->ack_be, syn->irs + 1);
+    //initial window, same as for new TCB
+    short2be(tcp->window_be, TCP_MSS_MAX);
+    tcps_tx_io(tcpips, io, &syn->remote_addr);
+}
+
+static TCP_SYN* tcps_syn_find(TCP_LISTEN_HANDLE* tlh, const IP* src, uint16_t remote_port)
+{
+    unsigned int i;
+    for (i = 0; i < tlh->syn_count; ++i)
+    {
+        if (tlh->syn[i].remote_port == remote_port && tlh->syn[i].remote_addr.u32.ip == src->u32.ip)
+            return &tlh->syn[i];
+    }
+    return NULL;
+}
+
+static inline void tcps_syn_remove(TCP_LISTEN_HANDLE* tlh, TCP_SYN* syn)
+{
+    //order is not important
+    *syn = tlh->syn[--tlh->syn_count];
+}
+
+static void tcps_syn_expire(TCP_LISTEN_HANDLE* tlh)
+{
+    unsigned int i;
+    uint32_t now = tcps_ms();
+    for (i = 0; i < tlh->syn_count; )
+    {
+        if ((int)(now - tlh->syn[i].time) >= TCP_SYN_TIMEOUT)
+            tcps_syn_remove(tlh, &tlh->syn[i]);
+        else
+            ++i;
+    }
+}
+
+#if (TCP_SYN_COOKIES)
+static inline uint32_t tcps_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t tcps_cookie_hash(TCPIPS* tcpips, const IP* src, uint16_t remote_port, uint16_t local_port, uint32_t irs, uint32_t t)
+{
+    uint32_t h = tcps_mix(tcpips->tcps.secret ^ src->u32.ip);
+    h = tcps_mix(h ^ (((uint32_t)remote_port << 16) | local_port));
+    h = tcps_mix(h ^ irs);
+    return tcps_mix(h ^ t ^ tcpips->tcps.secret) & 0xffffff;
+}
+
+//RFC 4987. Connection state is encoded in ISN
+static uint32_t tcps_cookie_make(TCPIPS* tcpips, const IP* src, uint16_t local_port, const TCP_SYN* syn)
+{
+    unsigned int mss_idx;
+    uint32_t t = tcps_ms() >> TCP_COOKIE_TIME_SHIFT;
+    for (mss_idx = TCP_COOKIE_MSS_COUNT - 1; mss_idx && (__TCP_COOKIE_MSS[mss_idx] > syn->mss); --mss_idx) {}
+    return ((t & 0x1f) << 27) | (mss_idx << 24) | tcps_cookie_hash(tcpips, src, syn->remote_port, local_port, syn->irs, t);
+}
+
+//return MSS, 0 if cookie is invalid or expired
+static uint16_t tcps_cookie_check(TCPIPS* tcpips, const IP* src, uint16_t local_port, const TCP_SYN* syn)
+{
+    unsigned int i, mss_idx;
+    uint32_t t = tcps_ms() >> TCP_COOKIE_TIME_SHIFT;
+    mss_idx = (syn->iss >> 24) & 7;
+    if (mss_idx >= TCP_COOKIE_MSS_COUNT)
+        return 0;
+    //current and previous time counter
+    for (i = 0; i < 2; ++i, --t)
+    {
+        if (((syn->iss >> 27) == (t & 0x1f)) &&
+            ((syn->iss & 0xffffff) == tcps_cookie_hash(tcpips, src, syn->remote_port, local_port, syn->irs, t)))
+            return __TCP_COOKIE_MSS[mss_idx] < TCP_MSS_MAX ? __TCP_COOKIE_MSS[mss_idx] : TCP_MSS_MAX;
+    }
+    return 0;
+}
+#endif //TCP_SYN_COOKIES
+
+static void tcps_rx_listen_syn(TCPIPS* tcpips, IO* io, const IP* src, TCP_LISTEN_HANDLE* tlh, TCP_SYN* syn)
+{
+    TCP_SYN tmp;
+    uint32_t seq = be2int(((TCP_HEADER*)io_data(io))->seq_be);
+    //SYN retransmitted, SYN/ACK probably lost
+    if ((syn != NULL) && (syn->irs == seq))
+    {
+        syn->rexmit = true;
+        tcps_tx_syn_ack_listen(tcpips, tlh, syn);
+        return;
+    }
+    if (syn == NULL)
+    {
+        tcps_syn_expire(tlh);
+        if (tlh->syn_count < TCP_SYN_BACKLOG)
+            syn = &tlh->syn[tlh->syn_count++];
+        else
+        {
+#if (TCP_SYN_COOKIES)
+            //backlog is full, answer without keeping state
+            tmp.remote_addr.u32.ip = src->u32.ip;
+            tmp.remote_port = be2short(((TCP_HEADER*)io_data(io))->src_port_be);
+            tmp.irs = seq;
+            tcps_syn_options(io, &tmp);
+            tmp.wscale_ok = tmp.sack_ok = false;
+            tmp.iss = tcps_cookie_make(tcpips, src, tlh->port, &tmp);
+            ++tlh->cookies;
+            tcps_tx_syn_ack_listen(tcpips, tlh, &tmp);
+#else
+            ++tlh->drops;
+#if (TCP_DEBUG)
+            printf("TCP: SYN backlog is full\n");
+#endif //TCP_DEBUG
+#endif //TCP_SYN_COOKIES
+            return;
+        }
+    }
+    //new or restarted connection attempt
+    syn->remote_addr.u32.ip = src->u32.ip;
+    syn->remote_port = be2short(((TCP_HEADER*)io_data(io))->src_port_be);
+    syn->irs = seq;
+    syn->iss = tcps_gen_isn();
+    syn->time = tcps_ms();
+    syn->rexmit = false;
+    tcps_syn_options(io, syn);
+    tcps_tx_syn_ack_listen(tcpips, tlh, syn);
+}
+
+static HANDLE tcps_rx_listen_ack(TCPIPS* tcpips, IO* io, const IP* src, TCP_LISTEN_HANDLE* tlh, TCP_SYN* syn)
 {
-    TCP_HEADER* tcp;
-    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
-    tcp = io_data(io);
-
-    do {
-        //An incoming RST should be ignored
-        if (tcp->flags & TCP_FLAG_RST)
-            break;
-
-        //An acceptable reset segment should be formed for any arriving ACK-bearing segment
-        if (tcp->flags & TCP_FLAG_ACK)
+    TCP_SYN tmp;
+    TCP_TCB* tcb;
+    HANDLE tcb_handle;
+    TCP_HEADER* tcp = io_data(io);
+    uint32_t iss = be2int(tcp->ack_be) - 1;
+    uint32_t irs = be2int(tcp->seq_be) - 1;
+    if ((syn == NULL) || (syn->iss != iss) || (syn->irs != irs))
+    {
+#if (TCP_SYN_COOKIES)
+        tmp.remote_addr.u32.ip = src->u32.ip;
+        tmp.remote_port = be2short(tcp->src_port_be);
+        tmp.irs = irs;
+        tmp.iss = iss;
+        tmp.snd_wscale = 0;
+        tmp.wscale_ok = tmp.sack_ok = false;
+        if ((tmp.mss = tcps_cookie_check(tcpips, src, tlh->port, &tmp)) == 0)
+#endif //TCP_SYN_COOKIES
+            //not ours, reset
+            return tcps_create_tcb_internal(tcpips, src, be2short(tcp->src_port_be), tlh->port);
+#if (TCP_SYN_COOKIES)
+        syn = NULL;
+#endif //TCP_SYN_COOKIES
+    }
+    if ((tcb_handle = tcps_create_tcb_internal(tcpips, src, be2short(tcp->src_port_be), tlh->port)) == INVALID_HANDLE)
+    {
+        //half-open is kept, remote will retry
+        ++tlh->drops;
+        return INVALID_HANDLE;
+    }
+    if (syn == NULL)
+        syn = &tmp;
+    tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    tcb->process = tlh->process;
+    tcb->active = false;
+    tcb->rcv_nxt = syn->irs + 1;
+    tcb->snd_una = tcb->recover = syn->iss;
+    tcb->snd_nxt = syn->iss + 1;
+    tcb->peer_mss = syn->mss;
+    tcps_update_mss(tcpips, tcb);
+    tcb->snd_wscale = syn->snd_wscale;
+    tcb->wscale_ok = syn->wscale_ok;
+    tcb->sack_ok = syn->sack_ok;
+    tcps_set_state(tcb, TCP_STATE_SYN_RECEIVED);
+    if (syn != &tmp)
+    {
+        //Karn's algorithm: retransmitted SYN/ACK can't be timed
+        if (!syn->rexmit)
         {
-            tcps_tx_rst(tcpips, tcb_handle, be2int(tcp->ack_be));
-            break;
+            tcb->rtt_seq = syn->iss;
+            tcb->rtt_start = syn->time;
+            tcb->rtt_timing = true;
         }
+        tcps_syn_remove(tlh, syn);
+    }
+    //ACK will be processed in SYN RECEIVED state
+    return tcb_handle;
+}
 
-        if (tcp->flags & TCP_FLAG_SYN)
-        {
-            tcps_set_state(tcb, TCP_STATE_SYN_RECEIVED);
-            tcb->rcv_nxt = be2int(tcp->seq_be) + 1;
-            tcb->snd_una = tcb->snd_nxt = tcps_gen_isn();
-            ++tcb->snd_nxt;
-
-            tcps_tx_syn_ack(tcpips, tcb_handle);
-            return;
-        }
+//segment to listening port without TCB. Returns TCB to continue processing with
+static HANDLE tcps_rx_listen(TCPIPS* tcpips, IO* io, const IP* src, TCP_LISTEN_HANDLE* tlh)
+{
+    TCP_HEADER* tcp = io_data(io);
+    TCP_SYN* syn = tcps_syn_find(tlh, src, be2short(tcp->src_port_be));
 
-        //You are unlikely to get here, but if you do, drop the segment, and return
-    } while (false);
-    tcps_destroy_tcb(tcpips, tcb_handle);
+    //An incoming RST should be ignored. Half-open connection is aborted by remote
+    if (tcp->flags & TCP_FLAG_RST)
+    {
+        if (syn != NULL)
+            tcps_syn_remove(tlh, syn);
+        return INVALID_HANDLE;
+    }
+    //final ACK of handshake. Any other ACK-bearing segment is reset
+    if ((tcp->flags & TCP_FLAG_ACK) && !(tcp->flags & TCP_FLAG_SYN))
+        return tcps_rx_listen_ack(tcpips, io, src, tlh, syn);
+    if (tcp->flags & TCP_FLAG_ACK)
+        return tcps_create_tcb_internal(tcpips, src, be2short(tcp->src_port_be), tlh->port);
+    if (tcp->flags & TCP_FLAG_SYN)
+        tcps_rx_listen_syn(tcpips, io, src, tlh, syn);
+    //You are unlikely to get here, but if you do, drop the segment, and return
+    return INVALID_HANDLE;
 }
 
 static inline void tcps_rx_syn_sent(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
@@ -1075,7 +2399,7 @@ static inline void tcps_rx_syn_sent(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
         {
             if ((tcp->flags & TCP_FLAG_RST) == 0)
                 tcps_tx_rst(tcpips, tcb_handle, ack);
-            tcps_timer_start(tcb);
+            tcps_timer_start(tcpips, tcb_handle);
             return;
         }
     }
@@ -1090,33 +2414,38 @@ static inline void tcps_rx_syn_sent(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
             tcps_destroy_tcb(tcpips, tcb_handle);
         }
         else
-            tcps_timer_start(tcb);
+            tcps_timer_start(tcpips, tcb_handle);
         return;
     }
 
     //fourth check the SYN bit
-    if (tcp->flags & TCP_FLAG_SYN)
+    if ((tcp->flags & TCP_FLAG_SYN) && (ack_diff > 0) && (ack_diff <= tcps_diff(tcb->snd_una, tcb->snd_nxt)))
     {
-        if (ack_diff)
-        {
-            ++tcb->rcv_nxt;
-            tcps_set_state(tcb, TCP_STATE_ESTABLISHED);
-            //inform user connected successfully
-            ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_OPEN), tcb_handle, tcb_handle, 0);
-            tcps_rx_text(tcpips, io, tcb_handle);
-        }
-        tcps_rx_send(tcpips, tcb_handle);
+        tcb->snd_una += ack_diff;
+        tcps_rtt_ack(tcb);
+        tcb->rcv_nxt = be2int(tcp->seq_be) + 1;
+        tcps_set_state(tcb, TCP_STATE_ESTABLISHED);
+        //inform user connected successfully
+        ipc_post_inline(tcb->process, HAL_CMD(HAL_TCP, IPC_OPEN), tcb_handle, tcb_handle, 0);
+        tcps_rx_text(tcpips, io, tcb_handle);
+        tcps_rx_send(tcpips, tcb_handle, true, true);
         return;
     }
+    tcps_timer_start(tcpips, tcb_handle);
 }
 
 static inline void tcps_rx_otw(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
 {
+    bool need_ack, quick_ack;
     TCP_HEADER* tcp = io_data(io);
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
 
     //first check sequence number
     if (!tcps_rx_otw_check_seq(tcpips, io, tcb_handle))
         return;
+    need_ack = tcps_seg_len(io) != 0;
+    //don't delay on PSH, FIN or if segment is filling the hole
+    quick_ack = (tcp->flags & (TCP_FLAG_PSH | TCP_FLAG_FIN)) || tcb->ooo_count;
 
     //second check the RST bit
     //fourth, check the SYN bit
@@ -1133,7 +2462,7 @@ static inline void tcps_rx_otw(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
     }
     else
     {
-        tcps_timer_start(so_get(&tcpips->tcps.tcbs, tcb_handle));
+        tcps_timer_start(tcpips, tcb_handle);
         return;
     }
 
@@ -1147,9 +2476,12 @@ static inline void tcps_rx_otw(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
         if (!tcps_rx_otw_fin(tcpips, tcb_handle))
             return;
     }
+    //hole filled?
+    else if (!tcps_rx_otw_ooo(tcpips, tcb_handle))
+        return;
 
     //finally send ACK reply/data/fin/etc
-    tcps_rx_send(tcpips, tcb_handle);
+    tcps_rx_send(tcpips, tcb_handle, need_ack, quick_ack);
 }
 
 static inline void tcps_rx_process(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
@@ -1160,9 +2492,6 @@ static inline void tcps_rx_process(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
     case TCP_STATE_CLOSED:
         tcps_rx_closed(tcpips, io, tcb_handle);
         break;
-    case TCP_STATE_LISTEN:
-        tcps_rx_listen(tcpips, io, tcb_handle);
-        break;
     case TCP_STATE_SYN_SENT:
         tcps_rx_syn_sent(tcpips, io, tcb_handle);
         break;
@@ -1174,13 +2503,27 @@ static inline void tcps_rx_process(TCPIPS* tcpips, IO* io, HANDLE tcb_handle)
 
 void tcps_init(TCPIPS* tcpips)
 {
+    unsigned int i;
     so_create(&tcpips->tcps.listen, sizeof(TCP_LISTEN_HANDLE), 1);
     so_create(&tcpips->tcps.tcbs, sizeof(TCP_TCB), 1);
+    tcpips->tcps.secret = srand();
+    for (i = 0; i < TCP_HASH_SIZE; ++i)
+        tcpips->tcps.tcb_hash[i] = INVALID_HANDLE;
+    for (i = 0; i < TCP_LISTEN_HASH_SIZE; ++i)
+        tcpips->tcps.listen_hash[i] = INVALID_HANDLE;
+    array_create(&tcpips->tcps.timers, sizeof(TCP_TIMER), 1);
+    array_create(&tcpips->tcps.tw, sizeof(TCP_TW), 1);
+    array_create(&tcpips->tcps.zc_closed, sizeof(IO*), 1);
+    tcpips->tcps.timer = timer_create(ANY_HANDLE, HAL_TCP);
+    tcpips->tcps.timer_active = false;
+    tcpips->tcps.rx_io = NULL;
+    tcpips->tcps.ack_timer_active = false;
 }
 
 void tcps_link_changed(TCPIPS* tcpips, bool link)
 {
     HANDLE handle;
+    unsigned int i;
     //nothing to do if link, close all connections if not
     if (!link)
     {
@@ -1188,6 +2531,11 @@ void tcps_link_changed(TCPIPS* tcpips, bool link)
             tcps_close_connection(tcpips, handle, ERROR_CONNECTION_CLOSED);
         while((handle = so_first(&tcpips->tcps.listen)) != INVALID_HANDLE)
             so_free(&tcpips->tcps.listen, handle);
+        for (i = 0; i < TCP_LISTEN_HASH_SIZE; ++i)
+            tcpips->tcps.listen_hash[i] = INVALID_HANDLE;
+        timer_stop(tcpips->tcps.timer, ANY_HANDLE, HAL_TCP);
+        tcpips->tcps.timer_active = tcpips->tcps.ack_timer_active = false;
+        array_clear(&tcpips->tcps.tw);
     }
 }
 
@@ -1195,8 +2543,11 @@ void tcps_rx(TCPIPS* tcpips, IO* io, IP* src)
 {
     TCP_HEADER* tcp;
     TCP_TCB* tcb;
-    HANDLE tcb_handle, process;
+    TCP_LISTEN_HANDLE* tlh;
+    HANDLE tcb_handle;
     uint16_t src_port, dst_port;
+    unsigned int wnd;
+    bool held;
     if (io->data_size < sizeof(TCP_HEADER) || tcp_checksum(io_data(io), io->data_size, src, &tcpips->ips.ip))
     {
         ips_release_io(tcpips, io);
@@ -1211,29 +2562,42 @@ void tcps_rx(TCPIPS* tcpips, IO* io, IP* src)
 
     if ((tcb_handle = tcps_find_tcb(tcpips, src, src_port, dst_port)) == INVALID_HANDLE)
     {
-        if ((tcb_handle = tcps_create_tcb_internal(tcpips, src, src_port, dst_port)) != INVALID_HANDLE)
+        if (tcps_rx_time_wait(tcpips, io, src))
         {
-            //listening?
-            if ((process = tcps_find_listener(tcpips, dst_port)) != INVALID_HANDLE)
-            {
-                tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
-                tcb->state = TCP_STATE_LISTEN;
-                tcb->active = false;
-                tcb->process = process;
-            }
+            ips_release_io(tcpips, io);
+            return;
         }
+        //listening?
+        if ((tlh = tcps_find_listen_handle(tcpips, dst_port)) != NULL)
+            tcb_handle = tcps_rx_listen(tcpips, io, src, tlh);
+        else
+            tcb_handle = tcps_create_tcb_internal(tcpips, src, src_port, dst_port);
     }
     if (tcb_handle != INVALID_HANDLE)
     {
         tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
-        timer_stop(tcb->timer, tcb_handle, HAL_TCP);
+        tcps_timer_stop(tcpips, tcb_handle);
+        //remote is alive
+        tcb->ka_probes = 0;
         tcps_apply_options(tcpips, io, tcb);
-        tcb->tx_wnd = be2short(tcp->window_be);
-        tcb->rx_cur = 0;
+        wnd = be2short(tcp->window_be);
+        //window in SYN is never scaled
+        if (tcb->wscale_ok && !(tcp->flags & TCP_FLAG_SYN))
+            wnd <<= tcb->snd_wscale;
+        tcb->wnd_update = tcb->tx_wnd != wnd;
+        tcb->tx_wnd = wnd;
+        tcpips->tcps.rx_io = io;
         tcps_rx_process(tcpips, io, tcb_handle);
-        //make sure not queued in rx
-        if (tcb->rx_tmp == io)
-            return;
+        tcpips->tcps.rx_io = NULL;
+        //make sure not queued in rx. TCB can be destroyed while processing
+        if (so_check_handle(&tcpips->tcps.tcbs, tcb_handle))
+        {
+            tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+            held = tcps_rx_holds(tcb, io);
+            tcps_zc_deliver(tcpips, tcb_handle);
+            if (held)
+                return;
+        }
     }
     ips_release_io(tcpips, io);
 }
@@ -1253,14 +2617,48 @@ static inline void tcps_listen(TCPIPS* tcpips, IPC* ipc)
     tlh = so_get(&tcpips->tcps.listen, handle);
     tlh->port = (uint16_t)ipc->param1;
     tlh->process = ipc->process;
+    tlh->syn_count = 0;
+    tlh->cookies = tlh->drops = 0;
+    tlh->next = tcpips->tcps.listen_hash[tcps_listen_hash(tlh->port)];
+    tcpips->tcps.listen_hash[tcps_listen_hash(tlh->port)] = handle;
     ipc->param2 = handle;
 }
 
 static inline void tcps_close_listen(TCPIPS* tcpips, HANDLE handle)
 {
+    HANDLE* cur;
+    TCP_LISTEN_HANDLE* tlh = so_get(&tcpips->tcps.listen, handle);
+    if (tlh == NULL)
+        return;
+    for (cur = &tcpips->tcps.listen_hash[tcps_listen_hash(tlh->port)]; *cur != INVALID_HANDLE;
+         cur = &((TCP_LISTEN_HANDLE*)so_get(&tcpips->tcps.listen, *cur))->next)
+    {
+        if (*cur == handle)
+        {
+            *cur = tlh->next;
+            break;
+        }
+    }
     so_free(&tcpips->tcps.listen, handle);
 }
 
+static inline void tcps_get_listen_stat(TCPIPS* tcpips, IPC* ipc)
+{
+    TCP_LISTEN_HANDLE* tlh = so_get(&tcpips->tcps.listen, (HANDLE)ipc->param1);
+    if (tlh == NULL)
+        return;
+    ipc->param2 = tlh->syn_count;
+    ipc->param3 = tlh->drops;
+}
+
+static inline void tcps_get_listen_cookies(TCPIPS* tcpips, IPC* ipc)
+{
+    TCP_LISTEN_HANDLE* tlh = so_get(&tcpips->tcps.listen, (HANDLE)ipc->param1);
+    if (tlh == NULL)
+        return;
+    ipc->param2 = tlh->cookies;
+}
+
 static HANDLE tcps_create_tcb(TCPIPS* tcpips, uint16_t remote_port, const IP* remote_addr, HANDLE process)
 {
     HANDLE tcb_handle;
@@ -1301,6 +2699,85 @@ static inline uint16_t tcps_get_local_port(TCPIPS* tcpips, HANDLE tcb_handle)
     return tcb->local_port;
 }
 
+static inline void tcps_get_rtt(TCPIPS* tcpips, IPC* ipc)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, (HANDLE)ipc->param1);
+    if (tcb == NULL)
+        return;
+    ipc->param2 = tcb->srtt >> 3;
+    ipc->param3 = tcb->rttvar >> 2;
+}
+
+static inline void tcps_get_rto(TCPIPS* tcpips, IPC* ipc)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, (HANDLE)ipc->param1);
+    if (tcb == NULL)
+        return;
+    ipc->param2 = tcb->rto;
+    ipc->param3 = tcb->retransmits;
+}
+
+static inline void tcps_set_options(TCPIPS* tcpips, HANDLE tcb_handle, unsigned int options)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb == NULL)
+        return;
+    if ((options ^ tcb->options) & TCP_OPTION_ZERO_COPY)
+    {
+        //can't switch with user IO pending or frames queued
+        if ((tcb->rx != NULL) || tcb->zc_count || tcb->zc_held)
+        {
+            error(ERROR_INVALID_STATE);
+            return;
+        }
+        //data, received before switch
+        if (tcb->rx_tmp != NULL)
+        {
+            tcb->zc[tcb->zc_count++] = tcb->rx_tmp;
+            tcb->rx_tmp = NULL;
+        }
+    }
+    tcb->options = options;
+    tcps_update_rx_wnd(tcb);
+    //push data, held by Nagle
+    if ((options & TCP_OPTION_NO_DELAY) && tcb->snd_len && (tcb->state == TCP_STATE_ESTABLISHED))
+    {
+        tcps_timer_stop(tcpips, tcb_handle);
+        tcps_output(tcpips, tcb_handle);
+        tcps_timer_start(tcpips, tcb_handle);
+    }
+}
+
+static inline void tcps_set_keep_alive(TCPIPS* tcpips, HANDLE tcb_handle, unsigned int idle, unsigned int interval_count)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb == NULL)
+        return;
+    tcb->ka_idle = idle;
+    tcb->ka_interval = interval_count >> 16;
+    tcb->ka_count = interval_count & 0xff;
+    tcb->ka_probes = 0;
+    //restart idle timer with new values
+    if ((tcb->state == TCP_STATE_ESTABLISHED) && !tcb->transmit)
+        tcps_timer_start(tcpips, tcb_handle);
+}
+
+static inline void tcps_set_user_timeout(TCPIPS* tcpips, HANDLE tcb_handle, unsigned int ms)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb == NULL)
+        return;
+    tcb->user_timeout = ms;
+}
+
+static inline unsigned int tcps_get_options(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb == NULL)
+        return 0;
+    return tcb->options;
+}
+
 static inline void tcps_open(TCPIPS* tcpips, HANDLE tcb_handle)
 {
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
@@ -1312,8 +2789,11 @@ static inline void tcps_open(TCPIPS* tcpips, HANDLE tcb_handle)
         return;
     }
     tcps_set_state(tcb, TCP_STATE_SYN_SENT);
-    tcb->snd_una = tcb->snd_nxt = tcps_gen_isn();
+    tcb->active = true;
+    tcb->snd_una = tcb->snd_nxt = tcb->recover = tcps_gen_isn();
     ++tcb->snd_nxt;
+    tcps_rtt_start(tcb, tcb->snd_una);
+    tcb->una_time = tcps_ms();
     tcps_tx_syn(tcpips, tcb_handle);
     error(ERROR_SYNC);
 }
@@ -1326,11 +2806,18 @@ static inline void tcps_close(TCPIPS* tcpips, HANDLE tcb_handle)
     switch (tcb->state)
     {
     case TCP_STATE_ESTABLISHED:
-        tcps_set_state(tcb, TCP_STATE_FIN_WAIT_1);
-        tcb->fin = true;
-        ++tcb->snd_nxt;
-        tcps_rx_flush(tcpips, tcb_handle);
-        tcps_tx_text_ack_fin(tcpips, tcb_handle);
+        tcps_timer_stop(tcpips, tcb_handle);
+        //remote FIN is already acked
+        if (tcb->rx_fin)
+            tcps_remote_close(tcpips, tcb_handle);
+        else
+        {
+            tcps_set_state(tcb, TCP_STATE_FIN_WAIT_1);
+            tcb->fin = true;
+            tcps_rx_flush(tcpips, tcb_handle);
+        }
+        tcps_output(tcpips, tcb_handle);
+        tcps_timer_start(tcpips, tcb_handle);
         error(ERROR_SYNC);
         break;
     case TCP_STATE_LAST_ACK:
@@ -1352,6 +2839,11 @@ static inline void tcps_read(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
     unsigned int size, data_size, data_offset;
     if (tcb == NULL)
         return;
+    if (tcb->options & TCP_OPTION_ZERO_COPY)
+    {
+        error(ERROR_INVALID_MODE);
+        return;
+    }
     if (tcb->rx != NULL)
     {
         error(ERROR_IN_PROGRESS);
@@ -1363,7 +2855,7 @@ static inline void tcps_read(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
     case TCP_STATE_ESTABLISHED:
     case TCP_STATE_FIN_WAIT_1:
     case TCP_STATE_FIN_WAIT_2:
-        timer_stop(tcb->timer, tcb_handle, HAL_TCP);
+        tcps_timer_stop(tcpips, tcb_handle);
         tcp_stack = io_push(io, sizeof(TCP_STACK));
         tcp_stack->flags = 0;
         tcp_stack->urg_len = 0;
@@ -1413,6 +2905,15 @@ static inline void tcps_read(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
                 memmove((uint8_t*)io_data(tcb->rx_tmp) + data_offset, (uint8_t*)io_data(tcb->rx_tmp) + data_offset + size, data_size - size);
                 tcb->rx_tmp->data_size -= size;
             }
+            //all data before remote FIN is read
+            if ((tcb->rx_tmp == NULL) && tcb->rx_fin)
+            {
+                tcp_stack->flags |= TCP_PSH;
+                io_complete(tcb->process, HAL_IO_CMD(HAL_TCP, IPC_READ), tcb_handle, io);
+                tcps_remote_close_deferred(tcpips, tcb_handle);
+                error(ERROR_SYNC);
+                return;
+            }
             //can return to user?
             if ((io_get_free(io) == 0) || (tcp_stack->flags & TCP_PSH))
             {
@@ -1433,8 +2934,91 @@ static inline void tcps_read(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
     }
 }
 
+static inline void tcps_get_frame(TCPIPS* tcpips, HANDLE tcb_handle)
+{
+    TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    if (tcb == NULL)
+        return;
+    if ((tcb->options & TCP_OPTION_ZERO_COPY) == 0)
+    {
+        error(ERROR_INVALID_MODE);
+        return;
+    }
+    if (tcb->zc_wait)
+    {
+        error(ERROR_IN_PROGRESS);
+        return;
+    }
+    switch (tcb->state)
+    {
+    case TCP_STATE_ESTABLISHED:
+    case TCP_STATE_FIN_WAIT_1:
+    case TCP_STATE_FIN_WAIT_2:
+        tcb->zc_wait = true;
+        tcps_zc_deliver(tcpips, tcb_handle);
+        error(ERROR_SYNC);
+        break;
+    default:
+        error(ERROR_INVALID_STATE);
+    }
+}
+
+//frame of already destroyed TCB
+static void tcps_release_closed_frame(TCPIPS* tcpips, IO* io)
+{
+    unsigned int i;
+    for (i = 0; i < array_size(tcpips->tcps.zc_closed); ++i)
+        if (*((IO**)array_at(tcpips->tcps.zc_closed, i)) == io)
+        {
+            array_remove(&tcpips->tcps.zc_closed, i);
+            ips_release_io(tcpips, io);
+            return;
+        }
+#if (TCP_DEBUG)
+    printf("TCP: release of unknown frame\n");
+#endif //TCP_DEBUG
+    error(ERROR_NOT_FOUND);
+}
+
+static inline void tcps_release_frame(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
+{
+    TCP_TCB* tcb;
+    unsigned int i;
+    //connection can be already closed
+    if (!so_check_handle(&tcpips->tcps.tcbs, tcb_handle))
+    {
+        tcps_release_closed_frame(tcpips, io);
+        return;
+    }
+    tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+    for (i = 0; (i < tcb->zc_held) && (tcb->zc_out[i] != io); ++i) {}
+    //handle can be reused by new TCB
+    if (i == tcb->zc_held)
+    {
+        tcps_release_closed_frame(tcpips, io);
+        return;
+    }
+    memmove(tcb->zc_out + i, tcb->zc_out + i + 1, (--tcb->zc_held - i) * sizeof(IO*));
+    ips_release_io(tcpips, io);
+    switch (tcb->state)
+    {
+    case TCP_STATE_ESTABLISHED:
+    case TCP_STATE_FIN_WAIT_1:
+    case TCP_STATE_FIN_WAIT_2:
+        if (tcps_update_rx_wnd(tcb))
+        {
+            tcps_timer_stop(tcpips, tcb_handle);
+            tcps_tx_ack(tcpips, tcb_handle);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 static inline void tcps_write(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
 {
+    IO* cur;
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
     if (tcb == NULL)
         return;
@@ -1443,17 +3027,37 @@ static inline void tcps_write(TCPIPS* tcpips, HANDLE tcb_handle, IO* io)
         error(ERROR_INVALID_STATE);
         return;
     }
+    //buffer is full, queue after others
     if (tcb->tx != NULL)
     {
-        error(ERROR_IN_PROGRESS);
+        if (io_push(io, sizeof(IO*)) == NULL)
+        {
+            error(ERROR_IO_BUFFER_TOO_SMALL);
+            return;
+        }
+        *((IO**)io_stack(io)) = NULL;
+        if (tcb->tx_queue == NULL)
+            tcb->tx_queue = io;
+        else
+        {
+            for (cur = tcb->tx_queue; *((IO**)io_stack(cur)) != NULL; cur = *((IO**)io_stack(cur))) {}
+            *((IO**)io_stack(cur)) = io;
+        }
+        error(ERROR_SYNC);
+        return;
+    }
+    if ((tcb->snd_buf == NULL) && ((tcb->snd_buf = malloc(TCP_SND_BUF_SIZE)) == NULL))
+    {
+        error(ERROR_OUT_OF_MEMORY);
         return;
     }
-    timer_stop(tcb->timer, tcb_handle, HAL_TCP);
+    tcps_timer_stop(tcpips, tcb_handle);
 
     tcb->tx = io;
-    tcb->snd_nxt += io->data_size;
     tcb->transmit = true;
-    tcps_tx_text_ack_fin(tcpips, tcb_handle);
+    tcps_snd_fill(tcpips, tcb_handle);
+    tcps_output(tcpips, tcb_handle);
+    tcps_timer_start(tcpips, tcb_handle);
     error(ERROR_SYNC);
 }
 
@@ -1470,27 +3074,43 @@ static inline void tcps_timeout(TCPIPS* tcpips, HANDLE tcb_handle)
     TCP_TCB* tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
     if (tcb == NULL)
         return;
-#if (TCP_KEEP_ALIVE)
     //keep-alive, not error condition
-    if ((tcb->state == TCP_STATE_ESTABLISHED) && (tcb->transmit == false))
+    if ((tcb->state == TCP_STATE_ESTABLISHED) && !tcb->transmit)
     {
+        if (tcb->ka_probes >= tcb->ka_count)
+        {
+#if (TCP_DEBUG_FLOW)
+            printf("TCP: Keep-alive failed, closing connection\n");
+#endif //TCP_DEBUG_FLOW
+            tcps_close_connection(tcpips, tcb_handle, ERROR_CONNECTION_TIMEOUT);
+            return;
+        }
 #if (TCP_DEBUG_FLOW)
         printf("TCP: Keep-alive to ");
         ip_print(&tcb->remote_addr);
         printf(":%u\n", tcb->remote_port);
 #endif //TCP_DEBUG_FLOW
-        tcb->transmit = true;
-        tcps_tx_text_ack_fin(tcpips, tcb_handle);
+        ++tcb->ka_probes;
+        tcps_tx_keep_alive(tcpips, tcb_handle);
+        tcps_timer_start(tcpips, tcb_handle);
         return;
     }
-#endif //TCP_KEEP_ALIVE
 
 #if (TCP_DEBUG_FLOW)
     printf("TCP: ");
     ip_print(&tcb->remote_addr);
     printf(":%u retry\n", tcb->remote_port);
 #endif //TCP_DEBUG_FLOW
-    if (++tcb->retry > TCP_RETRY_COUNT)
+    ++tcb->retry;
+    if (tcb->user_timeout && ((tcps_ms() - tcb->una_time) >= tcb->user_timeout))
+    {
+#if (TCP_DEBUG_FLOW)
+        printf("TCP: User timeout, closing connection\n");
+#endif //TCP_DEBUG_FLOW
+        tcps_close_connection(tcpips, tcb_handle, ERROR_CONNECTION_TIMEOUT);
+        return;
+    }
+    if (!tcb->user_timeout && (tcb->retry > TCP_RETRY_COUNT))
     {
 #if (TCP_DEBUG_FLOW)
         printf("TCP: Retry exceed, closing connection\n");
@@ -1498,21 +3118,84 @@ static inline void tcps_timeout(TCPIPS* tcpips, HANDLE tcb_handle)
         tcps_close_connection(tcpips, tcb_handle, ERROR_TIMEOUT);
         return;
     }
+    tcps_rto_backoff(tcb);
 
     switch (tcb->state)
     {
     case TCP_STATE_SYN_SENT:
         tcps_tx_syn(tcpips, tcb_handle);
         break;
+    case TCP_STATE_SYN_RECEIVED:
+        tcps_tx_syn_ack(tcpips, tcb_handle);
+        break;
     default:
-        tcps_tx_text_ack_fin(tcpips, tcb_handle);
+        //retransmit oldest unacked segment
+        if (tcb->seg_count)
+        {
+            tcb->cc_ops->tcp_cc_loss(&tcb->cc, tcps_delta(tcb->snd_una, tcb->snd_nxt), true);
+            tcb->recover = tcb->snd_nxt;
+            tcps_seg_reset(tcb, true);
+            tcps_retransmit(tcpips, tcb_handle, &tcb->seg[tcb->seg_head]);
+        }
+        //zero window probe
+        else if (tcps_tx_size(tcb) && (tcb->tx_wnd == 0))
+        {
+            ++tcb->tx_wnd;
+            tcps_output(tcpips, tcb_handle);
+            tcb->tx_wnd = 0;
+        }
+        else if (!tcps_output(tcpips, tcb_handle))
+        {
+            tcps_tx_ack(tcpips, tcb_handle);
+            break;
+        }
+        tcps_timer_start(tcpips, tcb_handle);
         break;
     }
 }
 
+static inline void tcps_ack_timeout(TCPIPS* tcpips)
+{
+    HANDLE tcb_handle;
+    TCP_TCB* tcb;
+    tcpips->tcps.ack_timer_active = false;
+    for (tcb_handle = so_first(&tcpips->tcps.tcbs); tcb_handle != INVALID_HANDLE; tcb_handle = so_next(&tcpips->tcps.tcbs, tcb_handle))
+    {
+        tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+        if (tcb->ack_pending)
+            tcps_tx_ack_internal(tcpips, tcb);
+    }
+}
+
+//all expired timers are processed at once
+static inline void tcps_timer_timeout(TCPIPS* tcpips)
+{
+    HANDLE tcb_handle;
+    uint32_t now = tcps_ms();
+    tcpips->tcps.timer_active = false;
+    if (tcpips->tcps.ack_timer_active && ((int)(now - tcpips->tcps.ack_expire) >= 0))
+        tcps_ack_timeout(tcpips);
+    while (array_size(tcpips->tcps.timers) && ((int)(now - TCP_TIMER_AT(tcpips, 0)->expire) >= 0))
+    {
+        tcb_handle = TCP_TIMER_AT(tcpips, 0)->handle;
+        tcps_timer_stop(tcpips, tcb_handle);
+        tcps_timeout(tcpips, tcb_handle);
+    }
+    if (tcpips->tcps.ack_timer_active)
+        tcps_timer_arm(tcpips, tcpips->tcps.ack_expire);
+    if (array_size(tcpips->tcps.timers))
+        tcps_timer_arm(tcpips, TCP_TIMER_AT(tcpips, 0)->expire);
+}
+
 void tcps_request(TCPIPS* tcpips, IPC* ipc)
 {
     IP ip;
+    //frame is returned to pool, even if TCB is closed or link is down
+    if (HAL_ITEM(ipc->cmd) == TCP_RELEASE_FRAME)
+    {
+        tcps_release_frame(tcpips, (HANDLE)ipc->param1, (IO*)ipc->param2);
+        return;
+    }
     if (!tcpips->connected)
     {
         error(ERROR_NOT_ACTIVE);
@@ -1526,6 +3209,12 @@ void tcps_request(TCPIPS* tcpips, IPC* ipc)
     case TCP_CLOSE_LISTEN:
         tcps_close_listen(tcpips, (HANDLE)ipc->param1);
         break;
+    case TCP_GET_LISTEN_STAT:
+        tcps_get_listen_stat(tcpips, ipc);
+        break;
+    case TCP_GET_LISTEN_COOKIES:
+        tcps_get_listen_cookies(tcpips, ipc);
+        break;
     case TCP_CREATE_TCB:
         ip.u32.ip = ipc->param2;
         ipc->param2 = tcps_create_tcb(tcpips, ipc->param1, &ip, ipc->process);
@@ -1540,6 +3229,12 @@ void tcps_request(TCPIPS* tcpips, IPC* ipc)
     case TCP_GET_LOCAL_PORT:
         ipc->param2 = tcps_get_local_port(tcpips, (HANDLE)ipc->param1);
         break;
+    case TCP_GET_RTT:
+        tcps_get_rtt(tcpips, ipc);
+        break;
+    case TCP_GET_RTO:
+        tcps_get_rto(tcpips, ipc);
+        break;
     case IPC_OPEN:
         tcps_open(tcpips, (HANDLE)ipc->param1);
         break;
@@ -1555,14 +3250,55 @@ void tcps_request(TCPIPS* tcpips, IPC* ipc)
     case IPC_FLUSH:
         tcps_flush(tcpips, (HANDLE)ipc->param1);
         break;
+    case TCP_SET_OPTIONS:
+        tcps_set_options(tcpips, (HANDLE)ipc->param1, ipc->param2);
+        break;
+    case TCP_GET_OPTIONS:
+        ipc->param2 = tcps_get_options(tcpips, (HANDLE)ipc->param1);
+        break;
+    case TCP_GET_FRAME:
+        tcps_get_frame(tcpips, (HANDLE)ipc->param1);
+        break;
+    case TCP_SET_KEEP_ALIVE:
+        tcps_set_keep_alive(tcpips, (HANDLE)ipc->param1, ipc->param2, ipc->param3);
+        break;
+    case TCP_SET_USER_TIMEOUT:
+        tcps_set_user_timeout(tcpips, (HANDLE)ipc->param1, ipc->param2);
+        break;
     case IPC_TIMEOUT:
-        tcps_timeout(tcpips, (HANDLE)ipc->param1);
+        tcps_timer_timeout(tcpips);
         break;
     default:
         error(ERROR_NOT_SUPPORTED);
     }
 }
 
+void tcps_pmtu_changed(TCPIPS* tcpips, const IP* dst)
+{
+    HANDLE tcb_handle;
+    TCP_TCB* tcb;
+    bool shrunk;
+    for (tcb_handle = so_first(&tcpips->tcps.tcbs); tcb_handle != INVALID_HANDLE; tcb_handle = so_next(&tcpips->tcps.tcbs, tcb_handle))
+    {
+        tcb = so_get(&tcpips->tcps.tcbs, tcb_handle);
+        if (tcb->remote_addr.u32.ip != dst->u32.ip)
+            continue;
+        //larger mss after PMTU expiration is used for new segments only
+        shrunk = tcps_update_mss(tcpips, tcb);
+        tcb->cc.mss = tcb->mss;
+        if (!shrunk || (tcb->seg_count == 0))
+            continue;
+#if (TCP_DEBUG)
+        printf("TCP: mss %d to ", tcb->mss);
+        ip_print(dst);
+        printf("\n");
+#endif //TCP_DEBUG
+        //RFC 1191: dropped segment is retransmitted at once, not waiting for RTO
+        if (!tcb->seg[tcb->seg_head].sacked)
+            tcps_retransmit(tcpips, tcb_handle, &tcb->seg[tcb->seg_head]);
+    }
+}
+
 #if (ICMP)
 void tcps_icmps_error_process(TCPIPS* tcpips, IO* io, ICMP_ERROR code, const IP* src)
 {
@@ -10,8 +10,10 @@
 #include "../../userspace/io.h"
 #include "../../userspace/ip.h"
 #include "../../userspace/so.h"
+#include "../../userspace/array.h"
 #include "tcpips.h"
 #include "icmps.h"
+#include "sys_config.h"
 
 #define TCP_FLAG_FIN                                (1 << 0)
 #define TCP_FLAG_SYN                                (1 << 1)
@@ -25,10 +27,33 @@
 #define TCP_OPTS_END                                0
 #define TCP_OPTS_NOOP                               1
 #define TCP_OPTS_MSS                                2
+#define TCP_OPTS_WSCALE                             3
+#define TCP_OPTS_SACK_PERMITTED                     4
+#define TCP_OPTS_SACK                               5
+#define TCP_OPTS_UTO                                28
 
 typedef struct {
     SO listen, tcbs;
+    //TCB by address/ports tuple, listener by port. Chained by handles
+    HANDLE tcb_hash[TCP_HASH_SIZE];
+    HANDLE listen_hash[TCP_LISTEN_HASH_SIZE];
+    //frames held in out-of-order queues of all TCBs
+    unsigned int ooo_count;
+    //segment in processing
+    IO* rx_io;
+    //TCB timers, binary heap by expire time
+    ARRAY* timers;
+    //connections in TIME WAIT
+    ARRAY* tw;
+    //zero-copy frames, still held by user after TCB is destroyed
+    ARRAY* zc_closed;
+    //single kernel timer for TCB timers and delayed ack, shared by all TCBs
+    HANDLE timer;
+    uint32_t timer_expire, ack_expire;
+    //SYN cookies key
+    uint32_t secret;
     uint16_t dynamic;
+    bool timer_active, ack_timer_active;
 } TCPS;
 
 
@@ -42,5 +67,7 @@ void tcps_rx(TCPIPS* tcpips, IO* io, IP* src);
 
 //from icmp
 void tcps_icmps_error_process(TCPIPS* tcpips, IO* io, ICMP_ERROR code, const IP* src);
+//path MTU to dst is changed
+void tcps_pmtu_changed(TCPIPS* tcpips, const IP* dst);
 
 #endif // TCPS_H
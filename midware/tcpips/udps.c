@@ -28,6 +28,12 @@ typedef struct {
     uint16_t remote_port, local_port;
     IP remote_addr;
     IO* head;
+    HANDLE hash_next;
+    //datagrams, received while no read is queued. UDP header is not hidden
+    IO* rx[UDP_RX_QUEUE_MAX];
+    IP rx_src[UDP_RX_QUEUE_MAX];
+    uint8_t rx_count;
+    uint8_t options;
 #if (ICMP)
     int err;
 #endif //ICMP
@@ -35,11 +41,16 @@ typedef struct {
 
 #define UDP_FRAME_MAX_DATA_SIZE                                 (IP_FRAME_MAX_DATA_SIZE - sizeof(UDP_HEADER))
 
+static inline unsigned int udps_hash(uint16_t port)
+{
+    return (port ^ (port >> 8)) & (UDP_HASH_SIZE - 1);
+}
+
 static HANDLE udps_find(TCPIPS* tcpips, uint16_t local_port)
 {
     HANDLE handle;
     UDP_HANDLE* uh;
-    for (handle = so_first(&tcpips->udps.handles); handle != INVALID_HANDLE; handle = so_next(&tcpips->udps.handles, handle))
+    for (handle = tcpips->udps.hash[udps_hash(local_port)]; handle != INVALID_HANDLE; handle = uh->hash_next)
     {
         uh = so_get(&tcpips->udps.handles, handle);
         if (uh->local_port == local_port)
@@ -48,6 +59,44 @@ static HANDLE udps_find(TCPIPS* tcpips, uint16_t local_port)
     return INVALID_HANDLE;
 }
 
+static HANDLE udps_allocate(TCPIPS* tcpips, uint16_t local_port, HANDLE process)
+{
+    HANDLE handle;
+    UDP_HANDLE* uh;
+    unsigned int hash;
+    if ((handle = so_allocate(&tcpips->udps.handles)) == INVALID_HANDLE)
+        return INVALID_HANDLE;
+    uh = so_get(&tcpips->udps.handles, handle);
+    uh->local_port = local_port;
+    uh->process = process;
+    uh->head = NULL;
+    uh->rx_count = 0;
+    uh->options = 0;
+#if (ICMP)
+    uh->err = ERROR_OK;
+#endif //ICMP
+    hash = udps_hash(local_port);
+    uh->hash_next = tcpips->udps.hash[hash];
+    tcpips->udps.hash[hash] = handle;
+    return handle;
+}
+
+static void udps_free(TCPIPS* tcpips, HANDLE handle)
+{
+    HANDLE* cur;
+    UDP_HANDLE* uh = so_get(&tcpips->udps.handles, handle);
+    for (cur = &tcpips->udps.hash[udps_hash(uh->local_port)]; *cur != INVALID_HANDLE;
+         cur = &((UDP_HANDLE*)so_get(&tcpips->udps.handles, *cur))->hash_next)
+    {
+        if (*cur == handle)
+        {
+            *cur = uh->hash_next;
+            break;
+        }
+    }
+    so_free(&tcpips->udps.handles, handle);
+}
+
 static inline uint16_t udps_allocate_port(TCPIPS* tcpips)
 {
     unsigned int res;
@@ -83,6 +132,14 @@ static IO* udps_peek_head(TCPIPS* tcpips, UDP_HANDLE* uh)
     return io;
 }
 
+static void udps_rx_pop(TCPIPS* tcpips, UDP_HANDLE* uh)
+{
+    ips_release_io(tcpips, uh->rx[0]);
+    --uh->rx_count;
+    memmove(uh->rx, uh->rx + 1, uh->rx_count * sizeof(IO*));
+    memmove(uh->rx_src, uh->rx_src + 1, uh->rx_count * sizeof(IP));
+}
+
 static void udps_flush(TCPIPS* tcpips, HANDLE handle)
 {
     IO* io;
@@ -96,6 +153,8 @@ static void udps_flush(TCPIPS* tcpips, HANDLE handle)
     if (uh->err != ERROR_OK)
         err = uh->err;
 #endif //ICMP
+    while (uh->rx_count)
+        udps_rx_pop(tcpips, uh);
     while ((io = udps_peek_head(tcpips, uh)) != NULL)
         io_complete_ex(uh->process, HAL_CMD(HAL_UDP, IPC_READ), handle, io, err);
 }
@@ -129,9 +188,70 @@ static void udps_send_user(TCPIPS* tcpips, IP* src, IO* io, HANDLE handle)
 #endif //UDP_DEBUG
 }
 
+static void udps_send_user_multi(TCPIPS* tcpips, HANDLE handle)
+{
+    IO* user_io;
+    unsigned int size, free;
+    UDP_RECORD* rec;
+    UDP_HEADER* hdr;
+    UDP_HANDLE* uh;
+
+    uh = so_get(&tcpips->udps.handles, handle);
+    user_io = udps_peek_head(tcpips, uh);
+    do {
+        hdr = io_data(uh->rx[0]);
+        size = uh->rx[0]->data_size - sizeof(UDP_HEADER);
+        free = io_get_free(user_io);
+        if (UDP_RECORD_SIZE(size) > free)
+        {
+            //left for the next read
+            if (user_io->data_size)
+                break;
+#if (UDP_DEBUG)
+            printf("UDP: %d byte(s) dropped\n", free < sizeof(UDP_RECORD) ? size : size - (free - sizeof(UDP_RECORD)));
+#endif //UDP_DEBUG
+            if (free < sizeof(UDP_RECORD))
+            {
+                udps_rx_pop(tcpips, uh);
+                break;
+            }
+            //first one is truncated
+            size = free - sizeof(UDP_RECORD);
+        }
+        rec = (UDP_RECORD*)((uint8_t*)io_data(user_io) + user_io->data_size);
+        rec->stack.remote_addr.u32.ip = uh->rx_src[0].u32.ip;
+        rec->stack.remote_port = be2short(hdr->src_port_be);
+        rec->size = size;
+        memcpy((uint8_t*)rec + sizeof(UDP_RECORD), (uint8_t*)hdr + sizeof(UDP_HEADER), size);
+        //no padding after truncated one
+        user_io->data_size += UDP_RECORD_SIZE(size) > free ? free : UDP_RECORD_SIZE(size);
+        udps_rx_pop(tcpips, uh);
+    } while (uh->rx_count);
+    io_complete(uh->process, HAL_IO_CMD(HAL_UDP, IPC_READ), handle, user_io);
+}
+
+//queued datagrams to queued reads
+static void udps_deliver(TCPIPS* tcpips, HANDLE handle)
+{
+    UDP_HANDLE* uh = so_get(&tcpips->udps.handles, handle);
+    while (uh->rx_count && uh->head)
+    {
+        if (uh->options & UDP_OPTION_MULTI_READ)
+            udps_send_user_multi(tcpips, handle);
+        else
+        {
+            udps_send_user(tcpips, &uh->rx_src[0], uh->rx[0], handle);
+            udps_rx_pop(tcpips, uh);
+        }
+    }
+}
+
 void udps_init(TCPIPS* tcpips)
 {
+    unsigned int i;
     so_create(&tcpips->udps.handles, sizeof(UDP_HANDLE), 1);
+    for (i = 0; i < UDP_HASH_SIZE; ++i)
+        tcpips->udps.hash[i] = INVALID_HANDLE;
 }
 
 void udps_link_changed(TCPIPS* tcpips, bool link)
@@ -144,7 +264,7 @@ void udps_link_changed(TCPIPS* tcpips, bool link)
         while ((handle = so_first(&tcpips->udps.handles)) != INVALID_HANDLE)
         {
             udps_flush(tcpips, handle);
-            so_free(&tcpips->udps.handles, handle);
+            udps_free(tcpips, handle);
         }
     }
 }
@@ -227,7 +347,18 @@ void udps_rx(TCPIPS* tcpips, IO* io, IP* src)
         uh = so_get(&tcpips->udps.handles, handle);
         //listener or connected
         if (uh->remote_port == 0 || (uh->remote_port == src_port && uh->remote_addr.u32.ip == src->u32.ip))
-            udps_send_user(tcpips, src, io, handle);
+        {
+            if (uh->rx_count < UDP_RX_QUEUE_MAX)
+            {
+                uh->rx[uh->rx_count] = io;
+                uh->rx_src[uh->rx_count++].u32.ip = src->u32.ip;
+                udps_deliver(tcpips, handle);
+                return;
+            }
+#if (UDP_DEBUG)
+            printf("UDP: rx queue full, datagramm dropped\n");
+#endif //UDP_DEBUG
+        }
         else
             handle = INVALID_HANDLE;
     }
@@ -256,18 +387,12 @@ static inline void udps_listen(TCPIPS* tcpips, IPC* ipc)
         error(ERROR_ALREADY_CONFIGURED);
         return;
     }
-    handle = so_allocate(&tcpips->udps.handles);
+    handle = udps_allocate(tcpips, (uint16_t)ipc->param1, ipc->process);
     if (handle == INVALID_HANDLE)
         return;
     uh = so_get(&tcpips->udps.handles, handle);
     uh->remote_port = 0;
-    uh->local_port = (uint16_t)ipc->param1;
     uh->remote_addr.u32.ip = __LOCALHOST.u32.ip;
-    uh->process = ipc->process;
-    uh->head = NULL;
-#if (ICMP)
-    uh->err = ERROR_OK;
-#endif //ICMP
 
     ipc->param2 = handle;
 }
@@ -279,20 +404,13 @@ static inline void udps_connect(TCPIPS* tcpips, IPC* ipc)
     IP dst;
     uint16_t local_port;
     dst.u32.ip = ipc->param2;
-    local_port = udps_allocate_port(tcpips);
     if ((local_port = udps_allocate_port(tcpips)) == 0)
         return;
-    if ((handle = so_allocate(&tcpips->udps.handles)) == INVALID_HANDLE)
+    if ((handle = udps_allocate(tcpips, local_port, ipc->process)) == INVALID_HANDLE)
         return;
     uh = so_get(&tcpips->udps.handles, handle);
     uh->remote_port = (uint16_t)ipc->param1;
-    uh->local_port = local_port;
     uh->remote_addr.u32.ip = dst.u32.ip;
-    uh->process = ipc->process;
-    uh->head = NULL;
-#if (ICMP)
-    uh->err = ERROR_OK;
-#endif //ICMP
     ipc->param2 = handle;
 }
 
@@ -302,7 +420,7 @@ static inline void udps_close(TCPIPS* tcpips, HANDLE handle)
     if ((uh = so_get(&tcpips->udps.handles, handle)) == NULL)
         return;
     udps_flush(tcpips, handle);
-    so_free(&tcpips->udps.handles, handle);
+    udps_free(tcpips, handle);
 }
 
 static inline void udps_read(TCPIPS* tcpips, HANDLE handle, IO* io)
@@ -330,14 +448,38 @@ static inline void udps_read(TCPIPS* tcpips, HANDLE handle, IO* io)
         for (cur = uh->head; *((IO**)io_data(cur)) != NULL; cur = *((IO**)io_data(cur))) {}
         *((IO**)io_data(cur)) = io;
     }
+    udps_deliver(tcpips, handle);
     error(ERROR_SYNC);
 }
 
+static inline void udps_set_options(TCPIPS* tcpips, HANDLE handle, unsigned int options)
+{
+    UDP_HANDLE* uh = so_get(&tcpips->udps.handles, handle);
+    if (uh == NULL)
+        return;
+    //can't change record format with read pending
+    if (uh->head != NULL)
+    {
+        error(ERROR_INVALID_STATE);
+        return;
+    }
+    uh->options = options;
+}
+
+static inline unsigned int udps_get_options(TCPIPS* tcpips, HANDLE handle)
+{
+    UDP_HANDLE* uh = so_get(&tcpips->udps.handles, handle);
+    if (uh == NULL)
+        return 0;
+    return uh->options;
+}
+
 static inline void udps_write(TCPIPS* tcpips, HANDLE handle, IO* io)
 {
     IO* cur;
     unsigned int offset, size;
     unsigned short remote_port;
+    uint16_t sum;
     IP dst;
     UDP_STACK* udp_stack;
     UDP_HEADER* udp;
@@ -378,8 +520,8 @@ static inline void udps_write(TCPIPS* tcpips, HANDLE handle, IO* io)
         cur = ips_allocate_io(tcpips, size + sizeof(UDP_HEADER), PROTO_UDP);
         if (cur == NULL)
             return;
-        //copy data
-        memcpy((uint8_t*)io_data(cur) + sizeof(UDP_HEADER), (uint8_t*)io_data(io) + offset, size);
+        //copy data, summing on the fly
+        sum = ip_copy_sum((uint8_t*)io_data(cur) + sizeof(UDP_HEADER), (uint8_t*)io_data(io) + offset, size, 0);
         udp = io_data(cur);
 // correct size
         cur->data_size = size + sizeof(UDP_HEADER);
@@ -388,7 +530,8 @@ static inline void udps_write(TCPIPS* tcpips, HANDLE handle, IO* io)
         short2be(udp->dst_port_be, remote_port);
         short2be(udp->len_be, size + sizeof(UDP_HEADER));
         short2be(udp->checksum_be, 0);
-        short2be(udp->checksum_be, udp_checksum(io_data(cur), cur->data_size, &tcpips->ips.ip, &dst));
+        sum = ip_sum_add(ip_sum(udp, sizeof(UDP_HEADER), ip_pseudo_sum(&tcpips->ips.ip, &dst, PROTO_UDP, cur->data_size)), sum, sizeof(UDP_HEADER));
+        short2be(udp->checksum_be, (uint16_t)~sum);
         ips_tx(tcpips, cur, &dst);
     }
 }
@@ -420,6 +563,12 @@ void udps_request(TCPIPS* tcpips, IPC* ipc)
     case IPC_FLUSH:
         udps_flush(tcpips, ipc->param1);
         break;
+    case UDP_SET_OPTIONS:
+        udps_set_options(tcpips, ipc->param1, ipc->param2);
+        break;
+    case UDP_GET_OPTIONS:
+        ipc->param2 = udps_get_options(tcpips, ipc->param1);
+        break;
     default:
         error(ERROR_NOT_SUPPORTED);
     }
@@ -13,9 +13,12 @@
 #include "../../userspace/ip.h"
 #include "../../userspace/io.h"
 #include "../../userspace/so.h"
+#include "sys_config.h"
 
 typedef struct {
     SO handles;
+    //handles by local port. Chained by handles
+    HANDLE hash[UDP_HASH_SIZE];
     uint16_t dynamic;
 } UDPS;
 
@@ -0,0 +1,136 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+/*
+    ipsum_test - host test vectors for userspace/ip.c checksum
+
+    ip_sum, ip_copy_sum, ip_sum_add and ip_checksum_update/32 are compared against
+    plain byte loop over random data, lengths, alignments and split points.
+    RFC 1624 update is checked on random 16 and 32 bit field rewrites.
+
+    build: make check
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../userspace/ip.h"
+
+#define BUF_SIZE                                4200
+#define SMALL_RUNS                              1000000
+#define RUNS                                    2000000
+
+static int bad;
+
+//reference: RFC 1071 byte loop, inverted
+static uint16_t ref_checksum(const uint8_t* buf, unsigned int size)
+{
+    unsigned int i;
+    uint32_t sum = 0;
+    for (i = 0; i + 1 < size; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (size & 1)
+        sum += buf[size - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static void fail(const char* what, unsigned int off, unsigned int doff, unsigned int size, unsigned int split)
+{
+    if (bad++ < 10)
+        printf("%s failed: offset %u, dst offset %u, size %u, split %u\n", what, off, doff, size, split);
+}
+
+static void fill(uint8_t* buf, unsigned int size)
+{
+    unsigned int i;
+    int mode = lrand48() % 3;
+    //all ones and 0x00/0xff mix hit carry corner cases
+    for (i = 0; i < size; ++i)
+        buf[i] = mode == 0 ? 0xff : mode == 1 ? ((lrand48() & 1) ? 0xff : 0x00) : (uint8_t)lrand48();
+}
+
+static void test_known()
+{
+    //RFC 1071 4.1 example
+    static const uint8_t rfc1071[] = {0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7};
+    //IPv4 header with zero checksum field, checksum 0xb861
+    static const uint8_t hdr[] = {0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+                                  0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7};
+    static const uint8_t pseudo[] = {10, 0, 0, 1, 192, 168, 1, 200, 0, PROTO_TCP, 0x05, 0xdc};
+    IP src = {{10, 0, 0, 1}}, dst = {{192, 168, 1, 200}};
+    if (ip_sum(rfc1071, sizeof(rfc1071), 0) != 0xddf2)
+        fail("RFC 1071 vector", 0, 0, sizeof(rfc1071), 0);
+    if (ip_checksum((void*)hdr, sizeof(hdr)) != 0xb861)
+        fail("IPv4 header vector", 0, 0, sizeof(hdr), 0);
+    if ((uint16_t)~ip_pseudo_sum(&src, &dst, PROTO_TCP, 1500) != ref_checksum(pseudo, sizeof(pseudo)))
+        fail("pseudo header", 0, 0, sizeof(pseudo), 0);
+}
+
+static void test_random()
+{
+    static uint8_t buf[BUF_SIZE], dst[BUF_SIZE];
+    unsigned int run, off, doff, size, split, pos;
+    uint16_t ref, old_value, new_value;
+    uint32_t old_value32, new_value32;
+    for (run = 0; run < RUNS; ++run)
+    {
+        off = lrand48() % 8;
+        doff = lrand48() % 8;
+        size = run < SMALL_RUNS ? lrand48() % 64 : lrand48() % 4000;
+        split = size ? lrand48() % size : 0;
+        fill(buf + off, size);
+        ref = ref_checksum(buf + off, size);
+
+        if ((uint16_t)~ip_sum(buf + off, size, 0) != ref)
+            fail("ip_sum", off, 0, size, 0);
+
+        memset(dst, 0xcc, sizeof(dst));
+        if ((uint16_t)~ip_copy_sum(dst + doff, buf + off, size, 0) != ref)
+            fail("ip_copy_sum", off, doff, size, 0);
+        if (memcmp(dst + doff, buf + off, size) || dst[doff + size] != 0xcc || (doff && dst[doff - 1] != 0xcc))
+            fail("ip_copy_sum data", off, doff, size, 0);
+
+        //chained sum of two blocks, second started at any offset
+        if ((uint16_t)~ip_sum_add(ip_sum(buf + off, split, 0), ip_sum(buf + off + split, size - split, 0), split) != ref)
+            fail("ip_sum_add", off, 0, size, split);
+        if ((uint16_t)~ip_sum_add(ip_copy_sum(dst + doff, buf + off, split, 0),
+                                  ip_copy_sum(dst + doff + split, buf + off + split, size - split, 0), split) != ref)
+            fail("ip_copy_sum split", off, doff, size, split);
+
+        //RFC 1624: rewrite of 16 bit field (port, ID) and 32 bit field (address, seq) at even offset
+        if (size >= 20)
+        {
+            pos = (lrand48() % (size / 2 - 1)) * 2;
+            old_value = (buf[off + pos] << 8) | buf[off + pos + 1];
+            new_value = (uint16_t)lrand48();
+            buf[off + pos] = new_value >> 8;
+            buf[off + pos + 1] = new_value & 0xff;
+            if (ip_checksum_update(ref, old_value, new_value) != (ref = ref_checksum(buf + off, size)))
+                fail("ip_checksum_update", off, 0, size, pos);
+
+            pos = (lrand48() % (size / 2 - 1)) * 2;
+            old_value32 = ((uint32_t)buf[off + pos] << 24) | (buf[off + pos + 1] << 16) | (buf[off + pos + 2] << 8) | buf[off + pos + 3];
+            new_value32 = (lrand48() & 3) ? (uint32_t)mrand48() : (lrand48() & 1) ? 0xffffffff : 0;
+            buf[off + pos] = new_value32 >> 24;
+            buf[off + pos + 1] = (new_value32 >> 16) & 0xff;
+            buf[off + pos + 2] = (new_value32 >> 8) & 0xff;
+            buf[off + pos + 3] = new_value32 & 0xff;
+            if (ip_checksum_update32(ref, old_value32, new_value32) != ref_checksum(buf + off, size))
+                fail("ip_checksum_update32", off, 0, size, pos);
+        }
+    }
+}
+
+int main()
+{
+    srand48(1);
+    test_known();
+    test_random();
+    printf("ipsum: %s, %d failed\n", bad ? "FAIL" : "OK", bad);
+    return bad != 0;
+}
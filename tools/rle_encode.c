@@ -0,0 +1,187 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+/*
+    rle_encode - host-side encoder for image_rle() format, see userspace/graphics.h
+
+    Input is raw pixel stream: MSB first, rows are not padded (canvas data without reserved byte).
+    Output is C array, ready to be included in project.
+
+    build: gcc -O2 -o rle_encode rle_encode.c
+    usage: rle_encode <input.raw> <width> <height> <bpp> <name> [transparent color]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+//must match userspace/graphics.h
+#define RLE_HEADER_SIZE                     5
+#define RLE_LITERAL                         (0 << 6)
+#define RLE_FILL                            (1 << 6)
+#define RLE_SKIP                            (2 << 6)
+#define RLE_LONG                            (1 << 5)
+#define RLE_LEN_MASK                        0x1f
+#define RLE_RUN_MAX                         0x2000
+
+typedef struct {
+    uint8_t* data;
+    unsigned int size, max;
+} BUF;
+
+static void buf_put(BUF* buf, uint8_t byte)
+{
+    if (buf->size == buf->max)
+    {
+        buf->max = buf->max ? buf->max * 2 : 1024;
+        buf->data = realloc(buf->data, buf->max);
+        if (buf->data == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    buf->data[buf->size++] = byte;
+}
+
+static void rle_ctrl(BUF* buf, uint8_t type, unsigned int len)
+{
+    --len;
+    if (len > RLE_LEN_MASK)
+    {
+        buf_put(buf, type | RLE_LONG | (len >> 8));
+        buf_put(buf, len & 0xff);
+    }
+    else
+        buf_put(buf, type | len);
+}
+
+static uint32_t pixel_read(const uint8_t* pix, unsigned int pos, unsigned int bpp)
+{
+    unsigned int i;
+    uint32_t res = 0;
+    for (i = 0; i < bpp; ++i, ++pos)
+        res = (res << 1) | ((pix[pos >> 3] >> (7 - (pos & 7))) & 1);
+    return res;
+}
+
+static void rle_literal(BUF* buf, const uint32_t* pixels, unsigned int len, unsigned int bpp)
+{
+    unsigned int i, j, bits;
+    uint8_t byte;
+    rle_ctrl(buf, RLE_LITERAL, len);
+    for (i = 0, bits = 0, byte = 0; i < len; ++i)
+    {
+        for (j = bpp; j; --j)
+        {
+            byte = (byte << 1) | ((pixels[i] >> (j - 1)) & 1);
+            if (++bits == 8)
+            {
+                buf_put(buf, byte);
+                bits = byte = 0;
+            }
+        }
+    }
+    if (bits)
+        buf_put(buf, byte << (8 - bits));
+}
+
+static void rle_encode(BUF* buf, const uint32_t* pixels, unsigned int count, unsigned int bpp, int transparent)
+{
+    unsigned int i, run, literal, color_size;
+    color_size = (bpp + 7) >> 3;
+    for (i = 0, literal = 0; i < count; )
+    {
+        for (run = 1; i + run < count && run < RLE_RUN_MAX && pixels[i + run] == pixels[i]; ++run) {}
+        //fill only if cheaper, than literal
+        if ((transparent >= 0 && pixels[i] == (uint32_t)transparent) || ((run * bpp + 7) >> 3) > color_size + 1)
+        {
+            if (literal)
+                rle_literal(buf, pixels + i - literal, literal, bpp);
+            literal = 0;
+            if (transparent >= 0 && pixels[i] == (uint32_t)transparent)
+                rle_ctrl(buf, RLE_SKIP, run);
+            else
+            {
+                rle_ctrl(buf, RLE_FILL, run);
+                for (; color_size; --color_size)
+                    buf_put(buf, (pixels[i] >> ((color_size - 1) << 3)) & 0xff);
+                color_size = (bpp + 7) >> 3;
+            }
+            i += run;
+            continue;
+        }
+        if (literal + run > RLE_RUN_MAX)
+        {
+            rle_literal(buf, pixels + i - literal, literal, bpp);
+            literal = 0;
+        }
+        literal += run;
+        i += run;
+    }
+    if (literal)
+        rle_literal(buf, pixels + i - literal, literal, bpp);
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* f;
+    BUF buf;
+    uint8_t* pix;
+    uint32_t* pixels;
+    unsigned int width, height, bpp, size, i;
+    int transparent;
+    if (argc < 6)
+    {
+        fprintf(stderr, "usage: rle_encode <input.raw> <width> <height> <bpp> <name> [transparent color]\n");
+        return 1;
+    }
+    width = strtoul(argv[2], NULL, 0);
+    height = strtoul(argv[3], NULL, 0);
+    bpp = strtoul(argv[4], NULL, 0);
+    transparent = argc > 6 ? (int)strtoul(argv[6], NULL, 0) : -1;
+    if (bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8 && bpp != 16)
+    {
+        fprintf(stderr, "unsupported bpp: %d\n", bpp);
+        return 1;
+    }
+    if (width == 0 || height == 0 || width > 0xffff || height > 0xffff)
+    {
+        fprintf(stderr, "invalid image size\n");
+        return 1;
+    }
+    size = (width * height * bpp + 7) >> 3;
+    pix = malloc(size);
+    pixels = malloc(width * height * sizeof(uint32_t));
+    f = fopen(argv[1], "rb");
+    if (f == NULL || pix == NULL || pixels == NULL || fread(pix, 1, size, f) != size)
+    {
+        fprintf(stderr, "can't read %d bytes from %s\n", size, argv[1]);
+        return 1;
+    }
+    fclose(f);
+    for (i = 0; i < width * height; ++i)
+        pixels[i] = pixel_read(pix, i * bpp, bpp);
+
+    memset(&buf, 0, sizeof(BUF));
+    buf_put(&buf, (width >> 8) & 0xff);
+    buf_put(&buf, width & 0xff);
+    buf_put(&buf, (height >> 8) & 0xff);
+    buf_put(&buf, height & 0xff);
+    buf_put(&buf, bpp);
+    rle_encode(&buf, pixels, width * height, bpp, transparent);
+
+    printf("//%dx%d %d bpp, %d bytes raw, %d bytes RLE\n", width, height, bpp, size, buf.size);
+    printf("const uint8_t %s[%d] = {", argv[5], buf.size);
+    for (i = 0; i < buf.size; ++i)
+        printf("%s0x%02x%s", (i % 16) ? " " : "\n    ", buf.data[i], i + 1 < buf.size ? "," : "");
+    printf("\n};\n");
+    free(buf.data);
+    free(pixels);
+    free(pix);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+/*
+    bulk transfer node0 -> node1, verify stream, report time
+
+    usage: bulk [loss] [total] [verbose] [one way delay us] [seed] [lost packet numbers...]
+    env: WR/RD - write/read size, QD - writes in flight (max 4), ZC - zero-copy receive, ND - no delay,
+         MTU, MTU_AT - link MTU drop after packet number, MERGE - packet number joined with next segment
+*/
+
+#include "sim.c"
+
+#define QD_MAX                          4
+
+unsigned total = 200000, wr_size = 8192, rd_size = 2048;
+unsigned written, received, rx_ios;
+HANDLE cli, srv;
+int opened, closed_cli, closed_srv, errors;
+IO* wios[QD_MAX];
+int pending, qd = 1;
+uint64_t t_open, t_done;
+
+static void cli_write(IO* wio)
+{
+    TCP_STACK* st;
+    unsigned i, n = total - written < wr_size ? total - written : wr_size;
+    io_reset(wio);
+    st = io_push(wio, sizeof(TCP_STACK));
+    st->flags = TCP_PSH; st->urg_len = 0;
+    for (i = 0; i < n; ++i)
+        ((uint8_t*)io_data(wio))[i] = (uint8_t)((written + i) * 7 + ((written + i) >> 8));
+    wio->data_size = n;
+    written += n;
+    ++pending;
+    if (request(0, HAL_IO_REQ(HAL_TCP, IPC_WRITE), cli, (uintptr_t)wio, n, NULL) != ERROR_SYNC)
+    {
+        printf("write err %d\n", last_error); ++errors;
+    }
+}
+
+int zc, nd;
+static void srv_get_frame(HANDLE h)
+{
+    int e = request(1, HAL_REQ(HAL_TCP, TCP_GET_FRAME), h, 0, 0, NULL);
+    if (e != ERROR_SYNC && received != total) { printf("get frame err %d\n", e); ++errors; }
+}
+
+static void srv_read(HANDLE h)
+{
+    if (zc) { srv_get_frame(h); return; }
+
+    IO* io = io_create(rd_size + 64);
+    int e = request(1, HAL_IO_REQ(HAL_TCP, IPC_READ), h, (uintptr_t)io, rd_size, NULL);
+    if (e != ERROR_SYNC) { if (received != total) { printf("read err %d\n", e); ++errors; } io_free(io); }
+}
+
+static void handler(EV* ev)
+{
+    unsigned i;
+    IO* io;
+    switch (ev->process)
+    {
+    case 100:
+        if (ev->cmd == HAL_CMD(HAL_TCP, IPC_OPEN))
+        {
+            if (ev->p2 == INVALID_HANDLE) { printf("open failed %d\n", (int)ev->p3); ++errors; return; }
+            opened = 1; t_open = now_us;
+            if (nd && request(0, HAL_REQ(HAL_TCP, TCP_SET_OPTIONS), cli, TCP_OPTION_NO_DELAY, 0, NULL)) { printf("nd set err\n"); ++errors; }
+            for (i = 0; i < qd && written < total; ++i)
+                cli_write(wios[i]);
+        }
+        else if (ev->cmd == HAL_IO_CMD(HAL_TCP, IPC_WRITE))
+        {
+            if ((int)ev->p3 < 0) { printf("write complete err %d\n", (int)ev->p3); ++errors; return; }
+            --pending;
+            if (written < total)
+                cli_write((IO*)ev->p2);
+            else if (pending == 0)
+                request(0, HAL_REQ(HAL_TCP, IPC_CLOSE), cli, 0, 0, NULL);
+        }
+        else if (ev->cmd == HAL_CMD(HAL_TCP, IPC_CLOSE))
+            closed_cli = 1;
+        break;
+    case 101:
+        if (ev->cmd == HAL_CMD(HAL_TCP, IPC_OPEN))
+        {
+            srv = ev->p1;
+            if (zc && request(1, HAL_REQ(HAL_TCP, TCP_SET_OPTIONS), srv, TCP_OPTION_ZERO_COPY, 0, NULL)) { printf("zc set err\n"); ++errors; }
+            srv_read(srv);
+        }
+        else if (ev->cmd == HAL_CMD(HAL_TCP, TCP_GET_FRAME))
+        {
+            io = (IO*)ev->p2;
+            if ((int)ev->p3 < 0) { if (received != total) { printf("frame err %d\n", (int)ev->p3); ++errors; } return; }
+            for (i = 0; i < io->data_size; ++i)
+                if (((uint8_t*)io_data(io))[i] != (uint8_t)((received + i) * 7 + ((received + i) >> 8)))
+                {
+                    printf("data mismatch at %u\n", received + i); ++errors; break;
+                }
+            received += io->data_size;
+            ++rx_ios;
+            if (received == total) t_done = now_us;
+            request(1, HAL_CMD(HAL_TCP, TCP_RELEASE_FRAME), srv, (uintptr_t)io, 0, NULL);
+            srv_get_frame(srv);
+        }
+        else if (ev->cmd == HAL_IO_CMD(HAL_TCP, IPC_READ))
+        {
+            io = (IO*)ev->p2;
+            if ((int)ev->p3 < 0) { io_free(io); return; }
+            for (i = 0; i < io->data_size; ++i)
+                if (((uint8_t*)io_data(io))[i] != (uint8_t)((received + i) * 7 + ((received + i) >> 8)))
+                {
+                    printf("data mismatch at %u\n", received + i); ++errors; break;
+                }
+            received += io->data_size;
+            ++rx_ios;
+            if (received == total) t_done = now_us;
+            io_free(io);
+            srv_read(srv);
+        }
+        else if (ev->cmd == HAL_CMD(HAL_TCP, IPC_CLOSE))
+        {
+            closed_srv = 1;
+            request(1, HAL_REQ(HAL_TCP, IPC_CLOSE), ev->p1, 0, 0, NULL);
+        }
+        break;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uintptr_t h;
+    if (argc > 1) loss = atof(argv[1]);
+    if (argc > 2) total = atoi(argv[2]);
+    if (argc > 3) verbose = atoi(argv[3]);
+    if (argc > 4) link_delay_us = atoi(argv[4]);
+    srand48(argc > 5 ? atoi(argv[5]) : 1);
+    for (h = 6; h < (uintptr_t)argc && drop_count < 64; ++h)
+        drop_list[drop_count++] = atoi(argv[h]);
+    if (getenv("RD")) rd_size = atoi(getenv("RD"));
+    if (getenv("WR")) wr_size = atoi(getenv("WR"));
+    if (getenv("ZC")) zc = 1;
+    if (getenv("ND")) nd = 1;
+    if (getenv("QD")) qd = atoi(getenv("QD"));
+    if (qd < 1 || qd > QD_MAX) qd = 1;
+    if (getenv("MTU_AT")) mtu_at = atoi(getenv("MTU_AT"));
+    if (getenv("MTU")) link_mtu = atoi(getenv("MTU"));
+    if (getenv("MERGE")) merge_at = atoi(getenv("MERGE"));
+    sim_init();
+    app = handler;
+    for (h = 0; h < qd; ++h)
+        wios[h] = io_create(wr_size + 64);
+    request(1, HAL_REQ(HAL_TCP, TCP_LISTEN), 80, 0, 0, NULL);
+    request(0, HAL_REQ(HAL_TCP, TCP_CREATE_TCB), 80, nodes[1].ips.ip.u32.ip, 0, &h);
+    cli = h;
+    request(0, HAL_REQ(HAL_TCP, IPC_OPEN), cli, 0, 0, NULL);
+    while (step(600ull * 1000000)) {}
+    printf("loss=%.3f rtt=%ums: %u/%u bytes in %.1f ms (%.1f KB/s), pkts %lu lost %lu acks %lu, err %d, tcbs %u/%u frames %d dbl %d closed %d/%d tw %u/%u\n",
+           loss, link_delay_us * 2 / 1000, received, total, (t_done - t_open) / 1000.0,
+           received / ((t_done - t_open) / 1000000.0) / 1024, pkts_sent, pkts_lost, acks_sent, errors,
+           so_count(&nodes[0].tcps.tcbs), so_count(&nodes[1].tcps.tcbs), frames_out, double_start, closed_cli, closed_srv, array_size(nodes[0].tcps.tw), array_size(nodes[1].tcps.tw));
+    printf("pmtu drops %u\n", pmtu_drops);
+    return errors || received != total;
+}
@@ -0,0 +1,372 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+/*
+    tcpsim - host simulation of tcps.c: two nodes over lossy link
+
+    Stack is compiled unmodified against stub userspace (see stub/ and Makefile).
+    Link is store-and-forward with fixed rate and delay, packets are lost
+    randomly (loss) or by number (drop_list). Time is virtual, so run is fast and repeatable.
+    Packet merge_at is joined with next segment sent before, as peer collapsing
+    segments on retransmission does.
+    Scenario includes this file and provides app handler, see bulk.c
+*/
+
+#include "userspace/types.h"
+#include "userspace/io.h"
+#include "userspace/so.h"
+#include "userspace/systime.h"
+#include "userspace/error.h"
+#include "userspace/endian.h"
+#include "userspace/tcp.h"
+#include "midware/tcpips/tcpips_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void tcps_init(TCPIPS* tcpips);
+void tcps_request(TCPIPS* tcpips, IPC* ipc);
+void tcps_rx(TCPIPS* tcpips, IO* io, IP* src);
+
+TCPIPS nodes[2];
+uint64_t now_us;
+static int last_error;
+int frames_out;
+int double_start;
+unsigned long pkts_sent, pkts_lost, bytes_wire, acks_sent;
+
+//link config
+unsigned link_delay_us = 10000;
+unsigned link_rate_bps = 10000000;
+double loss = 0;
+int drop_list[64], drop_count;
+uint64_t link_free[2];
+int verbose;
+
+void error(int code) { last_error = code; }
+int get_last_error() { return last_error; }
+unsigned int rexos_srand(void) { return 0x12345678; }
+
+//------- so
+SO* so_create(SO* so, unsigned int data_size, unsigned int reserved)
+{
+    so->data_size = data_size; so->count = 0; so->cap = 256;
+    so->data = calloc(so->cap, data_size);
+    so->used = calloc(so->cap, 1);
+    return so;
+}
+void so_destroy(SO* so) {}
+HANDLE so_allocate(SO* so)
+{
+    unsigned i;
+    for (i = 0; i < so->cap; ++i)
+        if (!so->used[i])
+        {
+            so->used[i] = 1; ++so->count;
+            memset(so->data + i * so->data_size, 0xa5, so->data_size);
+            return i + 1;
+        }
+    error(ERROR_TOO_MANY_HANDLES);
+    return INVALID_HANDLE;
+}
+bool so_check_handle(SO* so, HANDLE h) { return h && h <= so->cap && so->used[h - 1]; }
+void so_free(SO* so, HANDLE h) { if (so_check_handle(so, h)) { so->used[h - 1] = 0; --so->count; } }
+void* so_get(SO* so, HANDLE h)
+{
+    if (!so_check_handle(so, h)) { error(ERROR_NOT_FOUND); return NULL; }
+    return so->data + (h - 1) * so->data_size;
+}
+HANDLE so_first(SO* so) { unsigned i; for (i = 0; i < so->cap; ++i) if (so->used[i]) return i + 1; return INVALID_HANDLE; }
+HANDLE so_next(SO* so, HANDLE h) { unsigned i; for (i = h; i < so->cap; ++i) if (so->used[i]) return i + 1; return INVALID_HANDLE; }
+unsigned int so_count(SO* so) { return so->count; }
+
+//------- array (simple)
+struct _ARRAY { unsigned size, data_size, cap; uint8_t* data; };
+ARRAY* array_create(ARRAY** ar, unsigned int data_size, unsigned int reserved)
+{
+    *ar = calloc(1, sizeof(ARRAY)); (*ar)->data_size = data_size; (*ar)->cap = 1024; (*ar)->data = calloc(1024, data_size); return *ar;
+}
+void array_destroy(ARRAY** ar) { if (*ar) { free((*ar)->data); free(*ar); } *ar = NULL; }
+void* array_at(ARRAY* ar, unsigned int index) { return ar->data + index * ar->data_size; }
+unsigned int array_size(ARRAY* ar) { return ar ? ar->size : 0; }
+void* array_append(ARRAY** ar) { return array_at(*ar, (*ar)->size++); }
+void* array_insert(ARRAY** ar, unsigned int index)
+{
+    memmove(array_at(*ar, index + 1), array_at(*ar, index), ((*ar)->size - index) * (*ar)->data_size); ++(*ar)->size; return array_at(*ar, index);
+}
+ARRAY* array_clear(ARRAY** ar) { (*ar)->size = 0; return *ar; }
+ARRAY* array_remove(ARRAY** ar, unsigned int index)
+{
+    memmove(array_at(*ar, index), array_at(*ar, index + 1), ((*ar)->size - index - 1) * (*ar)->data_size); --(*ar)->size; return *ar;
+}
+ARRAY* array_squeeze(ARRAY** ar) { return *ar; }
+
+//------- io
+//IO pointers are passed as 32-bit IPC params, keep them low
+static void* io_alloc(size_t size)
+{
+    size_t* p = mmap(NULL, size + 16, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    *p = size + 16;
+    return p + 2;
+}
+void io_free(void* ptr) { size_t* p = (size_t*)ptr - 2; munmap(p, *p); }
+IO* io_create(unsigned int size)
+{
+    IO* io = io_alloc(sizeof(IO) + size);
+    io->size = sizeof(IO) + size;
+    io_reset(io);
+    return io;
+}
+void io_destroy(IO* io) { io_free(io); }
+
+//------- time
+void get_uptime(SYSTIME* t) { t->sec = now_us / 1000000; t->usec = now_us % 1000000; }
+
+typedef struct { int used, active, node; unsigned param; HAL hal; uint64_t expire; } SIMTIMER;
+SIMTIMER timers[1024];
+int cur_node;
+
+HANDLE timer_create(unsigned int param, HAL hal)
+{
+    int i;
+    for (i = 0; i < 1024; ++i)
+        if (!timers[i].used)
+        {
+            timers[i].used = 1; timers[i].active = 0; timers[i].param = param; timers[i].hal = hal; timers[i].node = cur_node;
+            return i;
+        }
+    return INVALID_HANDLE;
+}
+void timer_start_ms(HANDLE t, unsigned int ms)
+{
+    if (timers[t].active) { ++double_start; error(ERROR_ALREADY_CONFIGURED); return; }
+    timers[t].active = 1; timers[t].expire = now_us + (uint64_t)ms * 1000;
+}
+void timer_start_us(HANDLE t, unsigned int us)
+{
+    if (timers[t].active) { ++double_start; error(ERROR_ALREADY_CONFIGURED); return; }
+    timers[t].active = 1; timers[t].expire = now_us + us;
+}
+void timer_stop(HANDLE t, unsigned int param, HAL hal) { timers[t].active = 0; }
+void timer_destroy(HANDLE t) { timers[t].used = 0; timers[t].active = 0; }
+
+//------- ip
+IO* ips_allocate_io(TCPIPS* tcpips, unsigned int size, uint8_t proto)
+{
+    IO* io = io_create(size + 64 + 32);
+    io->data_offset += 64;
+    ++frames_out;
+    return io;
+}
+void ips_release_io(TCPIPS* tcpips, IO* io) { --frames_out; io_free(io); }
+uint16_t tcp_checksum(void* buf, unsigned int size, const IP* src, const IP* dst) { return (uint16_t)~ip_sum(buf, size, ip_pseudo_sum(src, dst, PROTO_TCP, size)); }
+unsigned int get(HANDLE process, unsigned int cmd, unsigned int param1, unsigned int param2, unsigned int param3) { return 0; }
+HANDLE get_handle(HANDLE process, unsigned int cmd, unsigned int param1, unsigned int param2, unsigned int param3) { return 0; }
+void ack(HANDLE process, unsigned int cmd, unsigned int param1, unsigned int param2, unsigned int param3) {}
+unsigned int sim_pmtu = TCPIP_MTU, link_mtu = TCPIP_MTU, pmtu_drops;
+int pmtu_pending = -1, mtu_at;
+unsigned int ips_pmtu(TCPIPS* tcpips, const IP* dst) { return sim_pmtu; }
+void icmps_tx_error(TCPIPS* tcpips, IO* original, ICMP_ERROR err, unsigned int offset) {}
+
+typedef struct { IO* io; int dst; uint64_t at; } PKT;
+PKT link_q[100000]; int link_head, link_tail;
+int pkt_no;
+
+//data segments already sent, for merge_at
+typedef struct { int from; uint32_t seq; unsigned len; uint8_t flags; uint8_t* data; } SENT;
+SENT sent[1024]; int sent_count;
+int merge_at;
+
+static void sent_save(int from, IO* io)
+{
+    uint8_t* tcp = io_data(io);
+    unsigned hdr = (tcp[12] >> 4) << 2;
+    if (io->data_size == hdr || sent_count >= 1024)
+        return;
+    sent[sent_count].from = from;
+    sent[sent_count].seq = be2int(tcp + 4);
+    sent[sent_count].len = io->data_size - hdr;
+    sent[sent_count].flags = tcp[13] & 0x01;
+    sent[sent_count].data = malloc(io->data_size - hdr);
+    memcpy(sent[sent_count].data, tcp + hdr, io->data_size - hdr);
+    ++sent_count;
+}
+
+static IO* sent_merge(TCPIPS* tcpips, IO* io, const IP* dst)
+{
+    int i, from = tcpips == &nodes[0] ? 0 : 1;
+    IO* merged;
+    uint8_t* tcp = io_data(io);
+    uint32_t end = be2int(tcp + 4) + io->data_size - ((tcp[12] >> 4) << 2);
+    for (i = 0; i < sent_count; ++i)
+        if (sent[i].from == from && sent[i].seq == end)
+            break;
+    if (i == sent_count)
+        return io;
+    merged = ips_allocate_io(tcpips, io->data_size + sent[i].len, PROTO_TCP);
+    memcpy(io_data(merged), tcp, io->data_size);
+    memcpy((uint8_t*)io_data(merged) + io->data_size, sent[i].data, sent[i].len);
+    merged->data_size = io->data_size + sent[i].len;
+    ips_release_io(tcpips, io);
+    tcp = io_data(merged);
+    tcp[13] |= sent[i].flags;
+    short2be(tcp + 16, 0);
+    short2be(tcp + 16, tcp_checksum(tcp, merged->data_size, &tcpips->ips.ip, dst));
+    return merged;
+}
+
+void ips_tx(TCPIPS* tcpips, IO* io, const IP* dst)
+{
+    int to = tcpips == &nodes[0] ? 1 : 0;
+    int i;
+    uint64_t start;
+    uint8_t* tcp;
+    ++pkt_no;
+    if (merge_at)
+    {
+        if (pkt_no == merge_at)
+            io = sent_merge(tcpips, io, dst);
+        else
+            sent_save(1 - to, io);
+    }
+    tcp = io_data(io);
+    ++pkts_sent;
+    bytes_wire += io->data_size + 40;
+    if (io->data_size == ((tcp[12] >> 4) << 2) && !(tcp[13] & 0x3))
+        ++acks_sent;
+    for (i = 0; i < drop_count; ++i)
+        if (drop_list[i] == pkt_no) break;
+    int lost = i < drop_count || (loss && drand48() < loss);
+    //router with smaller mtu: drop, ICMP is processed later
+    if (pkt_no >= mtu_at && io->data_size + 20 > link_mtu)
+    {
+        lost = 1;
+        ++pmtu_drops;
+        pmtu_pending = tcpips == &nodes[0] ? 0 : 1;
+    }
+    start = link_free[to] > now_us ? link_free[to] : now_us;
+    link_free[to] = start + (uint64_t)(io->data_size + 40) * 8 * 1000000 / link_rate_bps;
+    if (verbose)
+        printf("%8.3f %d->%d hdr=%u seq=%u ack=%u flags=%02x len=%u%s\n", now_us / 1000.0, 1 - to, to, (tcp[12] >> 4) << 2,
+               be2int(tcp + 4), be2int(tcp + 8), tcp[13], io->data_size - ((tcp[12] >> 4) << 2),
+               lost ? " LOST" : "");
+    if (lost)
+    {
+        ++pkts_lost;
+        ips_release_io(tcpips, io);
+        return;
+    }
+    link_q[link_tail].io = io;
+    link_q[link_tail].dst = to;
+    link_q[link_tail].at = link_free[to] + link_delay_us;
+    ++link_tail;
+}
+
+//------- app
+typedef struct { HANDLE process; unsigned cmd; uintptr_t p1, p2, p3; int node; } EV;
+EV evq[100000]; int ev_head, ev_tail;
+
+void ipc_post_inline(HANDLE process, unsigned int cmd, uintptr_t param1, uintptr_t param2, uintptr_t param3)
+{
+    evq[ev_tail].process = process; evq[ev_tail].cmd = cmd; evq[ev_tail].p1 = param1; evq[ev_tail].p2 = param2; evq[ev_tail].p3 = param3;
+    ++ev_tail;
+}
+
+int request(int node, unsigned cmd, uintptr_t p1, uintptr_t p2, uintptr_t p3, uintptr_t* out2)
+{
+    IPC ipc;
+    ipc.process = 100 + node;
+    ipc.cmd = cmd;
+    ipc.param1 = p1; ipc.param2 = p2; ipc.param3 = p3;
+    last_error = 0;
+    cur_node = node;
+    tcps_request(&nodes[node], &ipc);
+    if (out2) *out2 = ipc.param2;
+    return last_error;
+}
+
+void timeout(int i)
+{
+    IPC ipc;
+    timers[i].active = 0;
+    ipc.process = 0;
+    ipc.cmd = HAL_CMD(timers[i].hal, IPC_TIMEOUT);
+    ipc.param1 = timers[i].param;
+    cur_node = timers[i].node;
+    if (timers[i].hal == HAL_TCP)
+        tcps_request(&nodes[timers[i].node], &ipc);
+}
+
+void deliver(PKT* p)
+{
+    IO* io = p->io;
+    IP src = nodes[1 - p->dst].ips.ip;
+    IP_STACK* st = io_push(io, sizeof(IP_STACK));
+    st->hdr_size = 20; st->proto = PROTO_TCP;
+    cur_node = p->dst;
+    tcps_rx(&nodes[p->dst], io, &src);
+}
+
+typedef void (*APP_HANDLER)(EV* ev);
+APP_HANDLER app;
+
+//returns false when nothing to do
+int step(uint64_t limit)
+{
+    uint64_t next = ~0ull;
+    int i, ti = -1;
+    if (pmtu_pending >= 0)
+    {
+        IP dst = nodes[1 - pmtu_pending].ips.ip;
+        cur_node = pmtu_pending;
+        pmtu_pending = -1;
+        sim_pmtu = link_mtu;
+        tcps_pmtu_changed(&nodes[cur_node], &dst);
+        return 1;
+    }
+    if (ev_head < ev_tail)
+    {
+        EV ev = evq[ev_head++];
+        app(&ev);
+        return 1;
+    }
+    if (link_head < link_tail && link_q[link_head].at < next)
+        next = link_q[link_head].at;
+    for (i = 0; i < 1024; ++i)
+        if (timers[i].used && timers[i].active && timers[i].expire < next)
+        {
+            next = timers[i].expire;
+            ti = i;
+        }
+    if (next == ~0ull || next > limit)
+        return 0;
+    if (next > now_us)
+        now_us = next;
+    if (link_head < link_tail && link_q[link_head].at == next)
+    {
+        PKT p = link_q[link_head++];
+        deliver(&p);
+        return 1;
+    }
+    timeout(ti);
+    return 1;
+}
+
+void sim_init()
+{
+    int i;
+    memset(nodes, 0, sizeof(nodes));
+    for (i = 0; i < 2; ++i)
+    {
+        cur_node = i;
+        nodes[i].connected = true;
+        nodes[i].node = i;
+        nodes[i].ips.ip.u8[0] = 10; nodes[i].ips.ip.u8[3] = i + 1;
+        nodes[i].tcps.dynamic = TCPIP_DYNAMIC_RANGE_LO;
+        tcps_init(&nodes[i]);
+    }
+}
@@ -0,0 +1,40 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: IO without kernel object. Completion is posted to sim.c event queue
+
+#ifndef IO_H
+#define IO_H
+
+#include "types.h"
+#include "ipc.h"
+
+typedef struct {
+    HANDLE kio;
+    unsigned int size, data_offset, data_size, stack_size;
+} IO;
+
+void* io_data(IO* io);
+void* io_stack(IO* io);
+void* io_push(IO* io, unsigned int size);
+void* io_pop(IO* io, unsigned int size);
+unsigned int io_get_free(IO* io);
+void io_reset(IO* io);
+void io_hide(IO* io, unsigned int size);
+void io_unhide(IO* io, unsigned int size);
+void io_show(IO* io);
+IO* io_create(unsigned int size);
+void io_destroy(IO* io);
+unsigned int io_data_append(IO* io, const void *data, unsigned int size);
+
+#define io_complete(process, cmd, handle, io)                           ipc_post_inline((process), (cmd), (handle), (uintptr_t)(io), (io)->data_size)
+#define io_complete_ex(process, cmd, handle, io, param3)                ipc_post_inline((process), (cmd), (handle), (uintptr_t)(io), (param3))
+#define io_read(process, cmd, handle, io, size)                         ipc_post_inline((process), (cmd), (handle), (uintptr_t)(io), (size))
+#define io_write(process, cmd, handle, io)                              ipc_post_inline((process), (cmd), (handle), (uintptr_t)(io), (io)->data_size)
+#define io_read_sync(process, cmd, handle, io, size)                    0
+#define io_write_sync(process, cmd, handle, io)                         0
+
+#endif // IO_H
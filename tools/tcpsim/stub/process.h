@@ -0,0 +1,19 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: only error reporting is used by stack
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include "types.h"
+#include "ipc.h"
+#include "error.h"
+
+void error(int code);
+int get_last_error();
+
+#endif // PROCESS_H
@@ -0,0 +1,31 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: SO is implemented in sim.c over plain heap
+
+#ifndef SO_H
+#define SO_H
+
+#include "types.h"
+#include <stdlib.h>
+
+typedef struct {
+    unsigned int data_size, count, cap;
+    uint8_t* data;
+    uint8_t* used;
+} SO;
+
+SO* so_create(SO* so, unsigned int data_size, unsigned int reserved);
+void so_destroy(SO* so);
+HANDLE so_allocate(SO* so);
+bool so_check_handle(SO* so, HANDLE handle);
+void so_free(SO* so, HANDLE handle);
+void* so_get(SO* so, HANDLE handle);
+HANDLE so_first(SO* so);
+HANDLE so_next(SO* so, HANDLE handle);
+unsigned int so_count(SO* so);
+
+#endif // SO_H
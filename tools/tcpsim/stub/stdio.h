@@ -0,0 +1,14 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: printf from libc
+
+#ifndef STDIO_H
+#define STDIO_H
+
+#include <stdio.h>
+
+#endif // STDIO_H
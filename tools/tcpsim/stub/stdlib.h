@@ -0,0 +1,17 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: malloc from libc, fixed seed
+
+#ifndef STDLIB_H
+#define STDLIB_H
+
+#include <stdlib.h>
+
+unsigned int rexos_srand(void);
+#define srand()                                                         rexos_srand()
+
+#endif // STDLIB_H
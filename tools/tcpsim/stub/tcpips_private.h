@@ -0,0 +1,28 @@
+/*
+    RExOS - embedded RTOS
+    Copyright (c) 2011-2018, Alexey Kramarenko
+    All rights reserved.
+*/
+
+//host stub: TCP/IP stack with only IP and TCP modules. Node index is used by sim.c
+
+#ifndef TCPIPS_PRIVATE_H
+#define TCPIPS_PRIVATE_H
+
+#include "../../userspace/array.h"
+#include "../../userspace/ip.h"
+#include "ips.h"
+#include "icmps.h"
+#include "tcps.h"
+#include "sys_config.h"
+
+typedef struct _TCPIPS {
+    HANDLE timer, app;
+    unsigned int seconds;
+    bool connected;
+    IPS ips;
+    TCPS tcps;
+    int node;
+} TCPIPS;
+
+#endif // TCPIPS_PRIVATE_H
@@ -19,6 +19,7 @@ CANVAS* canvas_create(unsigned short width, unsigned short height, unsigned shor
     canvas->height = height;
     canvas->bits_per_pixel = bits_per_pixel;
     canvas->data = ((void*)canvas) + sizeof(CANVAS);
+    canvas->dirty_count = 0;
     return canvas;
 }
 
@@ -34,6 +35,7 @@ IO* canvas_create_io(unsigned short width, unsigned short height, unsigned short
     canvas->height = height;
     canvas->bits_per_pixel = bits_per_pixel;
     canvas->data = io_data(io) + sizeof(CANVAS);
+    canvas->dirty_count = 0;
     return io;
 }
 
@@ -48,12 +50,14 @@ bool canvas_resize(CANVAS* canvas, unsigned short width, unsigned short height,
     canvas->width = width;
     canvas->height = height;
     canvas->bits_per_pixel = bits_per_pixel;
+    canvas_invalidate_all(canvas);
     return true;
 }
 
 void canvas_clear(CANVAS* canvas)
 {
     memset(canvas->data, 0, canvas->size);
+    canvas_invalidate_all(canvas);
 }
 
 void canvas_destroy(CANVAS* canvas)
@@ -65,3 +69,93 @@ void canvas_destroy_io(IO* io)
 {
     io_destroy(io);
 }
+
+static void canvas_union(RECT* dst, const RECT* a, const RECT* b)
+{
+    unsigned short right, bottom;
+    right = a->left + a->width;
+    if (b->left + b->width > right)
+        right = b->left + b->width;
+    bottom = a->top + a->height;
+    if (b->top + b->height > bottom)
+        bottom = b->top + b->height;
+    dst->left = a->left < b->left ? a->left : b->left;
+    dst->top = a->top < b->top ? a->top : b->top;
+    dst->width = right - dst->left;
+    dst->height = bottom - dst->top;
+}
+
+static inline int canvas_area(const RECT* rect)
+{
+    return rect->width * rect->height;
+}
+
+static inline bool canvas_touch(const RECT* a, const RECT* b)
+{
+    return a->left <= b->left + b->width && b->left <= a->left + a->width &&
+           a->top <= b->top + b->height && b->top <= a->top + a->height;
+}
+
+void canvas_invalidate(CANVAS* canvas, const RECT* rect)
+{
+    RECT cur, merged;
+    unsigned int i, best;
+    int growth, best_growth;
+    bool touch;
+    if (rect->left >= canvas->width || rect->top >= canvas->height || rect->width == 0 || rect->height == 0)
+        return;
+    cur.left = rect->left;
+    cur.top = rect->top;
+    cur.width = rect->width;
+    if (cur.left + cur.width > canvas->width)
+        cur.width = canvas->width - cur.left;
+    cur.height = rect->height;
+    if (cur.top + cur.height > canvas->height)
+        cur.height = canvas->height - cur.top;
+    for (;;)
+    {
+        //find region, which is cheapest to merge with
+        best = canvas->dirty_count;
+        best_growth = 0;
+        touch = false;
+        for (i = 0; i < canvas->dirty_count; ++i)
+        {
+            //overlapped or adjacent regions are always merged
+            if (canvas_touch(&canvas->dirty[i], &cur))
+            {
+                best = i;
+                touch = true;
+                break;
+            }
+            canvas_union(&merged, &canvas->dirty[i], &cur);
+            growth = canvas_area(&merged) - canvas_area(&canvas->dirty[i]) - canvas_area(&cur);
+            if (best == canvas->dirty_count || growth < best_growth)
+            {
+                best = i;
+                best_growth = growth;
+            }
+        }
+        //others only if list is full
+        if (best == canvas->dirty_count || (!touch && canvas->dirty_count < CANVAS_DIRTY_RECTS_MAX))
+        {
+            canvas->dirty[canvas->dirty_count++] = cur;
+            return;
+        }
+        canvas_union(&cur, &canvas->dirty[best], &cur);
+        //merged region can now overlap others
+        canvas->dirty[best] = canvas->dirty[--canvas->dirty_count];
+    }
+}
+
+void canvas_invalidate_all(CANVAS* canvas)
+{
+    canvas->dirty[0].left = canvas->dirty[0].top = 0;
+    canvas->dirty[0].width = canvas->width;
+    canvas->dirty[0].height = canvas->height;
+    canvas->dirty_count = 1;
+}
+
+void canvas_validate(CANVAS* canvas)
+{
+    canvas->dirty_count = 0;
+}
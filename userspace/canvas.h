@@ -8,13 +8,25 @@
 #define CANVAS_H
 
 #include "io.h"
+#include "sys_config.h"
 #include <stdint.h>
 
+typedef struct {
+    unsigned short x, y;
+} POINT;
+
+typedef struct {
+    unsigned short left, top, width, height;
+} RECT;
+
 typedef struct {
     unsigned int size;
     void* data;
     unsigned short width, height;
     unsigned short bits_per_pixel;
+    //modified regions since last flush, coalesced
+    unsigned short dirty_count;
+    RECT dirty[CANVAS_DIRTY_RECTS_MAX];
 } CANVAS;
 
 CANVAS* canvas_create(unsigned short width, unsigned short height, unsigned short bits_per_pixel);
@@ -23,5 +35,8 @@ bool canvas_resize(CANVAS* canvas, unsigned short width, unsigned short height,
 void canvas_clear(CANVAS* canvas);
 void canvas_destroy(CANVAS* canvas);
 void canvas_destroy_io(IO* io);
+void canvas_invalidate(CANVAS* canvas, const RECT* rect);
+void canvas_invalidate_all(CANVAS* canvas);
+void canvas_validate(CANVAS* canvas);
 
 #endif // CANVAS_H
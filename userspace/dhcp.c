@@ -10,3 +10,13 @@ void dhcp_set_pool(HANDLE tcpip, const IP* ip_first, const IP* mask)
 {
     ack(tcpip, HAL_REQ(HAL_DHCPS, IPC_WRITE), tcpip, ip_first->u32.ip, mask->u32.ip);
 }
+
+int dhcp_get_leases(HANDLE tcpip, IO* io)
+{
+    return io_read_sync(tcpip, HAL_IO_REQ(HAL_DHCPS, DHCPS_GET_LEASES), tcpip, io, io_get_free(io));
+}
+
+int dhcp_set_leases(HANDLE tcpip, IO* io)
+{
+    return io_write_sync(tcpip, HAL_IO_REQ(HAL_DHCPS, DHCPS_SET_LEASES), tcpip, io);
+}
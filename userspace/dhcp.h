@@ -8,8 +8,33 @@
 #define DHCP_H
 
 #include "ip.h"
+#include "mac.h"
+#include "io.h"
+#include "ipc.h"
 #include <stdint.h>
 
+typedef enum {
+    DHCPS_GET_LEASES = IPC_USER,
+    DHCPS_SET_LEASES,
+    //to application on lease bind, release, decline or expire. param1 - IP, param2 - seconds left, 0 if not bound anymore
+    DHCPS_LEASE_CHANGED
+} DHCPS_IPCS;
+
+#pragma pack(push, 1)
+
+typedef struct {
+    IP ip;
+    MAC mac;
+    //seconds
+    uint32_t remaining;
+} DHCP_LEASE_RECORD;
+
+#pragma pack(pop)
+
 void dhcp_set_pool(HANDLE tcpip, const IP* ip_first, const IP* mask);
+//bound leases as DHCP_LEASE_RECORD array, for persistent storage. Returns size or error
+int dhcp_get_leases(HANDLE tcpip, IO* io);
+//restore saved leases. Call after dhcp_set_pool()
+int dhcp_set_leases(HANDLE tcpip, IO* io);
 
 #endif // DHCP_H
@@ -473,17 +473,17 @@ static void mt_write_rect_cs(unsigned int cs, RECT* rect, const uint8_t* data, u
     }
 }
 
-void mt_write_rect(const RECT* rect, const uint8_t* data)
+//bpl - bits per line of data stream, offset - stream bit offset of rect origin
+static void mt_write_region(const RECT* rect, const uint8_t* data, unsigned int bpl, unsigned int offset)
 {
     RECT csrect;
-    //bits per line
-    unsigned int offset;
+    unsigned int cs2_offset;
     if (rect->left >= MT_SIZE_X || rect->top >= MT_SIZE_Y)
     {
         error(ERROR_INVALID_PARAMS);
         return;
     }
-    offset = 0;
+    cs2_offset = offset;
     csrect.width = rect->width;
     if (rect->left + rect->height > MT_SIZE_X)
         csrect.width = MT_SIZE_X - rect->left;
@@ -497,8 +497,8 @@ void mt_write_rect(const RECT* rect, const uint8_t* data)
         csrect.height = rect->height;
         if (csrect.top + rect->height > MT_SIZE_X)
             csrect.height = MT_SIZE_X - rect->top;
-        offset = rect->width * csrect.height;
-        mt_write_rect_cs(MT_CS1, &csrect, data, rect->width, 0);
+        cs2_offset = offset + bpl * csrect.height;
+        mt_write_rect_cs(MT_CS1, &csrect, data, bpl, offset);
     }
     //apply for CS2
     if (rect->top + rect->height > MT_SIZE_X)
@@ -515,10 +515,15 @@ void mt_write_rect(const RECT* rect, const uint8_t* data)
         }
         if (csrect.top + rect->height > MT_SIZE_X)
             csrect.height = MT_SIZE_X - rect->top;
-        mt_write_rect_cs(MT_CS2, &csrect, data, rect->width, offset);
+        mt_write_rect_cs(MT_CS2, &csrect, data, bpl, cs2_offset);
     }
 }
 
+void mt_write_rect(const RECT* rect, const uint8_t* data)
+{
+    mt_write_region(rect, data, rect->width, 0);
+}
+
 void mt_read_canvas(CANVAS* canvas, const POINT* point)
 {
     RECT rect;
@@ -537,6 +542,29 @@ void mt_write_canvas(CANVAS* canvas, const POINT* point)
     rect.width = canvas->width;
     rect.height = canvas->height;
     mt_write_rect(&rect, canvas->data);
+    canvas_validate(canvas);
+}
+
+void mt_flush_canvas(CANVAS* canvas, const POINT* point)
+{
+    RECT rect;
+    unsigned int i, left, right;
+    for (i = 0; i < canvas->dirty_count; ++i)
+    {
+        //page is written as whole byte, extend region to page bounds, but not out of canvas
+        left = (point->x + canvas->dirty[i].left) & ~7;
+        if (left < point->x)
+            left = point->x;
+        right = (point->x + canvas->dirty[i].left + canvas->dirty[i].width + 7) & ~7;
+        if (right > point->x + canvas->width)
+            right = point->x + canvas->width;
+        rect.left = left;
+        rect.top = point->y + canvas->dirty[i].top;
+        rect.width = right - left;
+        rect.height = canvas->dirty[i].height;
+        mt_write_region(&rect, canvas->data, canvas->width, canvas->dirty[i].top * canvas->width + left - point->x);
+    }
+    canvas_validate(canvas);
 }
 
 void mt_enable()
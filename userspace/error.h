@@ -70,6 +70,7 @@
 #define ERROR_NAK                                       (ERROR_COMM - 9)
 #define ERROR_TIMEOUT                                   (ERROR_COMM - 10)
 #define ERROR_CHAR_LOSS                                 (ERROR_COMM - 11)
+#define ERROR_CONNECTION_TIMEOUT                        (ERROR_COMM - 12)
 
 #define ERROR_HARDWARE                                  -400
 
@@ -8,10 +8,18 @@
 #include "utf.h"
 #include "error.h"
 #include "process.h"
-#include "font.h"
+#include "stdlib.h"
+#include <string.h>
 
 #define FACE_OFFSET(face, num)              (*((uint16_t*)((unsigned int)(face) + sizeof(FACE) + ((num) << 1))))
 #define FACE_DATA(face)                     ((uint8_t*)((unsigned int)(face) + sizeof(FACE) + (((face)->count  + 1) << 1)))
+#define FONT_FACE(font)                     ((FACE*)((unsigned int)(font) + sizeof(FONT)))
+#define NEXT_FACE(face)                     ((FACE*)((unsigned int)(face) + (face)->total_size))
+
+#define FONT_CACHE_GLYPH(cache, slot)       ((GLYPH*)((unsigned int)(cache) + sizeof(FONT_CACHE) + (slot) * (sizeof(GLYPH) + (cache)->glyph_size)))
+#define FONT_CACHE_SLOT(cache, glyph)       (((unsigned int)(glyph) - (unsigned int)(cache) - sizeof(FONT_CACHE)) / (sizeof(GLYPH) + (cache)->glyph_size))
+#define GLYPH_DATA(glyph)                   ((uint8_t*)((unsigned int)(glyph) + sizeof(GLYPH)))
+#define FONT_CACHE_HASH(utf32)              ((utf32) & (FONT_CACHE_HASH_SIZE - 1))
 
 unsigned short font_get_glyph_width(FACE* face, unsigned short num)
 {
@@ -43,79 +51,42 @@ void font_render_glyph(CANVAS* canvas, const POINT* point, FACE* face, unsigned
     image(canvas, &rect, &data_rect, FACE_DATA(face), GUI_MODE_FILL);
 }
 
-unsigned short font_get_char_width(const FONT* font, const char* utf8)
+static unsigned short font_find_glyph(const FONT* font, uint32_t utf32, FACE** face)
 {
     int i;
-    FACE* face;
-    //convert to utf32
-    uint32_t utf32 = utf8_to_utf32(utf8);
+    FACE* cur;
     //find face in font
-    face = (FACE*)((unsigned int)font + sizeof(FONT));
+    cur = FONT_FACE(font);
     for (i = 0; i < font->face_count; ++i)
     {
-        if (face->char_offset <= utf32 && face->char_offset + face->count > utf32)
-            return font_get_glyph_width(face, utf32 - face->char_offset);
-        face = (FACE*)((unsigned int)face + face->total_size);
-    }
-    //render nil symbol
-    face = (FACE*)((unsigned int)font + sizeof(FONT));
-    return font_get_glyph_width(face, 0);
-}
-
-void font_render_char(CANVAS* canvas, const POINT *point, const FONT* font, const char* utf8)
-{
-    int i;
-    FACE* face;
-    //convert to utf32
-    uint32_t utf32 = utf8_to_utf32(utf8);
-    //find face in font
-    face = (FACE*)((unsigned int)font + sizeof(FONT));
-    for (i = 0; i < font->face_count; ++i)
-    {
-        if (face->char_offset <= utf32 && face->char_offset + face->count > utf32)
+        if (cur->char_offset <= utf32 && cur->char_offset + cur->count > utf32)
         {
-            font_render_glyph(canvas, point, face, font->height, utf32 - face->char_offset);
-            return;
+            *face = cur;
+            return utf32 - cur->char_offset;
         }
-        face = (FACE*)((unsigned int)face + face->total_size);
+        cur = NEXT_FACE(cur);
     }
-    //render nil symbol
-    face = (FACE*)((unsigned int)font + sizeof(FONT));
-    font_render_glyph(canvas, point, face, font->height, 0);
+    //nil symbol
+    *face = FONT_FACE(font);
+    return 0;
 }
 
-unsigned short font_get_text_width(const FONT* font, const char* utf8)
+//ASCII is decoded without UTF conversion
+static uint32_t font_next_char(const char** utf8)
 {
-    unsigned int cur = 0;
-    unsigned short len = 0;
-    while (utf8[cur])
+    uint32_t utf32 = (uint8_t)(**utf8);
+    if (utf32 < 0x80)
     {
-        len += font_get_char_width(font, utf8 + cur);
-        cur += utf8_char_len(utf8 + cur);
+        ++(*utf8);
+        return utf32;
     }
-    return len;
+    utf32 = utf8_to_utf32(*utf8);
+    *utf8 += utf8_char_len(*utf8);
+    return utf32;
 }
 
-void font_render_text(CANVAS* canvas, const POINT* point, const FONT* font, const char* utf8)
+static void font_align(const RECT* rect, unsigned short width, unsigned short height, unsigned int align, POINT* point)
 {
-    unsigned int cur = 0;
-    POINT cur_point;
-    cur_point.x = point->x;
-    cur_point.y = point->y;
-    while (utf8[cur])
-    {
-        font_render_char(canvas, &cur_point, font, utf8 + cur);
-        cur_point.x += font_get_char_width(font, utf8 + cur);
-        cur += utf8_char_len(utf8 + cur);
-    }
-}
-
-void font_render(CANVAS* canvas, const RECT *rect, const FONT* font, const char* utf8, unsigned int align)
-{
-    unsigned short width, height;
-    POINT point;
-    width = font_get_text_width(font, utf8);
-    height = font->height;
     if (width > rect->width)
         width = rect->width;
     if (height > rect->height)
@@ -123,24 +94,293 @@ void font_render(CANVAS* canvas, const RECT *rect, const FONT* font, const char*
     switch (align & FONT_ALIGN_HMASK)
     {
     case FONT_ALIGN_RIGHT:
-        point.x = rect->left + rect->width - width;
+        point->x = rect->left + rect->width - width;
         break;
     case FONT_ALIGN_HCENTER:
-        point.x = ((rect->width - width) >> 1) + rect->left;
+        point->x = ((rect->width - width) >> 1) + rect->left;
         break;
     default:
-        point.x = rect->left;
+        point->x = rect->left;
     }
     switch (align & FONT_ALIGN_VMASK)
     {
     case FONT_ALIGN_BOTTOM:
-        point.y = rect->top + rect->height - height;
+        point->y = rect->top + rect->height - height;
         break;
     case FONT_ALIGN_VCENTER:
-        point.y = ((rect->height - height) >> 1) + rect->top;
+        point->y = ((rect->height - height) >> 1) + rect->top;
         break;
     default:
-        point.y = rect->top;
+        point->y = rect->top;
     }
+}
+
+unsigned short font_get_char_width(const FONT* font, const char* utf8)
+{
+    FACE* face;
+    unsigned short num = font_find_glyph(font, utf8_to_utf32(utf8), &face);
+    return font_get_glyph_width(face, num);
+}
+
+void font_render_char(CANVAS* canvas, const POINT *point, const FONT* font, const char* utf8)
+{
+    FACE* face;
+    unsigned short num = font_find_glyph(font, utf8_to_utf32(utf8), &face);
+    font_render_glyph(canvas, point, face, font->height, num);
+}
+
+unsigned short font_get_text_width(const FONT* font, const char* utf8)
+{
+    FACE* face;
+    unsigned short num;
+    unsigned short len = 0;
+    while (*utf8)
+    {
+        num = font_find_glyph(font, font_next_char(&utf8), &face);
+        len += font_get_glyph_width(face, num);
+    }
+    return len;
+}
+
+void font_render_text(CANVAS* canvas, const POINT* point, const FONT* font, const char* utf8)
+{
+    FACE* face;
+    unsigned short num;
+    POINT cur_point;
+    cur_point.x = point->x;
+    cur_point.y = point->y;
+    while (*utf8)
+    {
+        num = font_find_glyph(font, font_next_char(&utf8), &face);
+        font_render_glyph(canvas, &cur_point, face, font->height, num);
+        cur_point.x += font_get_glyph_width(face, num);
+    }
+}
+
+void font_render(CANVAS* canvas, const RECT *rect, const FONT* font, const char* utf8, unsigned int align)
+{
+    POINT point;
+    font_align(rect, font_get_text_width(font, utf8), font->height, align, &point);
     font_render_text(canvas, &point, font, utf8);
 }
+
+FONT_CACHE* font_cache_create(const FONT* font, unsigned short bits_per_pixel, unsigned short count)
+{
+    FONT_CACHE* cache;
+    FACE* face;
+    unsigned int i, num, width, max_width;
+    if (count == 0 || count > 0xff)
+    {
+        error(ERROR_INVALID_PARAMS);
+        return NULL;
+    }
+    //slot must fit widest glyph
+    max_width = 0;
+    face = FONT_FACE(font);
+    for (i = 0; i < font->face_count; ++i)
+    {
+        for (num = 0; num < face->count; ++num)
+        {
+            width = FACE_OFFSET(face, num + 1) - FACE_OFFSET(face, num);
+            if (width > max_width)
+                max_width = width;
+        }
+        face = NEXT_FACE(face);
+    }
+    width = ((((max_width * font->height * bits_per_pixel + 7) >> 3) + 1) + 3) & ~3;
+    cache = malloc(sizeof(FONT_CACHE) + count * (sizeof(GLYPH) + width));
+    if (cache == NULL)
+        return NULL;
+    cache->font = font;
+    dlist_clear(&cache->lru);
+    cache->bits_per_pixel = bits_per_pixel;
+    cache->count = count;
+    cache->used = 0;
+    cache->glyph_size = width;
+    memset(cache->ascii, 0, FONT_CACHE_ASCII_SIZE);
+    memset(cache->hash, 0, FONT_CACHE_HASH_SIZE);
+    return cache;
+}
+
+void font_cache_destroy(FONT_CACHE* cache)
+{
+    free(cache);
+}
+
+static void font_cache_expand(FONT_CACHE* cache, GLYPH* glyph, uint32_t utf32)
+{
+    CANVAS canvas;
+    RECT rect, data_rect;
+    POINT point;
+    FACE* face;
+    const uint8_t* pix;
+    unsigned int pos;
+    unsigned short num, run;
+    num = font_find_glyph(cache->font, utf32, &face);
+    glyph->code = utf32;
+    glyph->width = font_get_glyph_width(face, num);
+    if (glyph->width == 0)
+        return;
+    //slot is used as canvas of glyph size
+    canvas.size = cache->glyph_size;
+    canvas.data = GLYPH_DATA(glyph);
+    canvas.width = glyph->width;
+    canvas.height = cache->font->height;
+    canvas.bits_per_pixel = cache->bits_per_pixel;
+    canvas.dirty_count = 0;
+    if (cache->bits_per_pixel == 1)
+    {
+        rect.left = rect.top = 0;
+        rect.width = glyph->width;
+        rect.height = cache->font->height;
+        data_rect.left = FACE_OFFSET(face, num);
+        data_rect.top = 0;
+        data_rect.width = face->width;
+        data_rect.height = cache->font->height;
+        image(&canvas, &rect, &data_rect, FACE_DATA(face), GUI_MODE_FILL);
+        return;
+    }
+    //expand set pixels to all ones by spans
+    canvas_clear(&canvas);
+    pix = FACE_DATA(face) + 1;
+    for (point.y = 0; point.y < canvas.height; ++point.y)
+    {
+        for (point.x = 0; point.x < canvas.width; point.x += run)
+        {
+            pos = point.y * face->width + FACE_OFFSET(face, num) + point.x;
+            for (run = 0; point.x + run < canvas.width && (pix[(pos + run) >> 3] & (0x80 >> ((pos + run) & 7))); ++run) {}
+            if (run)
+                fill_span(&canvas, &point, run, 0xffffffff, GUI_MODE_FILL);
+            else
+                run = 1;
+        }
+    }
+}
+
+static GLYPH* font_cache_find(FONT_CACHE* cache, uint32_t utf32)
+{
+    GLYPH* glyph;
+    unsigned int slot;
+    if (utf32 < FONT_CACHE_ASCII_SIZE)
+        return cache->ascii[utf32] ? FONT_CACHE_GLYPH(cache, cache->ascii[utf32] - 1) : NULL;
+    for (slot = cache->hash[FONT_CACHE_HASH(utf32)]; slot; slot = glyph->hash_next)
+    {
+        glyph = FONT_CACHE_GLYPH(cache, slot - 1);
+        if (glyph->code == utf32)
+            return glyph;
+    }
+    return NULL;
+}
+
+static void font_cache_unlink(FONT_CACHE* cache, GLYPH* glyph, unsigned int slot)
+{
+    uint8_t* cur;
+    if (glyph->code < FONT_CACHE_ASCII_SIZE)
+    {
+        cache->ascii[glyph->code] = 0;
+        return;
+    }
+    for (cur = &cache->hash[FONT_CACHE_HASH(glyph->code)]; *cur; cur = &FONT_CACHE_GLYPH(cache, *cur - 1)->hash_next)
+    {
+        if (*cur == slot + 1)
+        {
+            *cur = glyph->hash_next;
+            break;
+        }
+    }
+}
+
+static GLYPH* font_cache_glyph(FONT_CACHE* cache, uint32_t utf32)
+{
+    GLYPH* glyph;
+    unsigned int slot;
+    glyph = font_cache_find(cache, utf32);
+    if (glyph != NULL)
+    {
+        //most recently used goes first
+        if (cache->lru != (DLIST*)glyph)
+        {
+            dlist_remove(&cache->lru, (DLIST*)glyph);
+            dlist_add_head(&cache->lru, (DLIST*)glyph);
+        }
+        return glyph;
+    }
+    if (cache->used < cache->count)
+    {
+        slot = cache->used++;
+        glyph = FONT_CACHE_GLYPH(cache, slot);
+    }
+    else
+    {
+        //evict least recently used
+        glyph = (GLYPH*)(cache->lru->prev);
+        dlist_remove_tail(&cache->lru);
+        slot = FONT_CACHE_SLOT(cache, glyph);
+        font_cache_unlink(cache, glyph, slot);
+    }
+    font_cache_expand(cache, glyph, utf32);
+    dlist_add_head(&cache->lru, (DLIST*)glyph);
+    if (utf32 < FONT_CACHE_ASCII_SIZE)
+        cache->ascii[utf32] = slot + 1;
+    else
+    {
+        glyph->hash_next = cache->hash[FONT_CACHE_HASH(utf32)];
+        cache->hash[FONT_CACHE_HASH(utf32)] = slot + 1;
+    }
+    return glyph;
+}
+
+unsigned short font_cache_get_text_width(FONT_CACHE* cache, const char* utf8)
+{
+    FACE* face;
+    uint32_t utf32;
+    GLYPH* glyph;
+    unsigned short num;
+    unsigned short len = 0;
+    //measure only, cache is not populated
+    while (*utf8)
+    {
+        utf32 = font_next_char(&utf8);
+        if ((glyph = font_cache_find(cache, utf32)) != NULL)
+            len += glyph->width;
+        else
+        {
+            num = font_find_glyph(cache->font, utf32, &face);
+            len += font_get_glyph_width(face, num);
+        }
+    }
+    return len;
+}
+
+void font_cache_render_text(CANVAS* canvas, const POINT* point, FONT_CACHE* cache, const char* utf8)
+{
+    GLYPH* glyph;
+    RECT rect, data_rect;
+    if (canvas->bits_per_pixel != cache->bits_per_pixel)
+    {
+        error(ERROR_INVALID_PARAMS);
+        return;
+    }
+    rect.left = point->x;
+    rect.top = point->y;
+    rect.height = cache->font->height;
+    data_rect.left = data_rect.top = 0;
+    data_rect.height = cache->font->height;
+    while (*utf8)
+    {
+        glyph = font_cache_glyph(cache, font_next_char(&utf8));
+        if (glyph->width)
+        {
+            rect.width = data_rect.width = glyph->width;
+            image(canvas, &rect, &data_rect, GLYPH_DATA(glyph), GUI_MODE_FILL);
+        }
+        rect.left += glyph->width;
+    }
+}
+
+void font_cache_render(CANVAS* canvas, const RECT* rect, FONT_CACHE* cache, const char* utf8, unsigned int align)
+{
+    POINT point;
+    font_align(rect, font_cache_get_text_width(cache, utf8), cache->font->height, align, &point);
+    font_cache_render_text(canvas, &point, cache, utf8);
+}
@@ -9,6 +9,7 @@
 
 #include "canvas.h"
 #include "graphics.h"
+#include "dlist.h"
 
 #define FONT_ALIGN_LEFT                 (0 << 0)
 #define FONT_ALIGN_RIGHT                (1 << 0)
@@ -33,6 +34,30 @@ typedef struct {
     //face 0, than other faces
 } FONT;
 
+#define FONT_CACHE_ASCII_SIZE           128
+//non-ASCII glyphs lookup. Power of 2
+#define FONT_CACHE_HASH_SIZE            32
+
+typedef struct {
+    DLIST list;
+    uint32_t code;
+    unsigned short width;
+    //slot + 1 of next non-ASCII glyph with same hash
+    uint8_t hash_next;
+    //glyph image in canvas bpp, first byte reserved
+} GLYPH;
+
+typedef struct {
+    const FONT* font;
+    DLIST* lru;
+    unsigned short bits_per_pixel, count, used, glyph_size;
+    //slot + 1 for cached ASCII glyphs
+    uint8_t ascii[FONT_CACHE_ASCII_SIZE];
+    //slot + 1 of first cached non-ASCII glyph by code hash
+    uint8_t hash[FONT_CACHE_HASH_SIZE];
+    //glyphs
+} FONT_CACHE;
+
 unsigned short font_get_glyph_width(FACE* face, unsigned short num);
 void font_render_glyph(CANVAS* canvas, const POINT* point, FACE* face, unsigned short height, unsigned short num);
 unsigned short font_get_char_width(const FONT *font, const char* utf8);
@@ -41,4 +66,11 @@ unsigned short font_get_text_width(const FONT *font, const char* utf8);
 void font_render_text(CANVAS* canvas, const POINT *point, const FONT *font, const char* utf8);
 void font_render(CANVAS* canvas, const RECT* rect, const FONT *font, const char* utf8, unsigned int align);
 
+//glyph cache. Font is 1 bpp, glyphs are expanded to canvas bpp on first use. Up to 255 glyphs.
+FONT_CACHE* font_cache_create(const FONT* font, unsigned short bits_per_pixel, unsigned short count);
+void font_cache_destroy(FONT_CACHE* cache);
+unsigned short font_cache_get_text_width(FONT_CACHE* cache, const char* utf8);
+void font_cache_render_text(CANVAS* canvas, const POINT* point, FONT_CACHE* cache, const char* utf8);
+void font_cache_render(CANVAS* canvas, const RECT* rect, FONT_CACHE* cache, const char* utf8, unsigned int align);
+
 #endif // FONT_H
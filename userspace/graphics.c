@@ -7,6 +7,14 @@
 #include "graphics.h"
 #include "process.h"
 #include "error.h"
+#include "endian.h"
+
+//first byte of canvas/image data is reserved, pixel stream starts right after it
+#define GRAPHICS_PIX(data)                  (((uint8_t*)(data)) + 1)
+//span engine works with patterns, repeating in 32 bit word
+#define GRAPHICS_SPAN_BPP(bpp)              ((32 % (bpp)) == 0)
+//pattern byte for stream byte position
+#define GRAPHICS_PATTERN_BYTE(pattern, pos) ((uint8_t)((pattern) >> ((3 - ((pos) & 3)) << 3)))
 
 static void graphics_write(uint8_t* pix, unsigned short pix_width, unsigned short bpp, const POINT* point, unsigned int data, unsigned int data_width)
 {
@@ -53,20 +61,272 @@ static void graphics_canvas_write(CANVAS* canvas, unsigned int mode, POINT* poin
     case GUI_MODE_AND:
         data &= graphics_read(canvas->data, canvas->width, canvas->bits_per_pixel, point, data_width);
         break;
+    case GUI_MODE_INVERT:
+        data = ~graphics_read(canvas->data, canvas->width, canvas->bits_per_pixel, point, data_width);
+        break;
     default:
         break;
     }
     graphics_write(canvas->data, canvas->width, canvas->bits_per_pixel, point, data, data_width);
 }
 
-void put_pixel(CANVAS* canvas, const POINT *point, unsigned int color)
+static uint32_t graphics_pattern(unsigned int color, unsigned short bpp)
+{
+    uint32_t mask;
+    if (bpp >= 32)
+        return color;
+    mask = (1 << bpp) - 1;
+    //replicate color over whole word: 0xffffffff / 0xff = 0x01010101, etc
+    return (color & mask) * (0xffffffff / mask);
+}
+
+static inline uint32_t graphics_rotl(uint32_t value, unsigned int bits)
+{
+    return bits ? (value << bits) | (value >> (32 - bits)) : value;
+}
+
+static inline void graphics_rop8(uint8_t* dst, uint8_t src, uint8_t mask, unsigned int mode)
+{
+    switch (mode)
+    {
+    case GUI_MODE_OR:
+        *dst |= src & mask;
+        break;
+    case GUI_MODE_XOR:
+        *dst ^= src & mask;
+        break;
+    case GUI_MODE_AND:
+        *dst &= src | ~mask;
+        break;
+    case GUI_MODE_INVERT:
+        *dst ^= mask;
+        break;
+    default:
+        *dst = (*dst & ~mask) | (src & mask);
+        break;
+    }
+}
+
+static inline void graphics_rop32(uint32_t* dst, uint32_t src, unsigned int mode)
+{
+    switch (mode)
+    {
+    case GUI_MODE_OR:
+        *dst |= src;
+        break;
+    case GUI_MODE_XOR:
+        *dst ^= src;
+        break;
+    case GUI_MODE_AND:
+        *dst &= src;
+        break;
+    case GUI_MODE_INVERT:
+        *dst = ~(*dst);
+        break;
+    default:
+        *dst = src;
+        break;
+    }
+}
+
+static void graphics_fill_words(uint32_t* dst, uint32_t src, unsigned int count, unsigned int mode)
+{
+    //mode is checked once per span, not per word
+    switch (mode)
+    {
+    case GUI_MODE_OR:
+        for (; count; --count)
+            *dst++ |= src;
+        break;
+    case GUI_MODE_XOR:
+        for (; count; --count)
+            *dst++ ^= src;
+        break;
+    case GUI_MODE_AND:
+        for (; count; --count)
+            *dst++ &= src;
+        break;
+    case GUI_MODE_INVERT:
+        for (; count; --count, ++dst)
+            *dst = ~(*dst);
+        break;
+    default:
+        for (; count; --count)
+            *dst++ = src;
+        break;
+    }
+}
+
+//fill len bits of pixel stream at bit position pos with pattern
+static void graphics_fill(uint8_t* pix, unsigned int pos, unsigned int len, uint32_t pattern, unsigned int mode)
+{
+    unsigned int byte_pos, bit_pos, cur;
+    uint32_t word;
+    uint8_t* dst;
+    byte_pos = pos >> 3;
+    bit_pos = pos & 7;
+    dst = pix + byte_pos;
+    //head
+    if (bit_pos)
+    {
+        cur = 8 - bit_pos;
+        if (cur > len)
+            cur = len;
+        graphics_rop8(dst++, GRAPHICS_PATTERN_BYTE(pattern, byte_pos), (0xff >> bit_pos) & ~(0xff >> (bit_pos + cur)), mode);
+        ++byte_pos;
+        len -= cur;
+    }
+    //align to word
+    for (; len >= 8 && ((unsigned int)dst & 3); len -= 8, ++byte_pos)
+        graphics_rop8(dst++, GRAPHICS_PATTERN_BYTE(pattern, byte_pos), 0xff, mode);
+    //body
+    if (len >= 32)
+    {
+        cur = len >> 5;
+        word = graphics_rotl(pattern, (byte_pos & 3) << 3);
+        graphics_fill_words((uint32_t*)dst, HTONL(word), cur, mode);
+        dst += cur << 2;
+        byte_pos += cur << 2;
+        len &= 31;
+    }
+    for (; len >= 8; len -= 8, ++byte_pos)
+        graphics_rop8(dst++, GRAPHICS_PATTERN_BYTE(pattern, byte_pos), 0xff, mode);
+    //tail
+    if (len)
+        graphics_rop8(dst, GRAPHICS_PATTERN_BYTE(pattern, byte_pos), ~(0xff >> len), mode);
+}
+
+//len (up to 8) bits of stream at bit position pos, MSB aligned
+static inline uint8_t graphics_fetch8(const uint8_t* src, unsigned int pos, unsigned int len)
+{
+    unsigned int bit_pos = pos & 7;
+    src += pos >> 3;
+    if (bit_pos + len <= 8)
+        return src[0] << bit_pos;
+    return (src[0] << bit_pos) | (src[1] >> (8 - bit_pos));
+}
+
+static inline uint32_t graphics_fetch32(const uint8_t* src, unsigned int pos)
+{
+    unsigned int bit_pos = pos & 7;
+    uint32_t res;
+    src += pos >> 3;
+    res = be2int(src);
+    if (bit_pos)
+        res = (res << bit_pos) | (src[4] >> (8 - bit_pos));
+    return res;
+}
+
+//copy len bits of stream src at bit position src_pos to pix at bit position pos with arbitrary alignment
+static void graphics_blit(uint8_t* pix, unsigned int pos, const uint8_t* src, unsigned int src_pos, unsigned int len, unsigned int mode)
+{
+    unsigned int bit_pos, cur;
+    uint32_t word;
+    const uint32_t* src_word;
+    uint8_t* dst;
+    bit_pos = pos & 7;
+    dst = pix + (pos >> 3);
+    //head
+    if (bit_pos)
+    {
+        cur = 8 - bit_pos;
+        if (cur > len)
+            cur = len;
+        graphics_rop8(dst++, graphics_fetch8(src, src_pos, cur) >> bit_pos, (0xff >> bit_pos) & ~(0xff >> (bit_pos + cur)), mode);
+        src_pos += cur;
+        len -= cur;
+    }
+    //align to word
+    for (; len >= 8 && ((unsigned int)dst & 3); len -= 8, src_pos += 8)
+        graphics_rop8(dst++, graphics_fetch8(src, src_pos, 8), 0xff, mode);
+    //body
+    if ((src_pos & 7) == 0 && ((unsigned int)(src + (src_pos >> 3)) & 3) == 0)
+    {
+        //source and destination are equally aligned
+        for (src_word = (const uint32_t*)(src + (src_pos >> 3)); len >= 32; len -= 32, src_pos += 32, dst += 4)
+            graphics_rop32((uint32_t*)dst, *src_word++, mode);
+    }
+    else
+    {
+        for (; len >= 32; len -= 32, src_pos += 32, dst += 4)
+        {
+            word = graphics_fetch32(src, src_pos);
+            graphics_rop32((uint32_t*)dst, HTONL(word), mode);
+        }
+    }
+    for (; len >= 8; len -= 8, src_pos += 8)
+        graphics_rop8(dst++, graphics_fetch8(src, src_pos, 8), 0xff, mode);
+    //tail
+    if (len)
+        graphics_rop8(dst, graphics_fetch8(src, src_pos, len), ~(0xff >> len), mode);
+}
+
+static void graphics_fill_rows(CANVAS* canvas, unsigned short left, unsigned short top, unsigned short width, unsigned short height,
+                               unsigned int color, unsigned int mode)
+{
+    POINT point;
+    unsigned int data, i, row;
+    unsigned short cur_width;
+    unsigned int ppi;
+    unsigned short bpp = canvas->bits_per_pixel;
+    if (GRAPHICS_SPAN_BPP(bpp))
+    {
+        data = graphics_pattern(color, bpp);
+        //canvas rows are not padded, full width rect is single span
+        if (left == 0 && width == canvas->width)
+        {
+            graphics_fill(GRAPHICS_PIX(canvas->data), top * canvas->width * bpp, width * height * bpp, data, mode);
+            return;
+        }
+        for (row = top; row < top + height; ++row)
+            graphics_fill(GRAPHICS_PIX(canvas->data), (row * canvas->width + left) * bpp, width * bpp, data, mode);
+        return;
+    }
+    //pattern is not fit in word, pixel by pixel
+    ppi = (sizeof(int) << 3) / bpp;
+    for (i = 0, data = 0; i < ppi; ++i)
+        data = (data << bpp) | (color & ((1 << bpp) - 1));
+    for (point.y = top; point.y < top + height; ++point.y)
+    {
+        for (point.x = left; point.x < left + width; point.x += cur_width)
+        {
+            cur_width = ppi;
+            if (point.x + cur_width > left + width)
+                cur_width = left + width - point.x;
+            graphics_canvas_write(canvas, mode, &point, data, cur_width * bpp);
+        }
+    }
+}
+
+static void graphics_invalidate(CANVAS* canvas, unsigned short left, unsigned short top, unsigned short width, unsigned short height)
+{
+    RECT rect;
+    rect.left = left;
+    rect.top = top;
+    rect.width = width;
+    rect.height = height;
+    canvas_invalidate(canvas, &rect);
+}
+
+static bool graphics_put_pixel(CANVAS* canvas, const POINT *point, unsigned int color)
 {
     if (point->x >= canvas->width || point->y >= canvas->height)
     {
         error(ERROR_OUT_OF_RANGE);
-        return;
+        return false;
     }
-    graphics_write(canvas->data, canvas->width, canvas->bits_per_pixel, point, color, canvas->bits_per_pixel);
+    if (GRAPHICS_SPAN_BPP(canvas->bits_per_pixel))
+        graphics_fill(GRAPHICS_PIX(canvas->data), (canvas->width * point->y + point->x) * canvas->bits_per_pixel, canvas->bits_per_pixel,
+                      graphics_pattern(color, canvas->bits_per_pixel), GUI_MODE_FILL);
+    else
+        graphics_write(canvas->data, canvas->width, canvas->bits_per_pixel, point, color, canvas->bits_per_pixel);
+    return true;
+}
+
+void put_pixel(CANVAS* canvas, const POINT *point, unsigned int color)
+{
+    if (graphics_put_pixel(canvas, point, color))
+        graphics_invalidate(canvas, point->x, point->y, 1, 1);
 }
 
 unsigned int get_pixel(CANVAS* canvas, const POINT* point)
@@ -79,6 +339,33 @@ unsigned int get_pixel(CANVAS* canvas, const POINT* point)
     return graphics_read(canvas->data, canvas->width, canvas->bits_per_pixel, point, canvas->bits_per_pixel);
 }
 
+void fill_span(CANVAS* canvas, const POINT* point, unsigned short width, unsigned int color, unsigned int mode)
+{
+    if (point->x >= canvas->width || point->y >= canvas->height)
+    {
+        error(ERROR_OUT_OF_RANGE);
+        return;
+    }
+    if (point->x + width > canvas->width)
+        width = canvas->width - point->x;
+    graphics_fill_rows(canvas, point->x, point->y, width, 1, color, mode);
+    graphics_invalidate(canvas, point->x, point->y, width, 1);
+}
+
+void blit_span(CANVAS* canvas, const POINT* point, unsigned short width, const uint8_t* data, unsigned int bit_offset, unsigned int mode)
+{
+    if (point->x >= canvas->width || point->y >= canvas->height)
+    {
+        error(ERROR_OUT_OF_RANGE);
+        return;
+    }
+    if (point->x + width > canvas->width)
+        width = canvas->width - point->x;
+    graphics_blit(GRAPHICS_PIX(canvas->data), (canvas->width * point->y + point->x) * canvas->bits_per_pixel, data, bit_offset,
+                  width * canvas->bits_per_pixel, mode);
+    graphics_invalidate(canvas, point->x, point->y, width, 1);
+}
+
 static void gswap(short* a, short* b)
 {
     short tmp;
@@ -92,11 +379,34 @@ static short gabs(short val)
     return val > 0 ? val : -val;
 }
 
+static void line_hspan(CANVAS* canvas, short x0, short x1, short y, unsigned int color)
+{
+    //some pixels are out of canvas
+    if ((unsigned short)y >= canvas->height)
+    {
+        error(ERROR_OUT_OF_RANGE);
+        return;
+    }
+    if (x0 < 0)
+    {
+        error(ERROR_OUT_OF_RANGE);
+        x0 = 0;
+    }
+    if (x1 >= canvas->width)
+    {
+        error(ERROR_OUT_OF_RANGE);
+        x1 = canvas->width - 1;
+    }
+    if (x0 > x1)
+        return;
+    graphics_fill_rows(canvas, x0, y, x1 - x0 + 1, 1, color, GUI_MODE_FILL);
+}
+
 void line(CANVAS* canvas, const POINT *a, const POINT *b, unsigned int color)
 {
     POINT cur;
     bool vline;
-    short x0, x1, y0, y1, dx, dy, err, ystep, x, y;
+    short x0, x1, y0, y1, dx, dy, err, ystep, x, y, run;
     x0 = a->x;
     y0 = a->y;
     x1 = b->x;
@@ -116,36 +426,33 @@ void line(CANVAS* canvas, const POINT *a, const POINT *b, unsigned int color)
     dy = gabs(y1 - y0);
     err = dx >> 1;
     ystep = (y0 < y1) ? 1 : -1;
-    for (x = x0, y = y0; x <= x1; ++x)
+    for (x = x0, y = y0, run = x0; x <= x1; ++x)
     {
+       err -= dy;
        if (vline)
        {
            cur.x = y;
            cur.y = x;
+           graphics_put_pixel(canvas, &cur, color);
        }
-       else
+       //horizontal pixels on same row are drawn as single span
+       else if (err < 0 || x == x1)
        {
-           cur.x = x;
-           cur.y = y;
+           line_hspan(canvas, run, x, y, color);
+           run = x + 1;
        }
-       put_pixel(canvas, &cur, color);
-       err -= dy;
        if (err < 0)
        {
            y += ystep;
            err += dx;
        }
     }
+    graphics_invalidate(canvas, a->x < b->x ? a->x : b->x, a->y < b->y ? a->y : b->y, gabs(b->x - a->x) + 1, gabs(b->y - a->y) + 1);
 }
 
 void filled_rect(CANVAS* canvas, const RECT* rect, unsigned int color, unsigned int mode)
 {
-    POINT point;
-    unsigned int data, i;
-    unsigned short width, height, cur_width;
-    unsigned int ppi = (sizeof(int) << 3) / canvas->bits_per_pixel;
-    for (i = 0, data = 0; i < ppi; ++i)
-        data = (data << canvas->bits_per_pixel) | (color & ((1 << canvas->bits_per_pixel) - 1));
+    unsigned short width, height;
     if (rect->left >= canvas->width || rect->top >= canvas->height)
     {
         error(ERROR_OUT_OF_RANGE);
@@ -157,24 +464,14 @@ void filled_rect(CANVAS* canvas, const RECT* rect, unsigned int color, unsigned
     height = rect->height;
     if (rect->top + height > canvas->height)
         height = canvas->height - rect->top;
-    for (point.y = rect->top; point.y < rect->top + height; ++point.y)
-    {
-        for (point.x = rect->left; point.x < rect->left + width; point.x += cur_width)
-        {
-            cur_width = ppi;
-            if (point.x + cur_width > rect->left + width)
-                cur_width = rect->left + width - point.x;
-            graphics_canvas_write(canvas, mode, &point, data, cur_width * canvas->bits_per_pixel);
-        }
-    }
+    graphics_fill_rows(canvas, rect->left, rect->top, width, height, color, mode);
+    graphics_invalidate(canvas, rect->left, rect->top, width, height);
 }
 
 void image(CANVAS* canvas, const RECT *rect, const RECT *data_rect, const uint8_t* pix, unsigned int mode)
 {
-    POINT point, data_point;
-    unsigned short width, height, cur_width;
-    unsigned int data;
-    unsigned int ppi = (sizeof(int) << 3) / canvas->bits_per_pixel;
+    unsigned short width, height, row;
+    unsigned short bpp = canvas->bits_per_pixel;
     if (rect->left >= canvas->width || rect->top >= canvas->height || data_rect->left >= data_rect->width || data_rect->top >= data_rect->height)
     {
         error(ERROR_OUT_OF_RANGE);
@@ -190,18 +487,103 @@ void image(CANVAS* canvas, const RECT *rect, const RECT *data_rect, const uint8_
         height = canvas->height - rect->top;
     if (data_rect->top + height > data_rect->height)
         height = data_rect->height - data_rect->top;
-    for (point.y = rect->top; point.y < rect->top + height; ++point.y)
+    for (row = 0; row < height; ++row)
+        graphics_blit(GRAPHICS_PIX(canvas->data), ((rect->top + row) * canvas->width + rect->left) * bpp,
+                      GRAPHICS_PIX(pix), ((data_rect->top + row) * data_rect->width + data_rect->left) * bpp, width * bpp, mode);
+    graphics_invalidate(canvas, rect->left, rect->top, width, height);
+}
+
+void image_rle(CANVAS* canvas, const POINT* point, const uint8_t* rle, unsigned int mode)
+{
+    const uint8_t* data;
+    unsigned short width, height, bpp, visible_width, visible_height, x, y;
+    unsigned int len, cur, rows, color, bit_pos, i;
+    uint8_t ctrl;
+    if (point->x >= canvas->width || point->y >= canvas->height)
     {
-        for (point.x = rect->left; point.x < rect->left + width; point.x += cur_width)
+        error(ERROR_OUT_OF_RANGE);
+        return;
+    }
+    width = be2short(rle);
+    height = be2short(rle + 2);
+    bpp = rle[4];
+    //empty image is malformed, run can't be splitted by rows
+    if (width == 0 || height == 0 || bpp != canvas->bits_per_pixel)
+    {
+        error(ERROR_INVALID_PARAMS);
+        return;
+    }
+    visible_width = width;
+    if (point->x + visible_width > canvas->width)
+        visible_width = canvas->width - point->x;
+    visible_height = height;
+    if (point->y + visible_height > canvas->height)
+        visible_height = canvas->height - point->y;
+    rle += RLE_HEADER_SIZE;
+    for (x = y = 0; y < visible_height; )
+    {
+        ctrl = *rle++;
+        len = ctrl & RLE_LEN_MASK;
+        if (ctrl & RLE_LONG)
+            len = (len << 8) | *rle++;
+        ++len;
+        data = rle;
+        color = 0;
+        switch (ctrl & RLE_TYPE_MASK)
         {
-            cur_width = ppi;
-            if (point.x + cur_width > rect->left + width)
-                cur_width = rect->left + width - point.x;
-            data_point.x = point.x - rect->left + data_rect->left;
-            data_point.y = point.y - rect->top + data_rect->top;
-            data = graphics_read(pix, data_rect->width, canvas->bits_per_pixel, &data_point, cur_width * canvas->bits_per_pixel);
-            graphics_canvas_write(canvas, mode, &point, data, cur_width * canvas->bits_per_pixel);
+        case RLE_FILL:
+            for (i = 0; i < ((bpp + 7) >> 3); ++i)
+                color = (color << 8) | *rle++;
+            break;
+        case RLE_LITERAL:
+            rle += (len * bpp + 7) >> 3;
+            break;
+        default:
+            break;
+        }
+        //pixels are decoded right to canvas, run is splitted by rows
+        for (bit_pos = 0; len && y < visible_height; len -= cur, bit_pos += cur * bpp)
+        {
+            //solid runs over whole rows are filled as single rect
+            if (x == 0 && len >= width && (ctrl & RLE_TYPE_MASK) != RLE_LITERAL)
+            {
+                rows = len / width;
+                if (rows > visible_height - y)
+                    rows = visible_height - y;
+                if ((ctrl & RLE_TYPE_MASK) == RLE_FILL)
+                    graphics_fill_rows(canvas, point->x, point->y + y, visible_width, rows, color, mode);
+                cur = rows * width;
+                y += rows;
+                continue;
+            }
+            cur = width - x;
+            if (cur > len)
+                cur = len;
+            if (x < visible_width)
+            {
+                i = cur;
+                if (x + i > visible_width)
+                    i = visible_width - x;
+                switch (ctrl & RLE_TYPE_MASK)
+                {
+                case RLE_FILL:
+                    graphics_fill_rows(canvas, point->x + x, point->y + y, i, 1, color, mode);
+                    break;
+                case RLE_LITERAL:
+                    graphics_blit(GRAPHICS_PIX(canvas->data), ((point->y + y) * canvas->width + point->x + x) * bpp, data, bit_pos, i * bpp, mode);
+                    break;
+                default:
+                    //transparent
+                    break;
+                }
+            }
+            x += cur;
+            if (x == width)
+            {
+                x = 0;
+                ++y;
+            }
         }
     }
+    graphics_invalidate(canvas, point->x, point->y, visible_width, visible_height);
 }
-
@@ -13,19 +13,31 @@
 #define GUI_MODE_XOR                        0x1
 #define GUI_MODE_AND                        0x2
 #define GUI_MODE_FILL                       0x3
+#define GUI_MODE_INVERT                     0x4
 
-typedef struct {
-    unsigned short x, y;
-} POINT;
-
-typedef struct {
-    unsigned short left, top, width, height;
-} RECT;
+/*
+    RLE image: header - width (BE16), height (BE16), bpp (8), followed by packets.
+    Packet is control byte with type and length - 1 (5 bits, or 13 bits with RLE_LONG and next byte),
+    followed by color (fill, (bpp + 7) / 8 bytes BE) or pixel stream (literal, padded to byte).
+    Runs are continued over the rows.
+*/
+#define RLE_HEADER_SIZE                     5
+#define RLE_LITERAL                         (0 << 6)
+#define RLE_FILL                            (1 << 6)
+#define RLE_SKIP                            (2 << 6)
+#define RLE_TYPE_MASK                       (3 << 6)
+#define RLE_LONG                            (1 << 5)
+#define RLE_LEN_MASK                        0x1f
+#define RLE_RUN_MAX                         0x2000
 
 void put_pixel(CANVAS* canvas, const POINT* point, unsigned int color);
 unsigned int get_pixel(CANVAS* canvas, const POINT* point);
 void line(CANVAS* canvas, const POINT* a, const POINT* b, unsigned int color);
 void filled_rect(CANVAS* canvas, const RECT *rect, unsigned int color, unsigned int mode);
 void image(CANVAS* canvas, const RECT* rect, const RECT* data_rect, const uint8_t* pix, unsigned int mode);
+void image_rle(CANVAS* canvas, const POINT* point, const uint8_t* rle, unsigned int mode);
+//span raster. Data for blit is raw pixel stream, MSB first, starting from bit offset
+void fill_span(CANVAS* canvas, const POINT* point, unsigned short width, unsigned int color, unsigned int mode);
+void blit_span(CANVAS* canvas, const POINT* point, unsigned short width, const uint8_t* data, unsigned int bit_offset, unsigned int mode);
 
 #endif // GRAPHICS_H
@@ -6,6 +6,8 @@
 
 #include "ip.h"
 #include "stdio.h"
+#include "endian.h"
+#include <string.h>
 
 void ip_print(const IP* ip)
 {
@@ -18,18 +20,148 @@ void ip_print(const IP* ip)
     }
 }
 
-uint16_t ip_checksum(void* buf, unsigned int size)
+typedef union {
+    uint8_t u8[2];
+    uint16_t u16;
+} IP_SUM_WORD;
+
+//end around carry
+static uint16_t ip_fold(uint64_t sum)
+{
+    uint32_t res;
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    res = (uint32_t)sum + (uint32_t)(sum >> 32);
+    res = (res & 0xffff) + (res >> 16);
+    return (uint16_t)((res & 0xffff) + (res >> 16));
+}
+
+//folded native sum to big-endian
+static uint16_t ip_native_be(uint64_t sum)
+{
+    IP_SUM_WORD res;
+    res.u16 = ip_fold(sum);
+    return be2short(res.u8);
+}
+
+//native sum of 16 bit aligned buffer. 32 bit loads, unrolled
+static uint64_t ip_sum_aligned(const uint8_t* buf, unsigned int size)
 {
-    unsigned int i;
-    uint32_t sum = 0;
-    for (i = 0; i < (size >> 1); ++i)
-        sum += (((uint8_t*)buf)[i << 1] << 8) | (((uint8_t*)buf)[(i << 1) + 1]);
+    const uint32_t* buf32;
+    uint64_t sum = 0;
+    IP_SUM_WORD pad;
+    if (((unsigned int)buf & 2) && size >= 2)
+    {
+        sum += *(const uint16_t*)buf;
+        buf += 2;
+        size -= 2;
+    }
+    for (buf32 = (const uint32_t*)buf; size >= 16; size -= 16, buf32 += 4)
+        sum += (uint64_t)buf32[0] + buf32[1] + buf32[2] + buf32[3];
+    for (; size >= 4; size -= 4)
+        sum += *buf32++;
+    buf = (const uint8_t*)buf32;
+    if (size >= 2)
+    {
+        sum += *(const uint16_t*)buf;
+        buf += 2;
+        size -= 2;
+    }
     //padding zero
-    if (size & 1)
-        sum += ((uint8_t*)buf)[size - 1] << 8;
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
-    return ~((uint16_t)sum);
+    if (size)
+    {
+        pad.u8[0] = *buf;
+        pad.u8[1] = 0;
+        sum += pad.u16;
+    }
+    return sum;
+}
+
+uint16_t ip_sum_add(uint16_t sum, uint16_t part, unsigned int offset)
+{
+    uint32_t res;
+    //block started at odd offset has swapped bytes
+    if (offset & 1)
+        part = (part << 8) | (part >> 8);
+    res = (uint32_t)sum + part;
+    return (uint16_t)((res & 0xffff) + (res >> 16));
+}
+
+uint16_t ip_sum(const void* buf, unsigned int size, uint16_t sum)
+{
+    const uint8_t* ptr = buf;
+    if (size == 0)
+        return sum;
+    //odd address: leading byte is high, rest is on odd offset
+    if ((unsigned int)ptr & 1)
+    {
+        sum = ip_sum_add(sum, ptr[0] << 8, 0);
+        return ip_sum_add(sum, ip_native_be(ip_sum_aligned(ptr + 1, size - 1)), 1);
+    }
+    return ip_sum_add(sum, ip_native_be(ip_sum_aligned(ptr, size)), 0);
+}
+
+uint16_t ip_copy_sum(void* dst, const void* src, unsigned int size, uint16_t sum)
+{
+    unsigned int lead, tail;
+    uint32_t* dst32;
+    const uint32_t* src32;
+    uint64_t acc = 0;
+    //can't align both
+    if (((unsigned int)dst ^ (unsigned int)src) & 3)
+    {
+        memcpy(dst, src, size);
+        return ip_sum(dst, size, sum);
+    }
+    lead = (4 - ((unsigned int)src & 3)) & 3;
+    if (lead > size)
+        lead = size;
+    memcpy(dst, src, lead);
+    sum = ip_sum(src, lead, sum);
+    dst32 = (uint32_t*)((uint8_t*)dst + lead);
+    src32 = (const uint32_t*)((const uint8_t*)src + lead);
+    for (size -= lead; size >= 16; size -= 16, dst32 += 4, src32 += 4)
+    {
+        dst32[0] = src32[0];
+        dst32[1] = src32[1];
+        dst32[2] = src32[2];
+        dst32[3] = src32[3];
+        acc += (uint64_t)src32[0] + src32[1] + src32[2] + src32[3];
+    }
+    for (; size >= 4; size -= 4)
+    {
+        acc += *src32;
+        *dst32++ = *src32++;
+    }
+    sum = ip_sum_add(sum, ip_native_be(acc), lead);
+    tail = size;
+    memcpy(dst32, src32, tail);
+    return ip_sum_add(sum, ip_sum(src32, tail, 0), lead);
+}
+
+uint16_t ip_pseudo_sum(const IP* src, const IP* dst, uint8_t proto, uint16_t size)
+{
+    uint16_t sum = ip_sum(src->u8, sizeof(IP), 0);
+    sum = ip_sum(dst->u8, sizeof(IP), sum);
+    sum = ip_sum_add(sum, proto, 0);
+    return ip_sum_add(sum, size, 0);
+}
+
+uint16_t ip_checksum(void* buf, unsigned int size)
+{
+    return (uint16_t)~ip_sum(buf, size, 0);
+}
+
+uint16_t ip_checksum_update(uint16_t checksum, uint16_t old_value, uint16_t new_value)
+{
+    //RFC 1624: HC' = ~(~HC + ~m + m')
+    uint16_t sum = ip_sum_add((uint16_t)~checksum, (uint16_t)~old_value, 0);
+    return (uint16_t)~ip_sum_add(sum, new_value, 0);
+}
+
+uint16_t ip_checksum_update32(uint16_t checksum, uint32_t old_value, uint32_t new_value)
+{
+    checksum = ip_checksum_update(checksum, old_value >> 16, new_value >> 16);
+    return ip_checksum_update(checksum, old_value & 0xffff, new_value & 0xffff);
 }
 
 bool ip_compare(const IP* ip1, const IP* ip2, const IP* mask)
@@ -56,3 +188,18 @@ void ip_disable_firewall(HANDLE tcpip)
 {
     ack(tcpip, HAL_REQ(HAL_IP, IP_DISABLE_FIREWALL), 0, 0, 0);
 }
+
+bool ip_add_route(HANDLE tcpip, const IP* dst, unsigned int prefix_len, const IP* gateway, unsigned int metric)
+{
+    return get_handle(tcpip, HAL_REQ(HAL_IP, IP_ADD_ROUTE), dst->u32.ip, gateway->u32.ip, (metric << 8) | prefix_len) != INVALID_HANDLE;
+}
+
+bool ip_remove_route(HANDLE tcpip, const IP* dst, unsigned int prefix_len, const IP* gateway)
+{
+    return get_handle(tcpip, HAL_REQ(HAL_IP, IP_REMOVE_ROUTE), dst->u32.ip, gateway->u32.ip, prefix_len) != INVALID_HANDLE;
+}
+
+void ip_flush_routes(HANDLE tcpip)
+{
+    ack(tcpip, HAL_REQ(HAL_IP, IP_FLUSH_ROUTES), 0, 0, 0);
+}
@@ -222,15 +222,34 @@ typedef enum {
     IP_UP,
     IP_DOWN,
     IP_ENABLE_FIREWALL,
-    IP_DISABLE_FIREWALL
+    IP_DISABLE_FIREWALL,
+    IP_ADD_ROUTE,
+    IP_REMOVE_ROUTE,
+    IP_FLUSH_ROUTES
 }IP_IPCS;
 
 void ip_print(const IP* ip);
+//one's complement sum of big-endian words, not inverted. Chained from sum, buf starts at even offset of checksummed data
+uint16_t ip_sum(const void* buf, unsigned int size, uint16_t sum);
+//same while copying, single pass if dst and src are equally aligned
+uint16_t ip_copy_sum(void* dst, const void* src, unsigned int size, uint16_t sum);
+//add partial sum of block started at offset of checksummed data
+uint16_t ip_sum_add(uint16_t sum, uint16_t part, unsigned int offset);
+//TCP/UDP pseudo header
+uint16_t ip_pseudo_sum(const IP* src, const IP* dst, uint8_t proto, uint16_t size);
 uint16_t ip_checksum(void *buf, unsigned int size);
+//RFC 1624 incremental update of checksum on header field change
+uint16_t ip_checksum_update(uint16_t checksum, uint16_t old_value, uint16_t new_value);
+uint16_t ip_checksum_update32(uint16_t checksum, uint32_t old_value, uint32_t new_value);
 bool ip_compare(const IP* ip1, const IP* ip2, const IP* mask);
 void ip_set(HANDLE tcpip, const IP* ip);
 void ip_get(HANDLE tcpip, IP* ip);
 void ip_enable_firewall(HANDLE tcpip, const IP* src, const IP* mask);
 void ip_disable_firewall(HANDLE tcpip);
+//route to dst/prefix_len via gateway. Zero gateway is on-link. Lower metric is preferred on same prefix
+bool ip_add_route(HANDLE tcpip, const IP* dst, unsigned int prefix_len, const IP* gateway, unsigned int metric);
+//zero gateway removes routes via any gateway
+bool ip_remove_route(HANDLE tcpip, const IP* dst, unsigned int prefix_len, const IP* gateway);
+void ip_flush_routes(HANDLE tcpip);
 
 #endif // IP_H
@@ -6,38 +6,12 @@
 
 #include "tcp.h"
 #include "endian.h"
-
-#pragma pack(push, 1)
-typedef struct {
-    IP src;
-    IP dst;
-    uint8_t zero;
-    uint8_t ptcl;
-    uint8_t length_be[2];
-} TCP_PSEUDO_HEADER;
-#pragma pack(pop)
+#include "process.h"
+#include "error.h"
 
 uint16_t tcp_checksum(void* buf, unsigned int size, const IP* src, const IP* dst)
 {
-    TCP_PSEUDO_HEADER tph;
-    unsigned int i;
-    uint32_t sum = 0;
-    tph.src.u32.ip = src->u32.ip;
-    tph.dst.u32.ip = dst->u32.ip;
-    tph.zero = 0;
-    tph.ptcl = PROTO_TCP;
-    short2be(tph.length_be, size);
-
-    for (i = 0; i < (sizeof(TCP_PSEUDO_HEADER) >> 1); ++i)
-        sum += (((uint8_t*)&tph)[i << 1] << 8) | (((uint8_t*)&tph)[(i << 1) + 1]);
-    for (i = 0; i < (size >> 1); ++i)
-        sum += (((uint8_t*)buf)[i << 1] << 8) | (((uint8_t*)buf)[(i << 1) + 1]);
-    //padding zero
-    if (size & 1)
-        sum += ((uint8_t*)buf)[size - 1] << 8;
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
-    return ~((uint16_t)sum);
+    return (uint16_t)~ip_sum(buf, size, ip_pseudo_sum(src, dst, PROTO_TCP, size));
 }
 
 void tcp_get_remote_addr(HANDLE tcpip, HANDLE handle, IP* ip)
@@ -55,6 +29,43 @@ uint16_t tcp_get_local_port(HANDLE tcpip, HANDLE handle)
     return get(tcpip, HAL_REQ(HAL_TCP, TCP_GET_LOCAL_PORT), handle, 0, 0);
 }
 
+void tcp_get_rtt_stat(HANDLE tcpip, HANDLE handle, TCP_RTT_STAT* stat)
+{
+    IPC ipc;
+    ipc.cmd = HAL_REQ(HAL_TCP, TCP_GET_RTT);
+    ipc.process = tcpip;
+    ipc.param1 = handle;
+    call(&ipc);
+    stat->srtt = ipc.param2;
+    stat->rttvar = ipc.param3;
+    ipc.cmd = HAL_REQ(HAL_TCP, TCP_GET_RTO);
+    ipc.process = tcpip;
+    ipc.param1 = handle;
+    call(&ipc);
+    stat->rto = ipc.param2;
+    stat->retransmits = ipc.param3;
+}
+
+void tcp_set_options(HANDLE tcpip, HANDLE handle, unsigned int options)
+{
+    ack(tcpip, HAL_REQ(HAL_TCP, TCP_SET_OPTIONS), handle, options, 0);
+}
+
+unsigned int tcp_get_options(HANDLE tcpip, HANDLE handle)
+{
+    return get(tcpip, HAL_REQ(HAL_TCP, TCP_GET_OPTIONS), handle, 0, 0);
+}
+
+void tcp_set_keep_alive(HANDLE tcpip, HANDLE handle, unsigned int idle_s, unsigned int interval_s, unsigned int count)
+{
+    ack(tcpip, HAL_REQ(HAL_TCP, TCP_SET_KEEP_ALIVE), handle, idle_s, (interval_s << 16) | (count & 0xff));
+}
+
+void tcp_set_user_timeout(HANDLE tcpip, HANDLE handle, unsigned int ms)
+{
+    ack(tcpip, HAL_REQ(HAL_TCP, TCP_SET_USER_TIMEOUT), handle, ms, 0);
+}
+
 HANDLE tcp_listen(HANDLE tcpip, unsigned short port)
 {
     return get_handle(tcpip, HAL_REQ(HAL_TCP, TCP_LISTEN), port, 0, 0);
@@ -65,6 +76,18 @@ void tcp_close_listen(HANDLE tcpip, HANDLE handle)
     ack(tcpip, HAL_REQ(HAL_TCP, TCP_CLOSE_LISTEN), handle, 0, 0);
 }
 
+void tcp_get_listen_stat(HANDLE tcpip, HANDLE handle, TCP_LISTEN_STAT* stat)
+{
+    IPC ipc;
+    ipc.cmd = HAL_REQ(HAL_TCP, TCP_GET_LISTEN_STAT);
+    ipc.process = tcpip;
+    ipc.param1 = handle;
+    call(&ipc);
+    stat->backlog = ipc.param2;
+    stat->drops = ipc.param3;
+    stat->cookies = get(tcpip, HAL_REQ(HAL_TCP, TCP_GET_LISTEN_COOKIES), handle, 0, 0);
+}
+
 HANDLE tcp_create_tcb(HANDLE tcpip, const IP* remote_addr, uint16_t remote_port)
 {
     return get_handle(tcpip, HAL_REQ(HAL_TCP, TCP_CREATE_TCB), remote_port, remote_addr->u32.ip, 0);
@@ -84,3 +107,23 @@ void tcp_flush(HANDLE tcpip, HANDLE handle)
 {
     ack(tcpip, HAL_REQ(HAL_TCP, IPC_FLUSH), handle, 0, 0);
 }
+
+IO* tcp_get_frame(HANDLE tcpip, HANDLE handle)
+{
+    IPC ipc;
+    ipc.cmd = HAL_REQ(HAL_TCP, TCP_GET_FRAME);
+    ipc.process = tcpip;
+    ipc.param1 = handle;
+    call(&ipc);
+    if ((int)ipc.param3 < 0)
+    {
+        error(ipc.param3);
+        return NULL;
+    }
+    return (IO*)ipc.param2;
+}
+
+void tcp_release_frame(HANDLE tcpip, HANDLE handle, IO* io)
+{
+    ipc_post_inline(tcpip, HAL_CMD(HAL_TCP, TCP_RELEASE_FRAME), handle, (unsigned int)io, 0);
+}
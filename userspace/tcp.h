@@ -15,6 +15,13 @@
 #define TCP_PSH                     (1 << 0)
 #define TCP_URG                     (1 << 1)
 
+//per connection options
+#define TCP_OPTION_QUICK_ACK        (1 << 0)
+//disable Nagle algorithm
+#define TCP_OPTION_NO_DELAY         (1 << 1)
+//receive frames with tcp_get_frame() instead of copying to user IO
+#define TCP_OPTION_ZERO_COPY        (1 << 2)
+
 typedef struct {
     uint16_t flags;
     uint16_t urg_len;
@@ -26,17 +33,49 @@ typedef enum {
     TCP_CREATE_TCB,
     TCP_GET_REMOTE_ADDR,
     TCP_GET_REMOTE_PORT,
-    TCP_GET_LOCAL_PORT
+    TCP_GET_LOCAL_PORT,
+    TCP_GET_RTT,
+    TCP_GET_RTO,
+    TCP_SET_OPTIONS,
+    TCP_GET_OPTIONS,
+    TCP_GET_FRAME,
+    TCP_RELEASE_FRAME,
+    TCP_GET_LISTEN_STAT,
+    TCP_GET_LISTEN_COOKIES,
+    TCP_SET_KEEP_ALIVE,
+    TCP_SET_USER_TIMEOUT
 }TCP_IPCS;
 
+typedef struct {
+    //ms
+    unsigned int srtt, rttvar, rto;
+    unsigned int retransmits;
+} TCP_RTT_STAT;
+
+typedef struct {
+    //half-open connections in SYN queue
+    unsigned int backlog;
+    //SYN answered with cookie on full queue
+    unsigned int cookies;
+    //SYN dropped on full queue or connection not accepted on TCB limit
+    unsigned int drops;
+} TCP_LISTEN_STAT;
+
 uint16_t tcp_checksum(void* buf, unsigned int size, const IP* src, const IP* dst);
 
 void tcp_get_remote_addr(HANDLE tcpip, HANDLE handle, IP* ip);
 uint16_t tcp_get_remote_port(HANDLE tcpip, HANDLE handle);
 uint16_t tcp_get_local_port(HANDLE tcpip, HANDLE handle);
+void tcp_get_rtt_stat(HANDLE tcpip, HANDLE handle, TCP_RTT_STAT* stat);
+void tcp_set_options(HANDLE tcpip, HANDLE handle, unsigned int options);
+unsigned int tcp_get_options(HANDLE tcpip, HANDLE handle);
+//dead peer is reported with ERROR_CONNECTION_TIMEOUT. idle 0 - disable keep-alive
+void tcp_set_keep_alive(HANDLE tcpip, HANDLE handle, unsigned int idle_s, unsigned int interval_s, unsigned int count);
+void tcp_set_user_timeout(HANDLE tcpip, HANDLE handle, unsigned int ms);
 
 HANDLE tcp_listen(HANDLE tcpip, unsigned short port);
 void tcp_close_listen(HANDLE tcpip, HANDLE handle);
+void tcp_get_listen_stat(HANDLE tcpip, HANDLE handle, TCP_LISTEN_STAT* stat);
 
 HANDLE tcp_create_tcb(HANDLE tcpip, const IP* remote_addr, uint16_t remote_port);
 bool tcp_open(HANDLE tcpip, HANDLE handle);
@@ -49,4 +88,10 @@ void tcp_close(HANDLE tcpip, HANDLE handle);
 
 void tcp_flush(HANDLE tcpip, HANDLE handle);
 
+//zero-copy receive. Frame data is payload only, frame must be returned with tcp_release_frame() as soon as possible.
+//Async reply is HAL_CMD(HAL_TCP, TCP_GET_FRAME): param2 - frame, param3 - size or error
+IO* tcp_get_frame(HANDLE tcpip, HANDLE handle);
+#define tcp_get_frame_async(tcpip, handle)                          ipc_post_inline((tcpip), HAL_REQ(HAL_TCP, TCP_GET_FRAME), (handle), 0, 0)
+void tcp_release_frame(HANDLE tcpip, HANDLE handle, IO* io);
+
 #endif // TCP_H
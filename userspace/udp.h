@@ -9,8 +9,13 @@
 
 #include "ip.h"
 #include "io.h"
+#include "ipc.h"
 #include <stdint.h>
 
+//per socket options
+//read completes with all queued datagrams that fit in IO. Each one is UDP_RECORD, followed by data, aligned to 4 bytes
+#define UDP_OPTION_MULTI_READ       (1 << 0)
+
 #pragma pack(push, 1)
 
 typedef struct {
@@ -18,12 +23,27 @@ typedef struct {
     uint16_t remote_port;
 } UDP_STACK;
 
+typedef struct {
+    UDP_STACK stack;
+    //data size, following record
+    uint16_t size;
+} UDP_RECORD;
+
 #pragma pack(pop)
 
+typedef enum {
+    UDP_SET_OPTIONS = IPC_USER,
+    UDP_GET_OPTIONS
+} UDP_IPCS;
+
+#define UDP_RECORD_SIZE(size)       ((sizeof(UDP_RECORD) + (size) + 3) & ~3)
+
 uint16_t udp_checksum(void* buf, unsigned int size, const IP* src, const IP* dst);
 HANDLE udp_listen(HANDLE tcpip, unsigned short port);
 HANDLE udp_connect(HANDLE tcpip, unsigned short port, const IP* remote_addr);
 void udp_close_connect(HANDLE tcpip, HANDLE handle);
+void udp_set_options(HANDLE tcpip, HANDLE handle, unsigned int options);
+unsigned int udp_get_options(HANDLE tcpip, HANDLE handle);
 #define udp_read(tcpip, handle, io, size)                           io_read((tcpip), HAL_IO_REQ(HAL_UDP, IPC_READ), (handle), (io), (size))
 #define udp_read_sync(tcpip, handle, io, size)                      io_read_sync((tcpip), HAL_IO_REQ(HAL_UDP, IPC_READ), (handle), (io), (size))
 